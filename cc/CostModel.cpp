@@ -0,0 +1,367 @@
+/*
+  CostModel.cpp
+
+  Static cost estimation of statements (impl).
+
+*/
+
+#include "CostModel.hpp"
+#include "clang/AST/RecursiveASTVisitor.h"
+
+#include <unordered_set>
+
+using namespace clang;
+
+
+
+namespace {
+// Check whether a variable is modified in a statement
+class ModifyFinder : public RecursiveASTVisitor<ModifyFinder> {
+public:
+	ModifyFinder(const VarDecl* V)
+	: VD(V), Modified(false) { }
+
+	bool VisitBinaryOperator(BinaryOperator* BO) {
+		if (BO->isAssignmentOp() && Refers(BO->getLHS()))
+			Modified = true;
+		return !Modified;
+		}
+
+	bool VisitUnaryOperator(UnaryOperator* UO) {
+		if ((UO->isIncrementDecrementOp() || UO->getOpcode() == UO_AddrOf) &&
+		    Refers(UO->getSubExpr()))
+			Modified = true;
+		return !Modified;
+		}
+
+	bool Refers(const Expr* E) const {
+		auto* DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+		return (DRE != nullptr && DRE->getDecl() == VD);
+		}
+
+	bool isModified() const { return Modified; }
+
+private:
+	const VarDecl* VD;
+	bool Modified;
+
+	};
+
+const VarDecl* GetVarDecl(const Expr* E) {
+	if (E == nullptr)
+		return nullptr;
+	auto* DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+	return (DRE != nullptr) ? dyn_cast<VarDecl>(DRE->getDecl()) : nullptr;
+	}
+
+std::optional<int64_t> Evaluate(const Expr* E, ASTContext& AC) {
+	llvm::APSInt Result;
+	if (E == nullptr || !E->EvaluateAsInt(Result, AC))
+		return std::nullopt;
+	return Result.getExtValue();
+	}
+}
+
+
+
+CostTable CostTable::Get(device_class D) {
+
+	CostTable CT;
+
+	switch (D) {
+	case device_class::GPU:
+		break;
+
+	// Caches hide most of the memory latency, and vector operations are mapped
+	// to SIMD instructions
+	case device_class::CPU:
+		CT.IntDiv = 24;
+		CT.FloatDiv = 12;
+		CT.Transcendental = 24;
+		CT.GlobalMem = 4;
+		CT.LocalMem = 4;
+		CT.Atomic = 24;
+		CT.Call = 4;
+		CT.ScaleByVecWidth = false;
+		break;
+		}
+
+	return CT;
+
+	}
+
+unsigned CostModel::CostOf(const Stmt* S) const {
+
+	if (S == nullptr)
+		return 0;
+
+	// Free stuff
+	if (isa<ParenExpr>(S) || isa<ImplicitCastExpr>(S) || isa<DeclRefExpr>(S) ||
+	    isa<IntegerLiteral>(S) || isa<FloatingLiteral>(S) ||
+	    isa<CharacterLiteral>(S) || isa<StringLiteral>(S) ||
+	    isa<CompoundStmt>(S) || isa<NullStmt>(S) || isa<DeclStmt>(S) ||
+	    isa<UnaryExprOrTypeTraitExpr>(S))
+		return 0;
+
+	// Memory accesses
+	if (auto* ASE = dyn_cast<ArraySubscriptExpr>(S))
+		return MemCost(ASE->getBase()->getType()->getPointeeType());
+
+	if (auto* ME = dyn_cast<MemberExpr>(S))
+		return ME->isArrow()
+		       ? MemCost(ME->getBase()->getType()->getPointeeType()) : 0;
+
+	if (auto* UO = dyn_cast<UnaryOperator>(S)) {
+		switch (UO->getOpcode()) {
+		case UO_Deref:
+			return MemCost(UO->getSubExpr()->getType()->getPointeeType());
+		case UO_AddrOf:
+		case UO_Plus:
+			return 0;
+		default:
+			return Scale(Table.Arith, UO->getType());
+			}
+		}
+
+	if (auto* BO = dyn_cast<BinaryOperator>(S)) {
+		switch (BO->getOpcode()) {
+		case BO_Assign:
+		case BO_Comma:
+			return 0;
+		case BO_Div:
+		case BO_Rem:
+		case BO_DivAssign:
+		case BO_RemAssign: {
+				QualType QT = BO->getType();
+				const Type* ElemT = QT->isVectorType()
+				                    ? QT->getAs<VectorType>()->getElementType().getTypePtr()
+				                    : QT.getTypePtr();
+				return Scale(ElemT->isIntegerType() ? Table.IntDiv : Table.FloatDiv,
+				             QT);
+				}
+		case BO_LAnd:
+		case BO_LOr:
+			return Table.Branch;
+		default:
+			return Scale(Table.Arith, BO->getType());
+			}
+		}
+
+	if (isa<ConditionalOperator>(S))
+		return Table.Branch;
+
+	if (auto* CE = dyn_cast<CallExpr>(S)) {
+
+		const FunctionDecl* FD = CE->getDirectCallee();
+
+		if (FD == nullptr)
+			return Table.Call;
+
+		static const std::unordered_set<std::string> TranscendentalSet = {
+				"sin", "cos", "tan", "asin", "acos", "atan", "atan2", "sinh", "cosh",
+				"tanh", "asinh", "acosh", "atanh", "sincos", "sinpi", "cospi",
+				"tanpi", "exp", "exp2", "exp10", "expm1", "log", "log2", "log10",
+				"log1p", "pow", "pown", "powr", "rootn", "sqrt", "rsqrt", "cbrt",
+				"erf", "erfc", "tgamma", "lgamma", "hypot", "fmod", "remainder"};
+
+		std::string Name = FD->getNameInfo().getName().getAsString();
+
+		if (Name.compare(0, 7, "atomic_") == 0 || Name.compare(0, 5, "atom_") == 0)
+			return Table.Atomic;
+
+		// native_* and half_* are cheap approximations
+		if (Name.compare(0, 7, "native_") == 0 || Name.compare(0, 5, "half_") == 0)
+			return Scale(Table.Arith * 4, CE->getType());
+
+		if (TranscendentalSet.find(Name) != TranscendentalSet.end())
+			return Scale(Table.Transcendental, CE->getType());
+
+		if (Name.compare(0, 5, "vload") == 0 && CE->getNumArgs() == 2)
+			return MemCost(CE->getArg(1)->getType()->getPointeeType());
+
+		if (Name.compare(0, 6, "vstore") == 0 && CE->getNumArgs() == 3)
+			return MemCost(CE->getArg(2)->getType()->getPointeeType());
+
+		return Table.Call;
+
+		}
+
+	// Control flow
+	if (isa<IfStmt>(S) || isa<ForStmt>(S) || isa<WhileStmt>(S) ||
+	    isa<DoStmt>(S) || isa<ReturnStmt>(S) || isa<BreakStmt>(S) ||
+	    isa<ContinueStmt>(S) || isa<GotoStmt>(S))
+		return Table.Branch;
+
+	if (auto* E = dyn_cast<Expr>(S))
+		return Scale(Table.Arith, E->getType());
+
+	return Table.Arith;
+
+	}
+
+std::optional<uint64_t> CostModel::TripCount(const Stmt* Loop,
+                                              ASTContext& AC) {
+
+	auto IsFalse = [&AC](const Expr* Cond) -> bool {
+		bool Result;
+		return (Cond != nullptr && Cond->isEvaluatable(AC) &&
+		        Cond->EvaluateAsBooleanCondition(Result, AC) && !Result);
+		};
+
+	if (auto* WS = dyn_cast_or_null<WhileStmt>(Loop))
+		return IsFalse(WS->getCond()) ? std::optional<uint64_t>(0) : std::nullopt;
+
+	if (auto* DS = dyn_cast_or_null<DoStmt>(Loop))
+		return IsFalse(DS->getCond()) ? std::optional<uint64_t>(1) : std::nullopt;
+
+	auto* FS = dyn_cast_or_null<ForStmt>(Loop);
+
+	if (FS == nullptr)
+		return std::nullopt;
+
+	if (IsFalse(FS->getCond()))
+		return 0;
+
+	// Only handle the canonical form:
+	//   for (IV = Init; IV op Bound; IV += Step)
+	const VarDecl* IV = nullptr;
+	std::optional<int64_t> Init;
+
+	if (auto* DS = dyn_cast_or_null<DeclStmt>(FS->getInit());
+	    DS != nullptr && DS->isSingleDecl()) {
+		IV = dyn_cast<VarDecl>(DS->getSingleDecl());
+		if (IV != nullptr)
+			Init = Evaluate(IV->getInit(), AC);
+		}
+	else if (auto* BO = dyn_cast_or_null<BinaryOperator>(FS->getInit());
+	         BO != nullptr && BO->getOpcode() == BO_Assign) {
+		IV = GetVarDecl(BO->getLHS());
+		Init = Evaluate(BO->getRHS(), AC);
+		}
+
+	if (IV == nullptr || !Init || !IV->getType()->isIntegerType())
+		return std::nullopt;
+
+	std::optional<int64_t> Step;
+
+	if (auto* UO = dyn_cast_or_null<UnaryOperator>(FS->getInc());
+	    UO != nullptr && GetVarDecl(UO->getSubExpr()) == IV) {
+		if (UO->isIncrementOp())
+			Step = 1;
+		else if (UO->isDecrementOp())
+			Step = -1;
+		}
+	else if (auto* CAO = dyn_cast_or_null<CompoundAssignOperator>(FS->getInc());
+	         CAO != nullptr && GetVarDecl(CAO->getLHS()) == IV) {
+		if (auto Val = Evaluate(CAO->getRHS(), AC)) {
+			if (CAO->getOpcode() == BO_AddAssign)
+				Step = *Val;
+			else if (CAO->getOpcode() == BO_SubAssign)
+				Step = -*Val;
+			}
+		}
+
+	if (!Step || *Step == 0)
+		return std::nullopt;
+
+	auto* Cond = dyn_cast_or_null<BinaryOperator>(FS->getCond());
+
+	if (Cond == nullptr || GetVarDecl(Cond->getLHS()) != IV)
+		return std::nullopt;
+
+	std::optional<int64_t> Bound = Evaluate(Cond->getRHS(), AC);
+
+	if (!Bound)
+		return std::nullopt;
+
+	// Number of steps from Init to reach the bound
+	int64_t Dist = 0;
+
+	// An unsigned IV counting down never goes below zero, but wraps instead
+	// e.g. "for (unsigned i = 10; i >= 0; --i)" never ends
+	const bool Unsigned = IV->getType()->isUnsignedIntegerType();
+
+	switch (Cond->getOpcode()) {
+	case BO_LT:
+		Dist = *Bound - *Init;
+		break;
+	case BO_LE:
+		Dist = *Bound - *Init + 1;
+		break;
+	case BO_GT:
+		if (Unsigned && *Step < 0 && *Bound + 1 < -*Step)
+			return std::nullopt;
+		Dist = *Init - *Bound;
+		Step = -*Step;
+		break;
+	case BO_GE:
+		if (Unsigned && *Step < 0 && *Bound < -*Step)
+			return std::nullopt;
+		Dist = *Init - *Bound + 1;
+		Step = -*Step;
+		break;
+	case BO_NE:
+		Dist = *Bound - *Init;
+		if (Dist % *Step != 0 || Dist / *Step < 0)
+			return std::nullopt;
+		if (Dist < 0) {
+			Dist = -Dist;
+			Step = -*Step;
+			}
+		break;
+	default:
+		return std::nullopt;
+		}
+
+	if (Dist <= 0)
+		return 0;
+
+	// Going the wrong way, which ends only after wrapping around
+	if (*Step < 0)
+		return std::nullopt;
+
+	// Give up if the induction variable is modified in the body
+	ModifyFinder MF(IV);
+	MF.TraverseStmt(const_cast<Stmt*>(FS->getBody()));
+
+	if (MF.isModified())
+		return std::nullopt;
+
+	return static_cast<uint64_t>((Dist + *Step - 1) / *Step);
+
+	}
+
+unsigned CostModel::MemCost(QualType PointeeQT) const {
+
+	if (PointeeQT.isNull())
+		return Table.PrivateMem;
+
+	unsigned Cost = Table.PrivateMem;
+
+	switch (PointeeQT.getAddressSpace()) {
+	case LangAS::opencl_global:
+	case LangAS::opencl_constant:
+		Cost = Table.GlobalMem;
+		break;
+	case LangAS::opencl_local:
+		Cost = Table.LocalMem;
+		break;
+	default:
+		break;
+		}
+
+	return Scale(Cost, PointeeQT);
+
+	}
+
+unsigned CostModel::Scale(unsigned Cost, QualType QT) const {
+
+	if (!Table.ScaleByVecWidth || QT.isNull())
+		return Cost;
+
+	if (auto* VT = QT->getAs<VectorType>())
+		return Cost * VT->getNumElements();
+
+	return Cost;
+
+	}
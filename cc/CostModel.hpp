@@ -0,0 +1,115 @@
+/*
+  CostModel.hpp
+
+  Static cost estimation of statements.
+
+*/
+
+#ifndef __CLPKM__COST_MODEL_HPP__
+#define __CLPKM__COST_MODEL_HPP__
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/Stmt.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+
+
+// Weights of each kind of operation
+// The unit is arbitrary, roughly a simple ALU operation
+struct CostTable {
+
+	// Built-in tables
+	enum class device_class : unsigned {
+		GPU = 0,
+		CPU
+		};
+
+	unsigned Arith = 1;
+	unsigned IntDiv = 20;
+	unsigned FloatDiv = 8;
+	unsigned Transcendental = 16;
+	unsigned GlobalMem = 24;
+	unsigned LocalMem = 4;
+	unsigned PrivateMem = 1;
+	unsigned Atomic = 48;
+	unsigned Branch = 1;
+	unsigned Call = 2;
+
+	// Whether cost of vector operations scales with the number of components
+	// True for scalar SIMT architectures, false for SIMD ones
+	bool ScaleByVecWidth = true;
+
+	static CostTable Get(device_class );
+
+	struct Key {
+		static inline char Arith[] = "arith";
+		static inline char IntDiv[] = "int-div";
+		static inline char FloatDiv[] = "float-div";
+		static inline char Transcendental[] = "transcendental";
+		static inline char GlobalMem[] = "global-mem";
+		static inline char LocalMem[] = "local-mem";
+		static inline char PrivateMem[] = "private-mem";
+		static inline char Atomic[] = "atomic";
+		static inline char Branch[] = "branch";
+		static inline char Call[] = "call";
+		static inline char ScaleByVecWidth[] = "scale-by-vec-width";
+		};
+
+	};
+
+class CostModel {
+public:
+	CostModel(const CostTable& CT)
+	: Table(CT) { }
+
+	// Cost of S itself, excluding its children
+	unsigned CostOf(const clang::Stmt* S) const;
+
+	// Number of iterations of Loop if it's known at compile time
+	static std::optional<uint64_t> TripCount(const clang::Stmt* Loop,
+	                                         clang::ASTContext& );
+
+private:
+	unsigned MemCost(clang::QualType PointeeQT) const;
+	unsigned Scale(unsigned Cost, clang::QualType QT) const;
+
+	const CostTable& Table;
+
+	};
+
+
+
+#include "llvm/Support/YAMLTraits.h"
+
+template <>
+struct llvm::yaml::ScalarEnumerationTraits<CostTable::device_class> {
+	static void enumeration(llvm::yaml::IO& Io, CostTable::device_class& D) {
+		Io.enumCase(D, "gpu", CostTable::device_class::GPU);
+		Io.enumCase(D, "cpu", CostTable::device_class::CPU);
+		}
+	};
+
+// Keys not specified are left untouched
+template <>
+struct llvm::yaml::MappingTraits<CostTable> {
+	static void mapping(llvm::yaml::IO& Io, CostTable& CT) {
+		Io.mapOptional(CostTable::Key::Arith,           CT.Arith);
+		Io.mapOptional(CostTable::Key::IntDiv,          CT.IntDiv);
+		Io.mapOptional(CostTable::Key::FloatDiv,        CT.FloatDiv);
+		Io.mapOptional(CostTable::Key::Transcendental,  CT.Transcendental);
+		Io.mapOptional(CostTable::Key::GlobalMem,       CT.GlobalMem);
+		Io.mapOptional(CostTable::Key::LocalMem,        CT.LocalMem);
+		Io.mapOptional(CostTable::Key::PrivateMem,      CT.PrivateMem);
+		Io.mapOptional(CostTable::Key::Atomic,          CT.Atomic);
+		Io.mapOptional(CostTable::Key::Branch,          CT.Branch);
+		Io.mapOptional(CostTable::Key::Call,            CT.Call);
+		Io.mapOptional(CostTable::Key::ScaleByVecWidth, CT.ScaleByVecWidth);
+		}
+	};
+
+
+
+#endif
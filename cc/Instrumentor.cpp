@@ -6,6 +6,8 @@
 */
 
 #include "Instrumentor.hpp"
+#include "clang/Lex/Lexer.h"
+#include <algorithm>
 #include <string>
 #include <unordered_set>
 #include <vector>
@@ -18,8 +20,11 @@ namespace {
 // Helper class to collect info of variables located in local memory
 class FuncInfoCollector : public RecursiveASTVisitor<FuncInfoCollector> {
 public:
-	FuncInfoCollector(std::vector<DeclStmt*>& LD, size_t& BC)
-	: LocDecl(LD), BarrierCount(BC) { BarrierCount = 0; }
+	FuncInfoCollector(std::vector<DeclStmt*>& LD, size_t& BC, bool& CUF)
+	: LocDecl(LD), BarrierCount(BC), CallsUserFunc(CUF) {
+		BarrierCount = 0;
+		CallsUserFunc = false;
+		}
 
 	bool VisitDeclStmt(DeclStmt* DS) {
 		if (DS == nullptr || DS->getDeclGroup().isNull())
@@ -39,14 +44,121 @@ public:
 		if (CE->getDirectCallee()->getNameInfo().getName().getAsString() ==
 		    "barrier")
 			++BarrierCount;
+		// Built-in functions have no body
+		if (CE->getDirectCallee()->hasBody())
+			CallsUserFunc = true;
 		return true;
 		}
 
 private:
 	std::vector<DeclStmt*>& LocDecl;
 	size_t& BarrierCount;
+	bool& CallsUserFunc;
 
 	};
+
+// Limits of straight-line copies, beyond which a loop is emitted
+constexpr size_t MaxUnrolledVec4 = 4;
+constexpr size_t MaxUnrolledWord = 16;
+constexpr size_t MaxUnrolledByte = 16;
+
+// Generate {store, load} code of a private variable whose size and alignment
+// are known at compile time
+// Return a pair of empty strings if no specialized code fits
+std::pair<std::string, std::string> GenerateCopy(const std::string& VarName,
+                                                 size_t Offset, size_t Size,
+                                                 size_t Align,
+                                                 KernelProfile::prv_layout L) {
+
+	std::pair<std::string, std::string> Copy;
+	const std::string Prv = "((__private uint*)&" + VarName + ")";
+
+	// Word W of this work-item lives at __clpkm_prv[W * __clpkm_prv_stride]
+	if (L == KernelProfile::prv_layout::INTERLEAVED) {
+
+		if (Align < 4 || Size % 4 != 0 || Size / 4 > MaxUnrolledWord)
+			return Copy;
+
+		for (size_t W = 0; W < Size / 4; ++W) {
+			std::string Gbl = "((__global uint*)__clpkm_prv)[" +
+			                  std::to_string(Offset / 4 + W) +
+			                  " * __clpkm_prv_stride]";
+			std::string Var = Prv + "[" + std::to_string(W) + "]";
+			Copy.first += Gbl + " = " + Var + "; ";
+			Copy.second += std::move(Var) + " = " + std::move(Gbl) + "; ";
+			}
+
+		return Copy;
+
+		}
+
+	const std::string Off = std::to_string(Offset);
+
+	// Use vector load/store for 4-aligned variables
+	if (Align >= 4 && Size % 4 == 0) {
+
+		const std::string Gbl = "((__global uint*)(__clpkm_prv+" + Off + "))";
+		const size_t NumOfWord = Size / 4;
+		const size_t NumOfVec4 = NumOfWord / 4;
+
+		if (NumOfVec4 > MaxUnrolledVec4) {
+			std::string Head = "for (uint __clpkm_i = 0; __clpkm_i < " +
+			                   std::to_string(NumOfVec4) + "; ++__clpkm_i) ";
+			Copy.first += Head + "vstore4(vload4(__clpkm_i, " + Prv + "), "
+			              "__clpkm_i, " + Gbl + "); ";
+			Copy.second += std::move(Head) + "vstore4(vload4(__clpkm_i, " + Gbl +
+			               "), __clpkm_i, " + Prv + "); ";
+			}
+		else
+			for (size_t V = 0; V < NumOfVec4; ++V) {
+				std::string Idx = std::to_string(V);
+				Copy.first += "vstore4(vload4(" + Idx + ", " + Prv + "), " +
+				              Idx + ", " + Gbl + "); ";
+				Copy.second += "vstore4(vload4(" + Idx + ", " + Gbl + "), " +
+				               Idx + ", " + Prv + "); ";
+				}
+
+		size_t W = NumOfVec4 * 4;
+
+		if (NumOfWord - W >= 2) {
+			std::string Idx = std::to_string(W / 2);
+			Copy.first += "vstore2(vload2(" + Idx + ", " + Prv + "), " +
+			              Idx + ", " + Gbl + "); ";
+			Copy.second += "vstore2(vload2(" + Idx + ", " + Gbl + "), " +
+			               Idx + ", " + Prv + "); ";
+			W += 2;
+			}
+
+		if (NumOfWord - W >= 1) {
+			std::string Idx = "[" + std::to_string(W) + "]";
+			Copy.first += Gbl + Idx + " = " + Prv + Idx + "; ";
+			Copy.second += Prv + Idx + " = " + Gbl + Idx + "; ";
+			}
+
+		return Copy;
+
+		}
+
+	if (Size > MaxUnrolledByte)
+		return Copy;
+
+	// Small variables with smaller alignment, e.g. char3, short, bool
+	const char* Type = (Align >= 2 && Size % 2 == 0) ? "ushort" : "uchar";
+	const size_t Unit = (Align >= 2 && Size % 2 == 0) ? 2 : 1;
+	const std::string Gbl = std::string("((__global ") + Type +
+	                        "*)(__clpkm_prv+" + Off + "))";
+	const std::string PrvUnit = std::string("((__private ") + Type + "*)&" +
+	                            VarName + ")";
+
+	for (size_t Idx = 0; Idx < Size / Unit; ++Idx) {
+		std::string Sub = "[" + std::to_string(Idx) + "]";
+		Copy.first += Gbl + Sub + " = " + PrvUnit + Sub + "; ";
+		Copy.second += PrvUnit + Sub + " = " + Gbl + Sub + "; ";
+		}
+
+	return Copy;
+
+	}
 }
 
 
@@ -62,8 +174,7 @@ bool Instrumentor::VisitSwitchStmt(SwitchStmt* SS) {
 
 bool Instrumentor::VisitStmt(Stmt* S) {
 
-	// TODO: fine-grained cost evaluation
-	CostCounter++;
+	CostCounter += TheCostModel.CostOf(S);
 	return true;
 
 	}
@@ -139,8 +250,21 @@ bool Instrumentor::VisitCallExpr(CallExpr* CE) {
 	if (CE == nullptr || CE->getDirectCallee() == nullptr)
 		return true;
 
-	if (CE->getDirectCallee()->getNameInfo().getName().getAsString() !=
-	    "barrier")
+	std::string Callee = CE->getDirectCallee()->getNameInfo().getName().getAsString();
+
+	// Redirect to the macros in toolkit that refer to the whole NDRange
+	if (RedirectWorkItemFunc) {
+		static const std::unordered_set<std::string> WorkItemFunc = {
+				"get_global_id", "get_global_size", "get_group_id",
+				"get_num_groups", "get_global_offset"};
+		if (WorkItemFunc.find(Callee) != WorkItemFunc.end()) {
+			TheRewriter.ReplaceText(CE->getCallee()->getExprLoc(), Callee.size(),
+			                        "__clpkm_" + Callee);
+			return true;
+			}
+		}
+
+	if (Callee != "barrier")
 		return true;
 
 	std::string OrigBarrier =
@@ -156,10 +280,17 @@ bool Instrumentor::VisitCallExpr(CallExpr* CE) {
 
 	std::string BarrierStop =
 			"__clpkm_barrier_stop[" + std::to_string(BarrierIdx++) + "]";
-
-	Covfefe C = GenerateCovfefe(LVT.GenLivenessAfter(CE), ThePL.back());
 	std::string ThisNonce = std::to_string(++Nonce);
 
+	auto LiveVar = CollectPrvVar(LVT.GenLivenessAfter(CE));
+
+	if (TheConfig.LivenessReport)
+		ReportLiveness(CE->getLocStart(), LiveVar, CE);
+
+	Covfefe C = GenerateCovfefe(AssignPrvSlot(LiveVar, ThePL.back()),
+	                            ThePL.back());
+	++NumOfSite;
+
 	std::string InstCR =
 			" do {\n"
 			"   atomic_dec(&" + BarrierStop + ");\n"
@@ -252,7 +383,9 @@ bool Instrumentor::TraverseFunctionDecl(FunctionDecl* FuncDecl) {
 	const char* CLPKMParam = ", __global int * restrict __clpkm_metadata, "
 	                         "__global char * restrict __clpkm_local, "
 	                         "__global char * restrict __clpkm_prv, "
-	                         "const uint __clpkm_tlv";
+	                         "const uint __clpkm_tlv, "
+	                         "__global const volatile int * __clpkm_flag, "
+	                         "__global const uint * __clpkm_launch";
 
 	TheRewriter.InsertTextAfterToken(InsertCut, CLPKMParam);
 
@@ -262,6 +395,11 @@ bool Instrumentor::TraverseFunctionDecl(FunctionDecl* FuncDecl) {
 
 	// Put a new entry into the kernel profile list
 	auto& PLEntry = ThePL.emplace_back(FuncName, NumOfParam);
+	PLEntry.PrvLayout = TheConfig.PrvLayout;
+
+	if (std::string PristineName = "__clpkm_pristine_" + FuncName;
+	    TheConfig.EmitPristine && EmitPristineClone(FuncDecl, PristineName))
+		PLEntry.PristineName = std::move(PristineName);
 
 	std::string DynSzLocBufSize = "0";
 
@@ -286,13 +424,18 @@ bool Instrumentor::TraverseFunctionDecl(FunctionDecl* FuncDecl) {
 
 	std::vector<DeclStmt*> LocDecl;
 	size_t BarrierCount = 0;
+	bool CallsUserFunc = false;
 
 	// Collect local decl and number of barrier
 	{
-		FuncInfoCollector V(LocDecl, BarrierCount);
+		FuncInfoCollector V(LocDecl, BarrierCount, CallsUserFunc);
 		V.TraverseFunctionDecl(FuncDecl);
 		}
 
+	// Work-item functions called by other functions can't be redirected to the
+	// IDs in the whole NDRange, so such kernels must be launched as is
+	PLEntry.Compactable = !CallsUserFunc;
+
 	auto Locfefe = GenerateLocfefe(LocDecl, TheRewriter, FuncDecl, PLEntry);
 
 	auto InitBarrierStop = [&]() -> std::string {
@@ -317,7 +460,51 @@ bool Instrumentor::TraverseFunctionDecl(FunctionDecl* FuncDecl) {
 	const char* InitBarrier = (Locfefe.second.size() || InitBarrierStop.size())
 	                          ? "barrier(CLK_LOCAL_MEM_FENCE);" : "";
 
+	// Move the live value buffer to the slot of this work-item
+	auto AdjustPrvBuffer = [&]() -> std::string {
+		if (PLEntry.PrvLayout == KernelProfile::prv_layout::INTERLEAVED)
+			return "  __clpkm_prv += __clpkm_id * sizeof(uint);\n"
+			       "  size_t __clpkm_prv_stride = " +
+			       std::string(PLEntry.Compactable
+			                   ? "__get_compact_linear_global_size(__clpkm_num_grps)"
+			                   : "__get_linear_global_size()") + ";\n";
+		return "  __clpkm_prv += __clpkm_id * " + ReqPrvSizeVar + ";\n";
+		}();
+
+	TheRewriter.InsertTextBefore(FuncDecl->getBody()->getLocEnd(),
+	                             " } // switch\n"
+	                             " __clpkm_hdr[__clpkm_id] = 0;\n"
+	                             " __CLPKM_SV_LOC_AND_RET: ;\n" +
+	                             std::move(Locfefe.first));
+
+	// IDs of the work-group in the whole NDRange, in case of compact launch
+	auto GetLinearId = [&]() -> std::string {
+		if (PLEntry.Compactable)
+			return "  size_t __clpkm_grp_ids[3], __clpkm_num_grps[3], __clpkm_gwo[3];\n"
+			       "  __get_compact_linear_id(__clpkm_launch, __clpkm_grp_ids,\n"
+			       "                          __clpkm_num_grps, __clpkm_gwo,\n"
+			       "                          &__clpkm_id, &__clpkm_grp_id,\n"
+			       "                          &__clpkm_loc_id, &__clpkm_grp_size);\n";
+		return "  __get_linear_id(&__clpkm_id, &__clpkm_grp_id,\n"
+		       "                  &__clpkm_loc_id, &__clpkm_grp_size);\n";
+		}();
+
+	// Preparation for traversal
+	RedirectWorkItemFunc = PLEntry.Compactable;
+	LVT.SetContext(FuncDecl, TheConfig.LivenessReport);
+	CostCounter = 0;
+	ReportBytes = 0;
+	ReportLegacyBytes = 0;
+	Nonce = 1;
+	BarrierIdx = 0;
+	NumOfSite = 0;
+	PollCtrDecl.clear();
+
+	// Traverse
+	bool Ret = RecursiveASTVisitor<Instrumentor>::TraverseFunctionDecl(FuncDecl);
+
 	// Inject main control flow
+	// Note: this is done after traversal because loops add their poll counters
 	TheRewriter.InsertTextAfterToken(
 		FuncDecl->getBody()->getLocStart(),
 		"\n  __global const uint* __clpkm_dloc_sz_tbl = (__global uint*) __clpkm_metadata;\n"
@@ -328,10 +515,9 @@ bool Instrumentor::TraverseFunctionDecl(FunctionDecl* FuncDecl) {
 		"  size_t __clpkm_grp_id = 0; // work-group id \n"
 		"  size_t __clpkm_loc_id = 0; // local work-item id\n"
 		"  size_t __clpkm_grp_size = 0; // work-group size \n"
-		"  // Compute linear IDs and adjust live value buffer\n"
-		"  __get_linear_id(&__clpkm_id, &__clpkm_grp_id,\n"
-		"                  &__clpkm_loc_id, &__clpkm_grp_size);\n"
-		"  __clpkm_prv += __clpkm_id * " + ReqPrvSizeVar + ";\n"
+		"  // Compute linear IDs and adjust live value buffer\n" +
+		std::move(GetLinearId) +
+		std::move(AdjustPrvBuffer) +
 		"  __clpkm_local += __clpkm_grp_id * (" + ReqLocSizeVar + " + " +
 		                                      DynSzLocBufSize + ");\n"
 		"  // Initialize barrier stop\n" +
@@ -339,24 +525,21 @@ bool Instrumentor::TraverseFunctionDecl(FunctionDecl* FuncDecl) {
 		"  // Load live values for variables locate in local memory\n" +
 		std::move(Locfefe.second) +
 		InitBarrier +
+		"  // Poll counters\n" +
+		std::move(PollCtrDecl) +
 		"  switch (__builtin_expect(__clpkm_hdr[__clpkm_id], 1)) {\n"
 		"  default: goto __CLPKM_SV_LOC_AND_RET;\n"
 		"  case 1: ;\n");
 
-	TheRewriter.InsertTextBefore(FuncDecl->getBody()->getLocEnd(),
-	                             " } // switch\n"
-	                             " __clpkm_hdr[__clpkm_id] = 0;\n"
-	                             " __CLPKM_SV_LOC_AND_RET: ;\n" +
-	                             std::move(Locfefe.first));
-
-	// Preparation for traversal
-	LVT.SetContext(FuncDecl);
-	CostCounter = 0;
-	Nonce = 1;
-	BarrierIdx = 0;
-
-	// Traverse
-	bool Ret = RecursiveASTVisitor<Instrumentor>::TraverseFunctionDecl(FuncDecl);
+	if (TheConfig.LivenessReport)
+		DiagReport(FuncDecl->getNameInfo().getLoc(),
+		           DiagnosticsEngine::Level::Remark,
+		           "%0 checkpoint site(s) save %1 byte(s) in total, %2 byte(s) "
+		           "with block-level liveness; %3 byte(s) per work-item")
+		           << static_cast<unsigned>(NumOfSite)
+		           << static_cast<unsigned>(ReportBytes)
+		           << static_cast<unsigned>(ReportLegacyBytes)
+		           << static_cast<unsigned>(PLEntry.ReqPrvSize);
 
 	// Cleanup
 	LVT.EndContext();
@@ -374,32 +557,93 @@ bool Instrumentor::TraverseFunctionDecl(FunctionDecl* FuncDecl) {
 
 	}
 
+bool Instrumentor::EmitPristineClone(FunctionDecl* FuncDecl,
+                                     const std::string& PristineName) {
+
+	SourceManager& SM = TheRewriter.getSourceMgr();
+	SourceLocation Start = FuncDecl->getLocStart();
+	SourceLocation NameLoc = FuncDecl->getNameInfo().getLoc();
+
+	// The text from the original buffer is intact regardless of the rewrites
+	// made so far
+	std::string Clone = Lexer::getSourceText(
+			CharSourceRange::getTokenRange(FuncDecl->getSourceRange()), SM,
+			TheCI.getLangOpts()).str();
+
+	size_t NameOffset = SM.getFileOffset(NameLoc) - SM.getFileOffset(Start);
+	size_t NameLength = FuncDecl->getNameInfo().getName().getAsString().size();
+
+	if (Clone.empty() || NameOffset + NameLength > Clone.size()) {
+		DiagReport(NameLoc, DiagnosticsEngine::Level::Warning,
+		           "failed to clone the kernel from source");
+		return false;
+		}
+
+	Clone.replace(NameOffset, NameLength, PristineName);
+	TheRewriter.InsertTextBefore(Start, Clone + "\n\n");
+	return true;
+
+	}
+
 bool Instrumentor::PatchLoopBody(size_t OldCost, size_t NewCost,
                                  Stmt* Loop, Expr* Cond, Stmt* Body) {
 
 	CostCounter = OldCost;
 
+	// This loop will never repeat, or is too cheap to be worth polling, and
+	// hence needs no checkpoint
+	// Its cost is accounted to the enclosing code instead
+	if (auto Trip = CostModel::TripCount(Loop, TheCI.getASTContext());
+	    Trip && (*Trip <= 1 ||
+	             *Trip <= TheConfig.HoistCostLimit /
+	                      std::max<size_t>(NewCost - OldCost, 1))) {
+		CostCounter += *Trip * (NewCost - OldCost);
+		return true;
+		}
+
 	// If this condition is compiler-time evaluable
 	// Note: Cond could be nullptr in the case like:
 	//     for (;;) ...
 	if (bool Result;
 	    Cond != nullptr && Cond->isEvaluatable(TheCI.getASTContext()) &&
-	    Cond->EvaluateAsBooleanCondition(Result, TheCI.getASTContext())) {
-
-		// This loop will never repeat
-		if (!Result)
-			return true;
-
+	    Cond->EvaluateAsBooleanCondition(Result, TheCI.getASTContext()) &&
+	    Result)
 		DiagReport(Cond->getLocStart(), DiagnosticsEngine::Level::Warning,
 		           "infinite loop");
 
+	std::string ThisNonce = std::to_string(++Nonce);
+	std::string ThisCost = std::to_string(NewCost - OldCost);
+
+	// Poll every 2^n iterations, where 2^n is derived from the estimated cost
+	// of an iteration and the threshold at run-time, unless specified
+	std::string ShouldPoll;
+
+	if (TheConfig.PollStride != 1) {
+		std::string PollCtr = "__clpkm_poll_" + ThisNonce;
+		std::string PollMask = (TheConfig.PollStride == 0)
+		                       ? "__clpkm_poll_mask_" + ThisNonce
+		                       : std::to_string(TheConfig.PollStride - 1);
+		PollCtrDecl += "  uint " + PollCtr + " = 0;\n";
+		if (TheConfig.PollStride == 0)
+			PollCtrDecl += "  const uint " + PollMask + " = __clpkm_poll_mask(" +
+			               ThisCost + ", __clpkm_tlv);\n";
+		ShouldPoll = "(++" + PollCtr + " & " + PollMask + ") == 0 && ";
 		}
 
-	Covfefe C = GenerateCovfefe(LVT.GenLivenessAfter(Body), ThePL.back());
-	std::string ThisNonce = std::to_string(++Nonce);
+	auto LiveVar = CollectPrvVar(LVT.GenLivenessAtLoopEnd(Loop));
+
+	if (TheConfig.LivenessReport)
+		ReportLiveness(Loop->getLocStart(), LiveVar, Body);
+
+	Covfefe C = GenerateCovfefe(AssignPrvSlot(LiveVar, ThePL.back()),
+	                            ThePL.back());
+	++NumOfSite;
+
 	std::string InstCR =
-			" __clpkm_update_ctr(&__clpkm_ctr, " + std::to_string(NewCost - OldCost) + ");"
-			" if (__clpkm_should_chkpnt(__clpkm_ctr, __clpkm_tlv)) {"
+			" __clpkm_update_ctr(&__clpkm_ctr, " + ThisCost + ");"
+			" if (" + ShouldPoll +
+			     "__clpkm_should_chkpnt(__clpkm_ctr, __clpkm_tlv, "
+			                           "__clpkm_flag)) {"
 				" __clpkm_hdr[__clpkm_id] = " + ThisNonce + "; " +
 				std::move(C.first) + " goto __CLPKM_SV_LOC_AND_RET;"
 			" } if (0) case " + ThisNonce + ": {" +
@@ -419,53 +663,64 @@ bool Instrumentor::PatchLoopBody(size_t OldCost, size_t NewCost,
 
 	}
 
+void Instrumentor::ReportLiveness(SourceLocation SL,
+                                  const std::vector<VarDecl*>& LiveVar,
+                                  Stmt* S) {
+
+	auto LegacyVar = CollectPrvVar(LVT.GenLegacyLivenessAfter(S));
+
+	auto SizeOf = [](const std::vector<VarDecl*>& Var) -> size_t {
+		size_t Size = 0;
+		for (VarDecl* VD : Var)
+			Size += (VD->getASTContext().getTypeInfo(VD->getType()).Width + 7) / 8;
+		return Size;
+		};
+
+	// Names of variables in LHS but not in RHS
+	auto Diff = [](const std::vector<VarDecl*>& LHS,
+	               const std::vector<VarDecl*>& RHS) -> std::string {
+		std::string Name;
+		for (VarDecl* VD : LHS)
+			if (std::find(RHS.begin(), RHS.end(), VD) == RHS.end())
+				Name += (Name.empty() ? "" : ", ") + VD->getName().str();
+		return Name.empty() ? "none" : Name;
+		};
+
+	size_t Bytes = SizeOf(LiveVar);
+	size_t LegacyBytes = SizeOf(LegacyVar);
+
+	DiagReport(SL, DiagnosticsEngine::Level::Remark,
+	           "checkpoint saves %0 variable(s) in %1 byte(s), %2 in %3 byte(s) "
+	           "with block-level liveness; dropped: %4; added: %5")
+	           << static_cast<unsigned>(LiveVar.size())
+	           << static_cast<unsigned>(Bytes)
+	           << static_cast<unsigned>(LegacyVar.size())
+	           << static_cast<unsigned>(LegacyBytes)
+	           << Diff(LegacyVar, LiveVar) << Diff(LiveVar, LegacyVar);
+
+	ReportBytes += Bytes;
+	ReportLegacyBytes += LegacyBytes;
+
+	}
+
 
 
 // Static member functions
-auto Instrumentor::GenerateCovfefe(LiveVarTracker::liveness&& L,
-                                   KernelProfile& KP) -> Covfefe {
+auto Instrumentor::CollectPrvVar(LiveVarTracker::liveness&& L)
+	-> std::vector<VarDecl*> {
 
-	Covfefe C;
-	size_t ReqPrvSize = 0;
+	std::vector<VarDecl*> PrvVar;
 
 	for (VarDecl* VD : L) {
 
-		QualType QT = VD->getType();
-		TypeInfo TI = VD->getASTContext().getTypeInfo(QT);
-
-		switch (QT.getAddressSpace()) {
+		switch (VD->getType().getAddressSpace()) {
 #if LLVM_VERSION_MAJOR >= 6
-		case LangAS::opencl_private: {
+		case LangAS::opencl_private:
 #else
 		// clang::LangAS::Default, IIUC, private
-		case LangAS::Default: {
+		case LangAS::Default:
 #endif
-				const char* VarName = VD->getIdentifier()->getNameStart();
-				size_t Size = (TI.Width + 7) / 8;
-
-				const char* MemcpyStore = "__clpkm_store_private";
-				const char* MemcpyLoad = "__clpkm_load_private";
-
-				if (TI.Align >= 32) {
-					MemcpyStore = "__clpkm_store_private_align_4";
-					MemcpyLoad = "__clpkm_load_private_align_4";
-					}
-				else if (TI.Align >= 16) {
-					MemcpyStore = "__clpkm_store_private_align_2";
-					MemcpyLoad = "__clpkm_load_private_align_2";
-					}
-
-				std::string P = "(__clpkm_prv+" +
-				                std::to_string(ReqPrvSize) +
-				                ", &" + std::string(VarName) + ", " +
-				                std::to_string(Size) + "); ";
-				C.first += MemcpyStore;
-				C.first += P;
-				C.second += MemcpyLoad;
-				C.second += std::move(P);
-				ReqPrvSize += Size;
-
-				}
+			PrvVar.emplace_back(VD);
 			break;
 
 		case LangAS::opencl_global:
@@ -480,12 +735,104 @@ auto Instrumentor::GenerateCovfefe(LiveVarTracker::liveness&& L,
 
 		}
 
+	return PrvVar;
+
+	}
+
+// Assign each private variable live at a checkpoint site an offset in the
+// live value buffer, and update the max requested size
+// Note: the buffer of a work-item is only guaranteed to be 4-aligned, so
+// offsets are aligned to min(alignment, 4)
+auto Instrumentor::AssignPrvSlot(const std::vector<VarDecl*>& LiveVar,
+                                 KernelProfile& KP) -> std::vector<PrvSlot> {
+
+	std::vector<PrvSlot> Slots;
+	size_t ReqPrvSize = 0;
+
+	for (VarDecl* VD : LiveVar) {
+		TypeInfo TI = VD->getASTContext().getTypeInfo(VD->getType());
+		size_t Align = std::clamp<size_t>(TI.Align / 8, 1, 4);
+		ReqPrvSize = (ReqPrvSize + Align - 1) / Align * Align;
+		Slots.emplace_back(VD, ReqPrvSize);
+		ReqPrvSize += (TI.Width + 7) / 8;
+		}
+
 	// Pad to multiple of 4
 	ReqPrvSize = (ReqPrvSize + 3) & ~static_cast<size_t>(0b11);
 
 	// Update max requested size
 	KP.ReqPrvSize = std::max(KP.ReqPrvSize, ReqPrvSize);
 
+	return Slots;
+
+	}
+
+auto Instrumentor::GenerateCovfefe(const std::vector<PrvSlot>& Slots,
+                                   const KernelProfile& KP) -> Covfefe {
+
+	Covfefe C;
+
+	for (auto [VD, Offset] : Slots) {
+
+		TypeInfo TI = VD->getASTContext().getTypeInfo(VD->getType());
+
+		const char* VarName = VD->getIdentifier()->getNameStart();
+		size_t Size = (TI.Width + 7) / 8;
+
+		// AssignPrvSlot aligns offsets to min(alignment, 4)
+		if (auto Copy = GenerateCopy(VarName, Offset, Size,
+		                             std::min<size_t>(TI.Align / 8, 4),
+		                             KP.PrvLayout);
+		    !Copy.first.empty()) {
+			C.first += Copy.first;
+			C.second += Copy.second;
+			continue;
+			}
+
+		// Fall back to toolkit helpers
+		const char* MemcpyStore = "__clpkm_store_private";
+		const char* MemcpyLoad = "__clpkm_load_private";
+		std::string P;
+
+		if (KP.PrvLayout == KernelProfile::prv_layout::INTERLEAVED) {
+
+			MemcpyStore = "__clpkm_store_private_interleaved";
+			MemcpyLoad = "__clpkm_load_private_interleaved";
+
+			if (TI.Align >= 32) {
+				MemcpyStore = "__clpkm_store_private_interleaved_align_4";
+				MemcpyLoad = "__clpkm_load_private_interleaved_align_4";
+				}
+
+			P = "(__clpkm_prv, " + std::to_string(Offset) +
+			    ", &" + std::string(VarName) + ", " +
+			    std::to_string(Size) + ", __clpkm_prv_stride); ";
+
+			}
+		else {
+
+			if (TI.Align >= 32) {
+				MemcpyStore = "__clpkm_store_private_align_4";
+				MemcpyLoad = "__clpkm_load_private_align_4";
+				}
+			else if (TI.Align >= 16) {
+				MemcpyStore = "__clpkm_store_private_align_2";
+				MemcpyLoad = "__clpkm_load_private_align_2";
+				}
+
+			P = "(__clpkm_prv+" + std::to_string(Offset) +
+			    ", &" + std::string(VarName) + ", " +
+			    std::to_string(Size) + "); ";
+
+			}
+
+		C.first += MemcpyStore;
+		C.first += P;
+		C.second += MemcpyLoad;
+		C.second += std::move(P);
+
+		}
+
 	return C;
 
 	}
@@ -8,6 +8,7 @@
 #ifndef __CLPKM__INSTRUMENTOR_HPP__
 #define __CLPKM__INSTRUMENTOR_HPP__
 
+#include "CostModel.hpp"
 #include "KernelProfile.hpp"
 #include "LiveVarTracker.hpp"
 
@@ -18,14 +19,40 @@
 
 #include <string>
 #include <utility>
+#include <vector>
 
 
 
+// Options that affect the generated code
+struct InstrumentConfig {
+	KernelProfile::prv_layout PrvLayout = KernelProfile::prv_layout::CONTIGUOUS;
+
+	// Emit remarks comparing variables saved at each checkpoint site against
+	// the block-level liveness analysis we used to rely on
+	bool LivenessReport = false;
+
+	// Weights used to estimate cost of statements
+	CostTable Cost;
+
+	// Poll for checkpoint every PollStride iterations of a loop, which must be
+	// a power of 2, or 0 to derive it from the threshold at run-time
+	unsigned PollStride = 0;
+
+	// Loops whose trip count is known and total cost is no more than this are
+	// not instrumented, and their cost is accounted to the enclosing loop
+	size_t HoistCostLimit = 256;
+
+	// Emit an uninstrumented clone of each kernel, which the runtime launches
+	// when nothing could preempt it
+	bool EmitPristine = true;
+	};
+
 class Instrumentor : public clang::RecursiveASTVisitor<Instrumentor> {
 public:
 	Instrumentor(clang::Rewriter& R, clang::CompilerInstance& CI,
-	             ProfileList& PL)
-	: TheRewriter(R), TheCI(CI), ThePL(PL) { }
+	             ProfileList& PL, const InstrumentConfig& IC)
+	: TheRewriter(R), TheCI(CI), ThePL(PL), TheConfig(IC),
+	  TheCostModel(IC.Cost) { }
 
 	// Forbid switch
 	bool VisitSwitchStmt(clang::SwitchStmt* );
@@ -65,23 +92,50 @@ private:
 		return TheDiag.Report(SL, DiagID);
 		}
 
+	// Clone the kernel from the original source under the name PristineName
+	bool EmitPristineClone(clang::FunctionDecl* , const std::string& PristineName);
+
 	bool PatchLoopBody(size_t OldCost, size_t NewCost, clang::Stmt* Loop,
 	                   clang::Expr* Cond, clang::Stmt* Body);
 
 	clang::Rewriter&         TheRewriter;
 	clang::CompilerInstance& TheCI;
 	ProfileList&             ThePL;
+	const InstrumentConfig&  TheConfig;
+	const CostModel          TheCostModel;
+
+	// Compare LiveVar against the legacy liveness after S
+	void ReportLiveness(clang::SourceLocation ,
+	                    const std::vector<clang::VarDecl*>& LiveVar,
+	                    clang::Stmt* S);
 
 	LiveVarTracker LVT;
 
 	size_t CostCounter;
+	size_t ReportBytes;
+	size_t ReportLegacyBytes;
 	size_t Nonce;
 	size_t BarrierIdx;
+	size_t NumOfSite;
+
+	// Whether to redirect work-item functions for compact launch
+	bool RedirectWorkItemFunc;
+
+	// Declaration of poll counters of loops
+	std::string PollCtrDecl;
 
 	// A covfefe is a checkpoint/resume code sequence for variables located in
 	// private memory
 	using Covfefe = std::pair<std::string, std::string>;
-	static Covfefe GenerateCovfefe(LiveVarTracker::liveness&& , KernelProfile& );
+
+	// A private variable and its offset in the live value buffer
+	using PrvSlot = std::pair<clang::VarDecl*, size_t>;
+
+	static std::vector<clang::VarDecl*> CollectPrvVar(LiveVarTracker::liveness&& );
+	static std::vector<PrvSlot> AssignPrvSlot(
+			const std::vector<clang::VarDecl*>& , KernelProfile& );
+	static Covfefe GenerateCovfefe(const std::vector<PrvSlot>& ,
+	                               const KernelProfile& );
 
 	// Locfefe is the counterpart of local memory
 	using Locfefe = std::pair<std::string, std::string>;
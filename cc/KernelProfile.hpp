@@ -16,19 +16,38 @@
 
 struct KernelProfile {
 
+	// How the live values of __private variables are laid out in the buffer
+	enum class prv_layout : unsigned {
+		// Each work-item owns a contiguous chunk of ReqPrvSize bytes
+		CONTIGUOUS = 0,
+		// Word-interleaved by the number of work-items, i.e. the i-th word of the
+		// j-th work-item is located at ((uint*) __clpkm_prv)[i * NumOfThread + j]
+		INTERLEAVED
+		};
+
 	std::string Name;
 	unsigned    NumOfParam;
 	size_t      ReqPrvSize;
 	size_t      ReqLocSize;
+	prv_layout  PrvLayout;
+
+	// Name of the uninstrumented clone, or empty if there's none
+	std::string PristineName;
+
+	// Whether unfinished work-groups can be resumed without the others
+	bool Compactable;
 
 	// Hope it won't be too long and the STL impl got SVO
 	std::vector<unsigned> LocPtrParamIdx;
 
 	KernelProfile()
-	: Name(), NumOfParam(0), ReqPrvSize(0), ReqLocSize(0), LocPtrParamIdx() { }
+	: Name(), NumOfParam(0), ReqPrvSize(0), ReqLocSize(0),
+	  PrvLayout(prv_layout::CONTIGUOUS), PristineName(), Compactable(false),
+	  LocPtrParamIdx() { }
 
 	KernelProfile(std::string&& N, unsigned NP)
 	: Name(std::move(N)), NumOfParam(NP), ReqPrvSize(0), ReqLocSize(0),
+	  PrvLayout(prv_layout::CONTIGUOUS), PristineName(), Compactable(false),
 	  LocPtrParamIdx() { }
 
 	KernelProfile(const std::string& N, unsigned NP)
@@ -39,6 +58,9 @@ struct KernelProfile {
 		static inline char NumOfParam[] = "num-of-param";
 		static inline char ReqPrvSize[] = "req-private";
 		static inline char ReqLocSize[] = "req-local";
+		static inline char PrvLayout[] = "private-layout";
+		static inline char PristineName[] = "pristine-kernel";
+		static inline char Compactable[] = "compactable";
 		static inline char LocPtrParamIdx[] = "loc-ptr-param-idx";
 		};
 
@@ -51,6 +73,14 @@ using ProfileList = std::vector<KernelProfile>;
 #ifdef HAVE_LLVM
 #include "llvm/Support/YAMLTraits.h"
 
+template <>
+struct llvm::yaml::ScalarEnumerationTraits<KernelProfile::prv_layout> {
+	static void enumeration(llvm::yaml::IO& Io, KernelProfile::prv_layout& L) {
+		Io.enumCase(L, "contiguous", KernelProfile::prv_layout::CONTIGUOUS);
+		Io.enumCase(L, "interleaved", KernelProfile::prv_layout::INTERLEAVED);
+		}
+	};
+
 template <>
 struct llvm::yaml::MappingTraits<KernelProfile> {
 	static void mapping(llvm::yaml::IO& Io, KernelProfile& KP) {
@@ -58,6 +88,11 @@ struct llvm::yaml::MappingTraits<KernelProfile> {
 		Io.mapRequired(KernelProfile::Key::NumOfParam, KP.NumOfParam);
 		Io.mapRequired(KernelProfile::Key::ReqPrvSize, KP.ReqPrvSize);
 		Io.mapOptional(KernelProfile::Key::ReqLocSize, KP.ReqLocSize, std::size_t(0));
+		Io.mapOptional(KernelProfile::Key::PrvLayout, KP.PrvLayout,
+		               KernelProfile::prv_layout::CONTIGUOUS);
+		Io.mapOptional(KernelProfile::Key::PristineName, KP.PristineName,
+		               std::string());
+		Io.mapOptional(KernelProfile::Key::Compactable, KP.Compactable, false);
 		Io.mapOptional(KernelProfile::Key::LocPtrParamIdx, KP.LocPtrParamIdx);
 		}
 	};
@@ -83,6 +118,17 @@ struct YAML::convert<KernelProfile> {
 		// Optional keys
 		if (YNode[KernelProfile::Key::ReqLocSize])
 			KP.ReqLocSize = YNode[KernelProfile::Key::ReqLocSize].as<size_t>();
+		if (YNode[KernelProfile::Key::PrvLayout]) {
+			auto Layout = YNode[KernelProfile::Key::PrvLayout].as<std::string>();
+			if (Layout == "interleaved")
+				KP.PrvLayout = KernelProfile::prv_layout::INTERLEAVED;
+			else if (Layout != "contiguous")
+				return false;
+			}
+		if (YNode[KernelProfile::Key::PristineName])
+			KP.PristineName = YNode[KernelProfile::Key::PristineName].as<std::string>();
+		if (YNode[KernelProfile::Key::Compactable])
+			KP.Compactable = YNode[KernelProfile::Key::Compactable].as<bool>();
 		if (YNode[KernelProfile::Key::LocPtrParamIdx])
 			// I really want to avoid deep copy here
 			KP.LocPtrParamIdx = YNode[KernelProfile::Key::LocPtrParamIdx].as<std::vector<unsigned>>();
@@ -6,12 +6,61 @@
 */
 
 #include "LiveVarTracker.hpp"
+#include "clang/AST/RecursiveASTVisitor.h"
 
 using namespace clang;
 
 
 
-bool LiveVarTracker::SetContext(const Decl* D) {
+namespace {
+// Collect variables whose address escapes
+class EscapeCollector : public RecursiveASTVisitor<EscapeCollector> {
+public:
+	EscapeCollector(std::set<VarDecl*>& E)
+	: Escaped(E) { }
+
+	~EscapeCollector() {
+		for (auto [ICE, VD] : Decayed)
+			if (Subscripted.find(ICE) == Subscripted.end())
+				Escaped.emplace(VD);
+		}
+
+	bool VisitUnaryOperator(UnaryOperator* UO) {
+		if (UO->getOpcode() == UO_AddrOf)
+			if (VarDecl* VD = GetVarDecl(UO->getSubExpr()))
+				Escaped.emplace(VD);
+		return true;
+		}
+
+	bool VisitImplicitCastExpr(ImplicitCastExpr* ICE) {
+		if (ICE->getCastKind() == CK_ArrayToPointerDecay)
+			if (VarDecl* VD = GetVarDecl(ICE->getSubExpr()))
+				Decayed.emplace(ICE, VD);
+		return true;
+		}
+
+	// Arr[Idx] decays Arr, but the pointer never leaves the expression
+	bool VisitArraySubscriptExpr(ArraySubscriptExpr* ASE) {
+		Subscripted.emplace(ASE->getBase()->IgnoreParens());
+		return true;
+		}
+
+private:
+	static VarDecl* GetVarDecl(Expr* E) {
+		auto* DRE = dyn_cast<DeclRefExpr>(E->IgnoreParens());
+		return (DRE != nullptr) ? dyn_cast<VarDecl>(DRE->getDecl()) : nullptr;
+		}
+
+	std::set<VarDecl*>& Escaped;
+	std::map<Expr*, VarDecl*> Decayed;
+	std::set<Expr*> Subscripted;
+
+	};
+}
+
+
+
+bool LiveVarTracker::SetContext(const Decl* D, bool WithLegacy) {
 
 	this->EndContext();
 #if LLVM_VERSION_MAJOR >= 6
@@ -25,9 +74,18 @@ bool LiveVarTracker::SetContext(const Decl* D) {
 	Context->getCFGBuildOptions().setAllAlwaysAdd();
 
 	LiveVar = LiveVariables::computeLiveness(*Context,
-	                                         /* killAtAssign */ false);
+	                                         /* killAtAssign */ true);
 	Map = Context->getCFGStmtMap();
 
+	if (WithLegacy)
+		LegacyLiveVar = LiveVariables::computeLiveness(*Context,
+		                                               /* killAtAssign */ false);
+
+	if (Stmt* Body = D->getBody()) {
+		EscapeCollector V(Escaped);
+		V.TraverseStmt(Body);
+		}
+
 	// TODO
 	return true;
 
@@ -36,6 +94,8 @@ bool LiveVarTracker::SetContext(const Decl* D) {
 void LiveVarTracker::EndContext() {
 
 	Tracker.clear();
+	Escaped.clear();
+	delete LegacyLiveVar;
 	delete LiveVar;
 	delete Manager;
 
@@ -43,21 +103,127 @@ void LiveVarTracker::EndContext() {
 	Context = nullptr;
 	Map = nullptr;
 	LiveVar = nullptr;
+	LegacyLiveVar = nullptr;
 	Scope = 0;
 
 	}
 
-bool LiveVarTracker::IsLiveAfter(VarDecl* VD, Stmt* S) const {
+auto LiveVarTracker::GenLivenessAfter(Stmt* S) -> liveness {
+
+	point P;
+	CFGBlock::iterator It;
+
+	if (CFGBlock* B = FindElement(S, It); B != nullptr) {
+
+		P.LV = LiveVar;
+		P.B = B;
+
+		// Live after S is live before the next statement in the same block, or
+		// live at the end of the block if S is the last one
+		while (++It != B->end())
+			if (auto CS = It->getAs<CFGStmt>()) {
+				P.S = const_cast<Stmt*>(CS->getStmt());
+				break;
+				}
+
+		}
+
+	return liveness(this, P);
+
+	}
+
+auto LiveVarTracker::GenLivenessAtLoopEnd(Stmt* Loop) -> liveness {
+
+	Stmt* Next = nullptr;
+
+	if (auto* FS = dyn_cast_or_null<ForStmt>(Loop)) {
+		if ((Next = FS->getInc()) == nullptr && (Next = FS->getCond()) == nullptr)
+			Next = FS->getBody();
+		}
+	else if (auto* WS = dyn_cast_or_null<WhileStmt>(Loop))
+		Next = WS->getCond();
+	else if (auto* DS = dyn_cast_or_null<DoStmt>(Loop))
+		Next = DS->getCond();
 
-	if (VD == nullptr || S == nullptr || LiveVar == nullptr || Map == nullptr)
+	// Find the statement evaluated first in Next
+	// Note: the CFG evaluates RHS before LHS for assignments, and children in
+	//       order otherwise
+	while (Next != nullptr) {
+
+		Stmt* First = nullptr;
+
+		if (auto* BO = dyn_cast<BinaryOperator>(Next); BO && BO->isAssignmentOp())
+			First = BO->getRHS();
+		else
+			for (Stmt* Child : Next->children())
+				if ((First = Child) != nullptr)
+					break;
+
+		if (First == nullptr)
+			break;
+
+		Next = First;
+
+		}
+
+	point P;
+	CFGBlock::iterator It;
+
+	// If it isn't a CFG element, we know nothing
+	if (FindElement(Next, It) != nullptr) {
+		P.LV = LiveVar;
+		P.S = Next;
+		}
+
+	return liveness(this, P);
+
+	}
+
+auto LiveVarTracker::GenLegacyLivenessAfter(Stmt* S) -> liveness {
+
+	point P;
+
+	if (LegacyLiveVar != nullptr && S != nullptr && Map != nullptr)
+		if ((P.B = Map->getBlock(S)) != nullptr)
+			P.LV = LegacyLiveVar;
+
+	return liveness(this, P);
+
+	}
+
+bool LiveVarTracker::IsLive(VarDecl* VD, const point& P) const {
+
+	if (VD == nullptr)
 		return false;
 
+	if (P.LV == nullptr)
+		return true;
+
+	if (P.LV == LiveVar && Escaped.find(VD) != Escaped.end())
+		return true;
+
+	if (P.S != nullptr)
+		return P.LV->isLive(P.S, VD);
+
+	return P.LV->isLive(P.B, VD);
+
+	}
+
+CFGBlock* LiveVarTracker::FindElement(Stmt* S, CFGBlock::iterator& It) {
+
+	if (S == nullptr || Map == nullptr)
+		return nullptr;
+
 	CFGBlock* B = Map->getBlock(S);
 
 	if (B == nullptr)
-		llvm_unreachable("Stmt outside of CFGMap???");
+		return nullptr;
+
+	for (It = B->begin(); It != B->end(); ++It)
+		if (auto CS = It->getAs<CFGStmt>(); CS && CS->getStmt() == S)
+			return B;
 
-	return LiveVar->isLive(B, VD);
+	return nullptr;
 
 	}
 
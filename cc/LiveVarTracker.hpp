@@ -9,9 +9,11 @@
 #define __CLPKM__LIVE_VAR_HELPER_HPP__
 
 #include "clang/Analysis/Analyses/LiveVariables.h"
+#include "clang/Analysis/CFG.h"
 #include "clang/Analysis/CFGStmtMap.h"
 #include "clang/AST/ASTContext.h"
 #include <map>
+#include <set>
 
 
 
@@ -31,10 +33,19 @@ private:
 	using tracker_iter = tracker_type::iterator;
 
 public:
+	// A program point to query liveness at
+	// If LV is nullptr, nothing is known about this point, and all tracked
+	// variables are considered live
+	struct point {
+		clang::LiveVariables* LV = nullptr;
+		clang::Stmt*          S = nullptr; // live right before S, or
+		clang::CFGBlock*      B = nullptr; // live at the end of B
+		};
+
 	class iterator {
-		iterator(LiveVarTracker* InitLVT, clang::Stmt* InitS,
+		iterator(LiveVarTracker* InitLVT, const point& InitP,
 		         tracker_iter InitIt)
-		: LVT(InitLVT), S(InitS), It(InitIt) { }
+		: LVT(InitLVT), P(InitP), It(InitIt) { }
 
 	public:
 		iterator() = delete;
@@ -46,7 +57,7 @@ public:
 		iterator operator++(int) { auto Old(*this); ++(*this); return Old; }
 
 		iterator& operator++() {
-			while(++It != LVT->Tracker.end() && !LVT->IsLiveAfter(It->first, S));
+			while(++It != LVT->Tracker.end() && !LVT->IsLive(It->first, P));
 			return (*this);
 			}
 
@@ -55,7 +66,7 @@ public:
 
 	private:
 		LiveVarTracker* LVT;
-		clang::Stmt*    S;
+		point           P;
 		tracker_iter    It;
 
 		friend class LiveVarTracker;
@@ -65,8 +76,8 @@ public:
 	// Helper class to generate iterator
 	class liveness {
 	private:
-		liveness(LiveVarTracker* InitLVT, clang::Stmt* InitS)
-		: LVT(InitLVT), S(InitS) { }
+		liveness(LiveVarTracker* InitLVT, const point& InitP)
+		: LVT(InitLVT), P(InitP) { }
 
 	public:
 		liveness() = delete;
@@ -75,18 +86,18 @@ public:
 
 		iterator begin() const {
 			tracker_iter It = LVT->Tracker.begin();
-			while (It != LVT->Tracker.end() && !LVT->IsLiveAfter(It->first, S))
+			while (It != LVT->Tracker.end() && !LVT->IsLive(It->first, P))
 				++It;
-			return iterator(LVT, S, It);
+			return iterator(LVT, P, It);
 			}
 
 		iterator end() const {
-			return iterator(LVT, S, LVT->Tracker.end());
+			return iterator(LVT, P, LVT->Tracker.end());
 			}
 
 	private:
 		LiveVarTracker* LVT;
-		clang::Stmt* S;
+		point P;
 
 		friend class LiveVarTracker;
 
@@ -95,13 +106,15 @@ public:
 	// Default stuff
 	LiveVarTracker()
 	: Manager(nullptr), Context(nullptr), Map(nullptr), LiveVar(nullptr),
-	  Scope(0) { }
+	  LegacyLiveVar(nullptr), Scope(0) { }
 
 	~LiveVarTracker() { this->EndContext(); }
 	LiveVarTracker(const LiveVarTracker& ) = delete;
 
 	// Set context, e.g. FunctionDecl
-	bool SetContext(const clang::Decl* );
+	// If WithLegacy is set, also compute the block-level liveness we used to
+	// rely on, for comparison
+	bool SetContext(const clang::Decl* , bool WithLegacy = false);
 	void EndContext();
 	bool HasContext() const noexcept { return (Map != nullptr); }
 
@@ -117,15 +130,36 @@ public:
 	void NewScope() { ++Scope; }
 	void PopScope();
 
-	liveness GenLivenessAfter(clang::Stmt* S) { return liveness(this, S); }
+	// Variables live right after S, e.g. a call to barrier
+	liveness GenLivenessAfter(clang::Stmt* S);
+
+	// Variables live at the end of the body of Loop, i.e. live on entry to
+	// whatever is evaluated next: increment, condition or the body itself
+	liveness GenLivenessAtLoopEnd(clang::Stmt* Loop);
+
+	// Variables live at the end of the block containing S, without killing
+	// at assignments
+	// This is what CLPKMCC used to save, only available if SetContext is
+	// called with WithLegacy set
+	liveness GenLegacyLivenessAfter(clang::Stmt* S);
 
 private:
-	bool IsLiveAfter(clang::VarDecl* , clang::Stmt* ) const;
+	bool IsLive(clang::VarDecl* , const point& ) const;
+
+	// Find the CFG element of S, or nullptr if S is not one
+	clang::CFGBlock* FindElement(clang::Stmt* S, clang::CFGBlock::iterator& );
 
 	clang::AnalysisDeclContextManager* Manager;
 	clang::AnalysisDeclContext*        Context;
 	clang::CFGStmtMap*                 Map;
 	clang::LiveVariables*              LiveVar;
+	clang::LiveVariables*              LegacyLiveVar;
+
+	// Variables whose address escapes, e.g. &Var or array decayed to pointer
+	// other than subscripting
+	// They may be accessed in ways the analysis doesn't see, and hence are
+	// always considered live
+	std::set<clang::VarDecl*> Escaped;
 
 	tracker_type Tracker;
 	unsigned Scope;
@@ -16,6 +16,7 @@
 #include "clang/Tooling/Tooling.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 #include <utility>
 
@@ -32,6 +33,46 @@ static llvm::cl::opt<std::string> OptSourceOut(
 static llvm::cl::opt<std::string> OptProfileOut(
 	"profile-output", llvm::cl::desc("Specify the profile output filename"),
 	llvm::cl::value_desc("filename"), llvm::cl::cat(CLPKMCCCat));
+static llvm::cl::opt<KernelProfile::prv_layout> OptPrvLayout(
+	"private-layout",
+	llvm::cl::desc("Specify the layout of the private live value buffer"),
+	llvm::cl::values(
+		clEnumValN(KernelProfile::prv_layout::CONTIGUOUS, "contiguous",
+		           "Each work-item owns a contiguous chunk (default)"),
+		clEnumValN(KernelProfile::prv_layout::INTERLEAVED, "interleaved",
+		           "Interleave words of work-items for coalesced access")),
+	llvm::cl::init(KernelProfile::prv_layout::CONTIGUOUS),
+	llvm::cl::cat(CLPKMCCCat));
+static llvm::cl::opt<bool> OptLivenessReport(
+	"liveness-report",
+	llvm::cl::desc("Report variables saved at each checkpoint site"),
+	llvm::cl::init(false), llvm::cl::cat(CLPKMCCCat));
+static llvm::cl::opt<CostTable::device_class> OptCostModel(
+	"cost-model",
+	llvm::cl::desc("Specify the device class to estimate cost for"),
+	llvm::cl::values(
+		clEnumValN(CostTable::device_class::GPU, "gpu", "GPUs (default)"),
+		clEnumValN(CostTable::device_class::CPU, "cpu", "CPUs")),
+	llvm::cl::init(CostTable::device_class::GPU),
+	llvm::cl::cat(CLPKMCCCat));
+static llvm::cl::opt<std::string> OptCostTable(
+	"cost-table",
+	llvm::cl::desc("Override weights of the cost model with a YAML file"),
+	llvm::cl::value_desc("filename"), llvm::cl::cat(CLPKMCCCat));
+static llvm::cl::opt<unsigned> OptPollStride(
+	"poll-stride",
+	llvm::cl::desc("Poll for checkpoint every N iterations of loops, which "
+	               "must be a power of 2 (default: 0, derived at run-time)"),
+	llvm::cl::value_desc("N"), llvm::cl::init(0), llvm::cl::cat(CLPKMCCCat));
+static llvm::cl::opt<unsigned> OptHoistCostLimit(
+	"hoist-cost-limit",
+	llvm::cl::desc("Don't instrument loops with constant trip count whose "
+	               "estimated total cost is no more than this (default: 256)"),
+	llvm::cl::init(256), llvm::cl::cat(CLPKMCCCat));
+static llvm::cl::opt<bool> OptEmitPristine(
+	"emit-pristine",
+	llvm::cl::desc("Emit an uninstrumented clone of each kernel (default: true)"),
+	llvm::cl::init(true), llvm::cl::cat(CLPKMCCCat));
 
 
 
@@ -59,6 +100,27 @@ public:
 		if (EC)
 			return "Failed to open source output: " + EC.message();
 
+		IC.PrvLayout = OptPrvLayout;
+		IC.LivenessReport = OptLivenessReport;
+		IC.Cost = CostTable::Get(OptCostModel);
+		IC.PollStride = OptPollStride;
+		IC.HoistCostLimit = OptHoistCostLimit;
+		IC.EmitPristine = OptEmitPristine;
+
+		if (OptPollStride & (OptPollStride - 1))
+			return "Poll stride must be a power of 2";
+
+		// Apply user-specified weights
+		if (!OptCostTable.empty()) {
+			auto Buffer = llvm::MemoryBuffer::getFile(OptCostTable);
+			if (!Buffer)
+				return "Failed to open cost table: " + Buffer.getError().message();
+			llvm::yaml::Input YIn(Buffer.get()->getBuffer());
+			YIn >> IC.Cost;
+			if (YIn.error())
+				return "Failed to parse cost table: " + YIn.error().message();
+			}
+
 		// Init profile output
 		// If not specified, don't init
 		if (OptProfileOut.empty())
@@ -79,6 +141,7 @@ public:
 	llvm::raw_ostream& getSourceOutput() { return *SOut; }
 	llvm::yaml::Output& getProfileOutput() { return *YOut; }
 	ProfileList& getProfileList() { return PL; }
+	InstrumentConfig& getConfig() { return IC; }
 
 private:
 	llvm::raw_ostream*  SOut;
@@ -90,6 +153,7 @@ private:
 	std::unique_ptr<llvm::yaml::Output>   __YOut;
 
 	ProfileList PL;
+	InstrumentConfig IC;
 
 	};
 
@@ -135,7 +199,8 @@ public:
 	                                               StringRef file) override {
 
 		CCRewriter.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
-		return llvm::make_unique<Driver>(CCRewriter, CI, Helper.getProfileList());
+		return llvm::make_unique<Driver>(CCRewriter, CI, Helper.getProfileList(),
+		                                 Helper.getConfig());
 
 		}
 
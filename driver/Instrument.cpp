@@ -0,0 +1,333 @@
+/*
+  Instrument.cpp
+
+  Instrument a program from its original source (impl)
+
+*/
+
+#include "Instrument.hpp"
+#include "Pipeline.hpp"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/YAMLTraits.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string>
+#include <tuple>
+#include <vector>
+
+
+
+static llvm::cl::OptionCategory DriverCat("CLPKM driver");
+static llvm::cl::opt<std::string> OptToolkit(
+	"toolkit", llvm::cl::desc("Emit this file before the instrumented code"),
+	llvm::cl::value_desc("filename"), llvm::cl::cat(DriverCat));
+static llvm::cl::opt<std::string> OptSlicingMode(
+	"slicing-mode",
+	llvm::cl::desc("How to measure the length of a slice, see clpkm.sh "
+	               "(clock, cost or flag, default: clock)"),
+	llvm::cl::init("clock"), llvm::cl::cat(DriverCat));
+static llvm::cl::opt<std::string> OptCacheDir(
+	"cache-dir",
+	llvm::cl::desc("Keep instrumented code and the precompiled libclc header "
+	               "here, empty to disable"),
+	llvm::cl::value_desc("directory"), llvm::cl::cat(DriverCat));
+static llvm::cl::opt<bool> OptTiming(
+	"timing", llvm::cl::desc("Report time spent in each stage to stderr"),
+	llvm::cl::init(false), llvm::cl::cat(DriverCat));
+
+// Same as CLPKMCC
+static llvm::cl::opt<KernelProfile::prv_layout> OptPrvLayout(
+	"private-layout",
+	llvm::cl::desc("Specify the layout of the private live value buffer"),
+	llvm::cl::values(
+		clEnumValN(KernelProfile::prv_layout::CONTIGUOUS, "contiguous",
+		           "Each work-item owns a contiguous chunk (default)"),
+		clEnumValN(KernelProfile::prv_layout::INTERLEAVED, "interleaved",
+		           "Interleave words of work-items for coalesced access")),
+	llvm::cl::init(KernelProfile::prv_layout::CONTIGUOUS),
+	llvm::cl::cat(DriverCat));
+static llvm::cl::opt<bool> OptLivenessReport(
+	"liveness-report",
+	llvm::cl::desc("Report variables saved at each checkpoint site"),
+	llvm::cl::init(false), llvm::cl::cat(DriverCat));
+static llvm::cl::opt<CostTable::device_class> OptCostModel(
+	"cost-model",
+	llvm::cl::desc("Specify the device class to estimate cost for"),
+	llvm::cl::values(
+		clEnumValN(CostTable::device_class::GPU, "gpu", "GPUs (default)"),
+		clEnumValN(CostTable::device_class::CPU, "cpu", "CPUs")),
+	llvm::cl::init(CostTable::device_class::GPU),
+	llvm::cl::cat(DriverCat));
+static llvm::cl::opt<std::string> OptCostTable(
+	"cost-table",
+	llvm::cl::desc("Override weights of the cost model with a YAML file"),
+	llvm::cl::value_desc("filename"), llvm::cl::cat(DriverCat));
+static llvm::cl::opt<unsigned> OptPollStride(
+	"poll-stride",
+	llvm::cl::desc("Poll for checkpoint every N iterations of loops, which "
+	               "must be a power of 2 (default: 0, derived at run-time)"),
+	llvm::cl::value_desc("N"), llvm::cl::init(0), llvm::cl::cat(DriverCat));
+static llvm::cl::opt<unsigned> OptHoistCostLimit(
+	"hoist-cost-limit",
+	llvm::cl::desc("Don't instrument loops with constant trip count whose "
+	               "estimated total cost is no more than this (default: 256)"),
+	llvm::cl::init(256), llvm::cl::cat(DriverCat));
+static llvm::cl::opt<bool> OptEmitPristine(
+	"emit-pristine",
+	llvm::cl::desc("Emit an uninstrumented clone of each kernel (default: true)"),
+	llvm::cl::init(true), llvm::cl::cat(DriverCat));
+
+
+
+namespace {
+
+// Pad log lines by 4 spaces and wrap them at 76 columns, leaving banners
+// alone, as clpkm.sh did
+void DumpDiag(llvm::StringRef Log, llvm::raw_ostream& Err) {
+
+	while (!Log.empty()) {
+		llvm::StringRef Line;
+		std::tie(Line, Log) = Log.split('\n');
+		Line = Line.rtrim();
+		if (Line.empty())
+			Err << '\n';
+		else if (Line.startswith("-   ") && Line.endswith(":"))
+			Err << Line << '\n';
+		else {
+			for (; !Line.empty(); Line = Line.substr(76))
+				Err << "    " << Line.take_front(76) << '\n';
+			}
+		}
+
+	}
+
+void EmitToolkit(llvm::raw_ostream& Out) {
+
+	if (OptSlicingMode == "cost")
+		Out << "#define CLPKM_SLICE_BY_COST\n";
+	else if (OptSlicingMode == "flag")
+		Out << "#define CLPKM_PREEMPT_BY_FLAG\n";
+
+	if (!OptToolkit.empty()) {
+		if (auto Buffer = llvm::MemoryBuffer::getFile(OptToolkit))
+			Out << Buffer.get()->getBuffer();
+		}
+
+	}
+
+// Write to a temporary file and rename it, so that concurrent builds never
+// see a partial file
+bool Publish(const std::string& Path, llvm::StringRef Content) {
+
+	llvm::SmallString<128> TmpPath;
+	int Fd = -1;
+
+	if (llvm::sys::fs::createUniqueFile(Path + ".%%%%%%.tmp", Fd, TmpPath))
+		return false;
+
+	{
+		llvm::raw_fd_ostream OS(Fd, /*shouldClose=*/true);
+		OS << Content;
+		OS.close();
+		if (OS.has_error()) {
+			OS.clear_error();
+			llvm::sys::fs::remove(TmpPath);
+			return false;
+			}
+	}
+
+	if (llvm::sys::fs::rename(TmpPath, Path)) {
+		llvm::sys::fs::remove(TmpPath);
+		return false;
+		}
+
+	return true;
+
+	}
+
+std::string getHash(llvm::ArrayRef<llvm::StringRef> Data) {
+
+	llvm::SHA1 Hash;
+
+	for (const auto& D : Data) {
+		Hash.update(D);
+		Hash.update(llvm::StringRef("\0", 1));
+		}
+
+	return llvm::toHex(Hash.final());
+
+	}
+
+std::string getTiming(const Pipeline& P) {
+
+	std::string Timing;
+	llvm::raw_string_ostream OS(Timing);
+
+	OS << "-   Timing:\n";
+	for (const auto& T : P.getTiming())
+		OS << "    " << llvm::left_justify(T.Name, 20)
+		   << llvm::format("%10.3f ms\n", T.Millisec);
+
+	return OS.str();
+
+	}
+
+// What the code cache is keyed by in addition to the source
+std::vector<std::string> FlagArgs;
+
+}
+
+
+
+
+bool CLPKM::ParseFlags(int ArgCount, const char* const* ArgVar) {
+
+	FlagArgs.assign(ArgVar + 1, ArgVar + ArgCount);
+
+	llvm::cl::HideUnrelatedOptions(DriverCat);
+	return llvm::cl::ParseCommandLineOptions(ArgCount, ArgVar, "CLPKM driver\n",
+	                                         &llvm::errs());
+
+	}
+
+std::vector<std::string> CLPKM::SplitOptions(llvm::ArrayRef<const char*> Args) {
+
+	llvm::BumpPtrAllocator Alloc;
+	llvm::StringSaver Saver(Alloc);
+	llvm::SmallVector<const char*, 16> Tokens;
+
+	for (const char* Arg : Args)
+		llvm::cl::TokenizeGNUCommandLine(Arg, Saver, Tokens);
+
+	return std::vector<std::string>(Tokens.begin(), Tokens.end());
+
+	}
+
+bool CLPKM::InstrumentSource(llvm::StringRef Source,
+                             const std::vector<std::string>& Options,
+                             InstrumentResult& Result) {
+
+	PipelineConfig Config;
+	Config.PCHDir = OptCacheDir;
+	Config.Instr.PrvLayout = OptPrvLayout;
+	Config.Instr.LivenessReport = OptLivenessReport;
+	Config.Instr.Cost = CostTable::Get(OptCostModel);
+	Config.Instr.PollStride = OptPollStride;
+	Config.Instr.HoistCostLimit = OptHoistCostLimit;
+	Config.Instr.EmitPristine = OptEmitPristine;
+
+	Pipeline P(Options, Config);
+
+	std::string JoinedOpts;
+	for (const auto& Opt : Options)
+		JoinedOpts.append("'").append(Opt).append("' ");
+	P.AppendLog("Options", JoinedOpts + "\n");
+
+	auto Fail = [&](llvm::StringRef Msg) -> bool {
+		if (!Msg.empty())
+			P.AppendLog("Driver", Msg.str() + "\n");
+		Result.Source.clear();
+		llvm::raw_string_ostream OS(Result.Source);
+		DumpDiag(P.getLog(), OS);
+		OS.flush();
+		return false;
+		};
+
+	if (OptPollStride & (OptPollStride - 1))
+		return Fail("Poll stride must be a power of 2");
+
+	// Apply user-specified weights
+	if (!OptCostTable.empty()) {
+		auto Buffer = llvm::MemoryBuffer::getFile(OptCostTable);
+		if (!Buffer)
+			return Fail("Failed to open cost table: " +
+			            Buffer.getError().message());
+		llvm::yaml::Input YIn(Buffer.get()->getBuffer());
+		YIn >> Config.Instr.Cost;
+		if (YIn.error())
+			return Fail("Failed to parse cost table: " + YIn.error().message());
+		}
+
+	// Step 1
+	// Macro expansion
+	std::string Preproced;
+
+	if (!P.Preprocess(Source, Preproced))
+		return Fail("");
+
+	auto Emit = [&](llvm::StringRef Instred) {
+		Result.Source.clear();
+		llvm::raw_string_ostream OS(Result.Source);
+		EmitToolkit(OS);
+		OS << Instred;
+		OS.flush();
+		if (OptTiming)
+			Result.Timing = getTiming(P);
+		};
+
+	// Lookup code cache
+	// Driver options are part of the key as they change the generated code
+	std::string CacheBase;
+
+	if (!OptCacheDir.empty()) {
+		std::vector<llvm::StringRef> OptKey(FlagArgs.begin(), FlagArgs.end());
+		OptKey.emplace_back("--");
+		OptKey.insert(OptKey.end(), Options.begin(), Options.end());
+		llvm::SmallString<128> Path(OptCacheDir);
+		llvm::sys::path::append(Path, getHash({Preproced}) + "-" +
+		                              getHash(OptKey));
+		CacheBase = Path.str();
+
+		auto CachedCode = llvm::MemoryBuffer::getFile(CacheBase + ".cl");
+		auto CachedYaml = llvm::MemoryBuffer::getFile(CacheBase + ".yaml");
+
+		if (CachedCode && CachedYaml) {
+			ProfileList PL;
+			llvm::yaml::Input YIn(CachedYaml.get()->getBuffer());
+			YIn >> PL;
+			// Build again if the entry is unreadable
+			if (!YIn.error()) {
+				Result.PL = std::move(PL);
+				Emit(CachedCode.get()->getBuffer());
+				return true;
+				}
+			}
+		}
+
+	// Step 2
+	// Add braces, rename, inline and instrument
+	std::string Instred;
+	ProfileList PL;
+
+	if (!P.Instrument(Preproced, Instred, PL))
+		return Fail("");
+
+	// Cache the result, the profile first as lookups need both
+	if (!CacheBase.empty()) {
+		std::string Yaml;
+		llvm::raw_string_ostream YamlOS(Yaml);
+		{
+			llvm::yaml::Output YOut(YamlOS);
+			YOut << PL;
+		}
+		YamlOS.flush();
+		llvm::sys::fs::create_directories(OptCacheDir);
+		if (Publish(CacheBase + ".yaml", Yaml))
+			Publish(CacheBase + ".cl", Instred);
+		}
+
+	Result.PL = std::move(PL);
+	Emit(Instred);
+	return true;
+
+	}
@@ -0,0 +1,51 @@
+/*
+  Instrument.hpp
+
+  Instrument a program from its original source, sharing the code cache with
+  other processes, which is what both clpkm-driver and libclpkmcc do
+
+*/
+
+#ifndef __CLPKM__INSTRUMENT_HPP__
+#define __CLPKM__INSTRUMENT_HPP__
+
+#include "InstrumentAPI.hpp"
+#include "KernelProfile.hpp"
+
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+#include <vector>
+
+
+
+namespace CLPKM {
+
+struct InstrumentResult {
+	// Instrumented code, led by the toolkit, on success
+	// Log of all stages on failure
+	std::string Source;
+
+	ProfileList PL;
+
+	// Time spent in each stage, only if "--timing" is given
+	std::string Timing;
+	};
+
+// Parse options to the driver, i.e. what comes before "--"
+// ArgVar[0] is the program name
+// Returns false if any option is invalid, with messages printed to stderr
+bool ParseFlags(int ArgCount, const char* const* ArgVar);
+
+// Split build options, which the runtime passes as a single string
+std::vector<std::string> SplitOptions(llvm::ArrayRef<const char*> Args);
+
+bool InstrumentSource(llvm::StringRef Source,
+                      const std::vector<std::string>& Options,
+                      InstrumentResult& Result);
+
+}
+
+
+
+#endif
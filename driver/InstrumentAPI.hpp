@@ -0,0 +1,72 @@
+/*
+  InstrumentAPI.hpp
+
+  Interface of libclpkmcc, the instrumentation pipeline as a plugin of the
+  runtime, which is loaded with dlopen so that the runtime does not link LLVM
+
+*/
+
+#ifndef __CLPKM__INSTRUMENT_API_HPP__
+#define __CLPKM__INSTRUMENT_API_HPP__
+
+#include <cstddef>
+
+
+
+// Bumped whenever the interface below changes
+#define CLPKMCC_API_VERSION 2
+
+// Only C types cross the boundary, as the plugin may be built by another
+// compiler against another C++ standard library, and is loaded with
+// RTLD_DEEPBIND, so it doesn't share the allocator with the runtime either
+extern "C" {
+
+// See KernelProfile.hpp for the fields
+struct clpkmcc_profile {
+	const char*     Name;
+	unsigned        NumOfParam;
+	size_t          ReqPrvSize;
+	size_t          ReqLocSize;
+	unsigned        PrvLayout;
+	const char*     PristineName;
+	bool            Compactable;
+	const unsigned* LocPtrParamIdx;
+	size_t          NumOfLocPtrParam;
+	};
+
+// Strings are NUL-terminated as well
+// Owned by the plugin, and shall be released with clpkmcc_free_result
+struct clpkmcc_result {
+	// Instrumented code, led by the toolkit, on success
+	// Log of all stages on failure
+	char*  Source;
+	size_t SourceSize;
+
+	// Valid on success
+	clpkmcc_profile* Profile;
+	size_t           NumOfProfile;
+
+	// Time spent in each stage, only if "--timing" is given
+	char*  Timing;
+	size_t TimingSize;
+	};
+
+// Returns CLPKMCC_API_VERSION the plugin is built with
+using clpkmcc_api_version_t = unsigned (*)();
+
+// Flags are what clpkm-driver takes before "--", and only those of the first
+// call take effect
+// Options are build options as passed to clBuildProgram
+// Result is filled in either way
+// Safe to call from multiple threads
+using clpkmcc_instrument_t = bool (*)(const char* Source, size_t SourceSize,
+                                      const char* Options, const char* Flags,
+                                      clpkmcc_result* Result);
+
+using clpkmcc_free_result_t = void (*)(clpkmcc_result* Result);
+
+}
+
+
+
+#endif
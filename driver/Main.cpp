@@ -0,0 +1,66 @@
+//===----------------------------------------------------------------------===//
+// CLPKM driver
+//
+// Does what clpkm.sh used to do with a chain of tools, in a single process
+//
+// -   The source is read from stdin
+// -   Instrumented code will be emitted to stdout
+// -   Kernel profile in YAML will be emitted to stderr
+// -   On failure, nothing will be emitted to stdout, and log is emitted to
+//     stderr
+//
+// Options to the driver come before "--", and build options after. If there
+// is no "--", all arguments are build options.
+//===----------------------------------------------------------------------===//
+
+#include "Instrument.hpp"
+
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/YAMLTraits.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+
+int main(int ArgCount, const char* ArgVar[]) {
+
+	const char** ArgEnd = ArgVar + ArgCount;
+	const char** Sep = std::find_if(ArgVar + 1, ArgEnd, [](const char* Arg) {
+		return strcmp(Arg, "--") == 0;
+		});
+
+	const char** FlagEnd = (Sep != ArgEnd) ? Sep : ArgVar + 1;
+	const char** BuildArgs = (Sep != ArgEnd) ? Sep + 1 : ArgVar + 1;
+
+	if (!CLPKM::ParseFlags(static_cast<int>(FlagEnd - ArgVar), ArgVar))
+		return 1;
+
+	// Read source code from stdin
+	auto Source = llvm::MemoryBuffer::getSTDIN();
+
+	if (!Source) {
+		llvm::errs() << "-   Driver:\n    Failed to read source: "
+		             << Source.getError().message() << '\n';
+		return 1;
+		}
+
+	CLPKM::InstrumentResult Result;
+
+	if (!CLPKM::InstrumentSource(Source.get()->getBuffer(),
+	                             CLPKM::SplitOptions({BuildArgs, ArgEnd}),
+	                             Result)) {
+		llvm::errs() << Result.Source;
+		return 1;
+		}
+
+	llvm::outs() << Result.Source;
+	llvm::errs() << Result.Timing;
+
+	llvm::yaml::Output YOut(llvm::errs());
+	YOut << Result.PL;
+
+	return 0;
+
+	}
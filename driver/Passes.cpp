@@ -0,0 +1,286 @@
+/*
+  Passes.cpp
+
+  Frontend actions run by the driver (impl)
+
+*/
+
+#include "Passes.hpp"
+
+#include "clang/AST/AST.h"
+#include "clang/AST/ASTConsumer.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Frontend/Utils.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Lex/Preprocessor.h"
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+using namespace clang;
+
+
+
+namespace {
+
+// Traverse only declarations in the main file, i.e. skip libclc
+template <class VisitorTy>
+class MainFileConsumer : public ASTConsumer {
+public:
+	template <class ... P>
+	MainFileConsumer(const SourceManager& SM, P&& ... Param)
+	: TheSM(SM), Visitor(std::forward<P>(Param)...) { }
+
+	bool HandleTopLevelDecl(DeclGroupRef DeclGroup) override {
+
+		for (auto& Decl : DeclGroup) {
+			if (Decl != nullptr &&
+			    TheSM.isInMainFile(TheSM.getExpansionLoc(Decl->getLocation())))
+				Visitor.TraverseDecl(Decl);
+			}
+
+		return true;
+
+		}
+
+private:
+	const SourceManager& TheSM;
+	VisitorTy            Visitor;
+
+	};
+
+class BraceInserter : public RecursiveASTVisitor<BraceInserter> {
+public:
+	BraceInserter(Rewriter& R)
+	: TheRewriter(R), SM(R.getSourceMgr()) { }
+
+	bool VisitIfStmt(IfStmt* IS) {
+
+		Wrap(IS->getThen());
+
+		// Leave "else if" alone
+		if (Stmt* Else = IS->getElse(); Else != nullptr && !isa<IfStmt>(Else))
+			Wrap(Else);
+
+		return true;
+
+		}
+
+	bool VisitForStmt(ForStmt* FS) {
+		Wrap(FS->getBody());
+		return true;
+		}
+
+	bool VisitWhileStmt(WhileStmt* WS) {
+		Wrap(WS->getBody());
+		return true;
+		}
+
+	bool VisitDoStmt(DoStmt* DS) {
+		Wrap(DS->getBody());
+		return true;
+		}
+
+private:
+	void Wrap(Stmt* S) {
+
+		if (S == nullptr || isa<CompoundStmt>(S))
+			return;
+
+		SourceLocation Begin = SM.getExpansionLoc(S->getLocStart());
+		SourceLocation End = FindEndOfStmt(S);
+
+		if (Begin.isInvalid() || End.isInvalid() || !SM.isInMainFile(Begin))
+			return;
+
+		// Enclosing statements sharing the end are visited first, and thus
+		// their braces are closed last
+		TheRewriter.InsertTextBefore(Begin, "{");
+		TheRewriter.InsertTextAfter(End, "}");
+
+		}
+
+	// Location right after the statement, including its semicolon, which is
+	// not part of its source range
+	SourceLocation FindEndOfStmt(Stmt* S) {
+
+		const LangOptions& LO = TheRewriter.getLangOpts();
+		SourceLocation Loc = Lexer::getLocForEndOfToken(
+				SM.getExpansionLoc(S->getLocEnd()), 0, SM, LO);
+
+		if (Loc.isInvalid())
+			return Loc;
+
+		Token Tok;
+
+		if (!Lexer::getRawToken(Loc, Tok, SM, LO, /*IgnoreWhiteSpace=*/true) &&
+		    Tok.is(tok::semi))
+			Loc = Tok.getLocation().getLocWithOffset(Tok.getLength());
+
+		return Loc;
+
+		}
+
+	Rewriter&      TheRewriter;
+	SourceManager& SM;
+
+	};
+
+class Renamer : public RecursiveASTVisitor<Renamer> {
+public:
+	Renamer(Rewriter& R)
+	: TheRewriter(R), SM(R.getSourceMgr()), Nonce(0) { }
+
+	bool VisitVarDecl(VarDecl* VD) {
+
+		SourceLocation Loc = getFileLoc(VD->getLocation());
+
+		if (VD->getIdentifier() == nullptr || Loc.isInvalid())
+			return true;
+
+		std::string& Name = NewName[VD->getCanonicalDecl()];
+
+		if (Name.empty())
+			Name = "__R_" + std::to_string(++Nonce) + '_' + VD->getName().str();
+
+		TheRewriter.ReplaceText(Loc, VD->getName().size(), Name);
+		return true;
+
+		}
+
+	// Declarations are visited before references, and references to variables
+	// not renamed are left alone
+	bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+
+		auto* VD = dyn_cast_or_null<VarDecl>(DRE->getDecl());
+
+		if (VD == nullptr)
+			return true;
+
+		auto It = NewName.find(VD->getCanonicalDecl());
+		SourceLocation Loc = getFileLoc(DRE->getLocation());
+
+		if (It != NewName.end() && Loc.isValid())
+			TheRewriter.ReplaceText(Loc, VD->getName().size(), It->second);
+
+		return true;
+
+		}
+
+private:
+	// Where the name is spelled in the main file, or an invalid location if
+	// it cannot be renamed
+	SourceLocation getFileLoc(SourceLocation Loc) {
+
+		if (SM.isMacroArgExpansion(Loc))
+			Loc = SM.getSpellingLoc(Loc);
+
+		// Same as rename-lst-gen, variables in macros are left alone
+		if (Loc.isMacroID()) {
+			auto& D = SM.getDiagnostics();
+			auto  DiagID = D.getCustomDiagID(
+					DiagnosticsEngine::Level::Warning,
+					"cannot rename variables declared in macros");
+			D.Report(Loc, DiagID);
+			return SourceLocation();
+			}
+
+		return SM.isInMainFile(Loc) ? Loc : SourceLocation();
+
+		}
+
+	Rewriter&      TheRewriter;
+	SourceManager& SM;
+
+	std::unordered_map<const VarDecl*, std::string> NewName;
+	unsigned Nonce;
+
+	};
+
+class InstrumentConsumer : public ASTConsumer {
+public:
+	template <class ... P>
+	InstrumentConsumer(P&& ... Param)
+	: Visitor(std::forward<P>(Param)...) { }
+
+	bool HandleTopLevelDecl(DeclGroupRef DeclGroup) override {
+
+		for (auto& Decl : DeclGroup)
+			Visitor.TraverseDecl(Decl);
+
+		return true;
+
+		}
+
+private:
+	Instrumentor Visitor;
+
+	};
+
+}
+
+
+
+void PreprocessAction::ExecuteAction() {
+
+	CompilerInstance& CI = getCompilerInstance();
+	DoPrintPreprocessedInput(CI.getPreprocessor(), &Out,
+	                         CI.getPreprocessorOutputOpts());
+
+	}
+
+void RewriteAction::EndSourceFileAction() {
+
+	if (getCompilerInstance().getDiagnostics().hasErrorOccurred())
+		return;
+
+	SourceManager& SM = TheRewriter.getSourceMgr();
+	TheRewriter.getEditBuffer(SM.getMainFileID()).write(Out);
+
+	}
+
+bool RewriteAction::BeginInvocation(CompilerInstance& CI) {
+
+	// Suppress warnings not produced by CLPKM
+	CI.getDiagnostics().setIgnoreAllWarnings(true);
+	return true;
+
+	}
+
+std::unique_ptr<ASTConsumer> BraceAction::CreateASTConsumer(
+		CompilerInstance& CI, StringRef File) {
+
+	TheRewriter.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
+	return llvm::make_unique<MainFileConsumer<BraceInserter>>(
+			CI.getSourceManager(), TheRewriter);
+
+	}
+
+std::unique_ptr<ASTConsumer> RenameAction::CreateASTConsumer(
+		CompilerInstance& CI, StringRef File) {
+
+	TheRewriter.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
+	return llvm::make_unique<MainFileConsumer<Renamer>>(
+			CI.getSourceManager(), TheRewriter);
+
+	}
+
+std::unique_ptr<ASTConsumer> InstrumentAction::CreateASTConsumer(
+		CompilerInstance& CI, StringRef File) {
+
+	TheRewriter.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
+	return llvm::make_unique<InstrumentConsumer>(TheRewriter, CI, ThePL,
+	                                             TheConfig);
+
+	}
+
+bool CLCHeaderAction::BeginInvocation(CompilerInstance& CI) {
+
+	// The output is written to a temporary file and renamed, so concurrent
+	// builds never see a partial header
+	CI.getFrontendOpts().OutputFile = Path;
+	CI.getFrontendOpts().RelocatablePCH = false;
+	return true;
+
+	}
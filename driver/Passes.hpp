@@ -0,0 +1,108 @@
+/*
+  Passes.hpp
+
+  Frontend actions run by the driver, each of which takes the output of the
+  previous one as its main file and writes the rewritten source to a stream
+
+*/
+
+#ifndef __CLPKM__PASSES_HPP__
+#define __CLPKM__PASSES_HPP__
+
+#include "Instrumentor.hpp"
+#include "KernelProfile.hpp"
+
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Rewrite/Core/Rewriter.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <memory>
+
+
+
+// Macro expansion, as "clang -E -P" does
+class PreprocessAction : public clang::PreprocessorFrontendAction {
+public:
+	explicit PreprocessAction(llvm::raw_ostream& O)
+	: Out(O) { }
+
+	void ExecuteAction() override;
+
+private:
+	llvm::raw_ostream& Out;
+
+	};
+
+// Common part of actions rewriting the main file
+class RewriteAction : public clang::ASTFrontendAction {
+public:
+	explicit RewriteAction(llvm::raw_ostream& O)
+	: Out(O) { }
+
+	void EndSourceFileAction() override;
+
+	bool BeginInvocation(clang::CompilerInstance& CI) override;
+
+protected:
+	llvm::raw_ostream& Out;
+	clang::Rewriter    TheRewriter;
+
+	};
+
+// Add braces around bodies of if, for, while and do, which the inliner and
+// CLPKMCC rely on
+// This replaces clang-tidy's readability-braces-around-statements
+class BraceAction : public RewriteAction {
+public:
+	using RewriteAction::RewriteAction;
+
+	std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
+			clang::CompilerInstance& CI, llvm::StringRef File) override;
+
+	};
+
+// Give every variable declared in the main file a unique name, so that the
+// inliner can move them across functions
+// This replaces rename-lst-gen and clang-rename
+class RenameAction : public RewriteAction {
+public:
+	using RewriteAction::RewriteAction;
+
+	std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
+			clang::CompilerInstance& CI, llvm::StringRef File) override;
+
+	};
+
+// Instrument kernels, which is what CLPKMCC does
+class InstrumentAction : public RewriteAction {
+public:
+	InstrumentAction(llvm::raw_ostream& O, ProfileList& PL,
+	                 const InstrumentConfig& IC)
+	: RewriteAction(O), ThePL(PL), TheConfig(IC) { }
+
+	std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
+			clang::CompilerInstance& CI, llvm::StringRef File) override;
+
+private:
+	ProfileList&            ThePL;
+	const InstrumentConfig& TheConfig;
+
+	};
+
+// Build the precompiled header of libclc to Path
+class CLCHeaderAction : public clang::GeneratePCHAction {
+public:
+	explicit CLCHeaderAction(std::string P)
+	: Path(std::move(P)) { }
+
+	bool BeginInvocation(clang::CompilerInstance& CI) override;
+
+private:
+	std::string Path;
+
+	};
+
+
+
+#endif
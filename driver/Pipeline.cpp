@@ -0,0 +1,256 @@
+/*
+  Pipeline.cpp
+
+  Run the stages in memory (impl)
+
+*/
+
+#include "Pipeline.hpp"
+#include "Inliner.hpp"
+#include "Passes.hpp"
+
+#include "clang/Basic/Version.h"
+#include "clang/Format/Format.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Tooling/Core/Replacement.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+using namespace clang;
+
+
+
+namespace {
+
+// Whether the header is usable, checked once per process for each path, as
+// pipelines run concurrently if CLPKMCC is loaded by the runtime
+struct PCHState {
+	std::once_flag Checked;
+	bool           Usable = false;
+	};
+
+std::mutex PCHMutex;
+std::unordered_map<std::string, std::unique_ptr<PCHState>> PCHStates;
+
+}
+
+
+Pipeline::Pipeline(std::vector<std::string> Opts, const PipelineConfig& C)
+: Options(std::move(Opts)), Config(C),
+  Files(new FileManager(FileSystemOptions())) {
+
+	// The header depends on the compiler and the build options, e.g. macros
+	if (!Config.PCHDir.empty()) {
+		llvm::SHA1 Hash;
+		Hash.update(getClangFullVersion());
+		for (const auto& Opt : Options) {
+			Hash.update(Opt);
+			Hash.update(llvm::StringRef("\0", 1));
+			}
+		llvm::SmallString<128> Path(Config.PCHDir);
+		llvm::sys::path::append(Path, "clc-" + llvm::toHex(Hash.final()) + ".pch");
+		PCHPath = Path.str();
+		}
+
+	}
+
+bool Pipeline::Preprocess(llvm::StringRef Source, std::string& Out) {
+
+	// NOTE: Preprocess in advance here may break things!
+	//       Please have a look at OpenCL 1.2 §6.10
+	llvm::raw_string_ostream OS(Out);
+	bool Succeed = RunStage("Preprocess stage", new PreprocessAction(OS),
+	                        Source, false);
+	OS.flush();
+	return Succeed;
+
+	}
+
+bool Pipeline::Instrument(llvm::StringRef Preprocessed, std::string& Out,
+                          ProfileList& PL) {
+
+	std::string Braced, Renamed, Inlined, Instred;
+
+	auto Run = [&](const char* Name, auto* FA, llvm::raw_string_ostream& OS,
+	               llvm::StringRef Code) -> bool {
+		bool Succeed = RunStage(Name, FA, Code, true);
+		OS.flush();
+		return Succeed;
+		};
+
+	llvm::raw_string_ostream BracedOS(Braced), RenamedOS(Renamed),
+	                         InlinedOS(Inlined), InstredOS(Instred);
+
+	if (!Run("Brace stage", new BraceAction(BracedOS), BracedOS,
+	         Preprocessed) ||
+	    !Run("Rename stage", new RenameAction(RenamedOS), RenamedOS, Braced) ||
+	    !Run("Inline stage", new InlinerFrontendAction(InlinedOS), InlinedOS,
+	         Renamed) ||
+	    !Run("Instrument stage",
+	         new InstrumentAction(InstredOS, PL, Config.Instr), InstredOS,
+	         Inlined))
+		return false;
+
+	// Prettify, as clang-format -style=llvm did
+	auto Start = std::chrono::high_resolution_clock::now();
+
+	auto Replaces = format::reformat(format::getLLVMStyle(), Instred,
+	                                 {tooling::Range(0, Instred.size())});
+	auto Formatted = tooling::applyAllReplacements(Instred, Replaces);
+
+	if (Formatted)
+		Out = std::move(*Formatted);
+	else {
+		llvm::consumeError(Formatted.takeError());
+		Out = std::move(Instred);
+		}
+
+	std::chrono::duration<double, std::milli> Elapsed =
+			std::chrono::high_resolution_clock::now() - Start;
+	Timing.push_back({"Format stage", Elapsed.count()});
+
+	return true;
+
+	}
+
+void Pipeline::AppendLog(const char* Banner, llvm::StringRef Msg) {
+	Log.append("-   ").append(Banner).append(":\n");
+	Log.append(Msg.data(), Msg.size());
+	}
+
+bool Pipeline::RunStage(const char* Name, FrontendAction* FA,
+                        llvm::StringRef Code, bool WithCLC) {
+
+	// Each stage gets its own main file, as the shared file manager remembers
+	// the size of files it has seen
+	std::string Input = "clpkm-" + std::to_string(Timing.size()) + ".cl";
+	std::vector<std::string> Args = {"clpkm-driver"};
+
+	if (WithCLC)
+		Args.emplace_back("-fsyntax-only");
+	else
+		Args.insert(Args.end(), {"-E", "-P"});
+
+	Args.insert(Args.end(), {"-x", "cl", "-std=cl1.2"});
+
+	if (WithCLC) {
+		auto CLCArgs = getCLCArgs();
+		Args.insert(Args.end(), CLCArgs.begin(), CLCArgs.end());
+		}
+
+	Args.insert(Args.end(), Options.begin(), Options.end());
+	Args.emplace_back(Input);
+
+	auto Start = std::chrono::high_resolution_clock::now();
+
+	std::string StageLog;
+	bool Succeed = Invoke(std::move(Args), FA, Input, Code, StageLog);
+
+	std::chrono::duration<double, std::milli> Elapsed =
+			std::chrono::high_resolution_clock::now() - Start;
+	Timing.push_back({Name, Elapsed.count()});
+
+	AppendLog(Name, StageLog);
+	return Succeed;
+
+	}
+
+bool Pipeline::Invoke(std::vector<std::string> Args, FrontendAction* FA,
+                      llvm::StringRef Input, llvm::StringRef Code,
+                      std::string& StageLog) {
+
+	llvm::raw_string_ostream LogStream(StageLog);
+	IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts = new DiagnosticOptions();
+	TextDiagnosticPrinter Printer(LogStream, &*DiagOpts);
+
+	tooling::ToolInvocation Invocation(std::move(Args), FA, Files.get());
+	Invocation.mapVirtualFile(Input, Code);
+	Invocation.setDiagnosticConsumer(&Printer);
+
+	bool Succeed = Invocation.run();
+	LogStream.flush();
+	return Succeed;
+
+	}
+
+std::vector<std::string> Pipeline::getCLCArgs() {
+
+	if (!PCHPath.empty()) {
+		PCHState* State = nullptr;
+		{
+			std::lock_guard<std::mutex> Lock(PCHMutex);
+			auto& Entry = PCHStates[PCHPath];
+			if (Entry == nullptr)
+				Entry = std::make_unique<PCHState>();
+			State = Entry.get();
+		}
+		// A header left by an earlier run may be stale, e.g. libclc has been
+		// updated since, which is found by loading it with an empty file
+		// It's not removed before rebuilding, as other processes may be loading
+		// it, but replaced by renaming the new one over it
+		std::call_once(State->Checked, [&] {
+			State->Usable = (llvm::sys::fs::exists(PCHPath) && CheckPCH()) ||
+			                BuildPCH();
+			});
+		if (!State->Usable)
+			PCHPath.clear();
+		}
+
+	if (PCHPath.empty())
+		return {"-include", "clc/clc.h"};
+
+	return {"-include-pch", PCHPath};
+
+	}
+
+bool Pipeline::CheckPCH() {
+
+	std::vector<std::string> Args = {"clpkm-driver", "-fsyntax-only",
+	                                 "-x", "cl", "-std=cl1.2",
+	                                 "-include-pch", PCHPath};
+	Args.insert(Args.end(), Options.begin(), Options.end());
+	Args.emplace_back("clpkm-check.cl");
+
+	std::string StageLog;
+	return Invoke(std::move(Args), new SyntaxOnlyAction(), "clpkm-check.cl", "",
+	              StageLog);
+
+	}
+
+bool Pipeline::BuildPCH() {
+
+	auto Start = std::chrono::high_resolution_clock::now();
+
+	std::vector<std::string> Args = {"clpkm-driver", "-fsyntax-only",
+	                                 "-x", "cl", "-std=cl1.2"};
+	Args.insert(Args.end(), Options.begin(), Options.end());
+	Args.emplace_back("clpkm-clc.cl");
+
+	llvm::sys::fs::create_directories(Config.PCHDir);
+
+	std::string StageLog;
+	bool Succeed = Invoke(std::move(Args), new CLCHeaderAction(PCHPath),
+	                      "clpkm-clc.cl", "#include <clc/clc.h>\n", StageLog);
+
+	std::chrono::duration<double, std::milli> Elapsed =
+			std::chrono::high_resolution_clock::now() - Start;
+	Timing.push_back({"Header stage", Elapsed.count()});
+
+	// Not fatal, the header is included in every stage instead
+	if (!Succeed)
+		AppendLog("Header stage", StageLog);
+
+	return Succeed;
+
+	}
@@ -0,0 +1,89 @@
+/*
+  Pipeline.hpp
+
+  Run the stages clpkm.sh used to run as separate tools, in memory and in a
+  single process
+
+*/
+
+#ifndef __CLPKM__PIPELINE_HPP__
+#define __CLPKM__PIPELINE_HPP__
+
+#include "Instrumentor.hpp"
+#include "KernelProfile.hpp"
+
+#include "clang/Basic/FileManager.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+#include <vector>
+
+
+
+struct PipelineConfig {
+	InstrumentConfig Instr;
+
+	// Where to keep the precompiled libclc header, empty to include the
+	// header in every stage instead
+	std::string PCHDir;
+	};
+
+class Pipeline {
+public:
+	struct StageTime {
+		const char* Name;
+		double      Millisec;
+		};
+
+	// Options are the build options split into arguments
+	Pipeline(std::vector<std::string> Opts, const PipelineConfig& Config);
+
+	// Expand macros, as "clang -E -P"
+	bool Preprocess(llvm::StringRef Source, std::string& Out);
+
+	// Add braces, rename, inline, instrument and format the preprocessed source
+	bool Instrument(llvm::StringRef Preprocessed, std::string& Out,
+	                ProfileList& PL);
+
+	// Diagnostics of all stages, each led by a banner "-   <Stage>:"
+	const std::string& getLog() const { return Log; }
+
+	const std::vector<StageTime>& getTiming() const { return Timing; }
+
+	void AppendLog(const char* Banner, llvm::StringRef Msg);
+
+private:
+	// The action is owned by the stage
+	bool RunStage(const char* Name, clang::FrontendAction* FA,
+	              llvm::StringRef Code, bool WithCLC);
+
+	// Run an action on Code, which is mapped to Input
+	bool Invoke(std::vector<std::string> Args, clang::FrontendAction* FA,
+	            llvm::StringRef Input, llvm::StringRef Code,
+	            std::string& StageLog);
+
+	// Returns arguments to include libclc, building its precompiled header on
+	// first use
+	std::vector<std::string> getCLCArgs();
+
+	bool CheckPCH();
+	bool BuildPCH();
+
+	std::vector<std::string> Options;
+	const PipelineConfig&    Config;
+
+	// Shared among stages, so that headers are looked up only once
+	llvm::IntrusiveRefCntPtr<clang::FileManager> Files;
+
+	std::string PCHPath;
+
+	std::string            Log;
+	std::vector<StageTime> Timing;
+
+	};
+
+
+
+#endif
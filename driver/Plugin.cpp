@@ -0,0 +1,104 @@
+/*
+  Plugin.cpp
+
+  Entry points of libclpkmcc, see InstrumentAPI.hpp
+
+*/
+
+#include "Instrument.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+
+namespace {
+std::once_flag FlagsParsed;
+bool FlagsValid = false;
+
+char* CopyString(const std::string& Str, size_t* Size = nullptr) {
+	char* Out = new char[Str.size() + 1];
+	memcpy(Out, Str.c_str(), Str.size() + 1);
+	if (Size != nullptr)
+		*Size = Str.size();
+	return Out;
+	}
+
+// Copy R out to Result, which only holds C types
+void Export(const CLPKM::InstrumentResult& R, clpkmcc_result* Result) {
+	Result->Source = CopyString(R.Source, &Result->SourceSize);
+	Result->Timing = CopyString(R.Timing, &Result->TimingSize);
+	Result->NumOfProfile = R.PL.size();
+	Result->Profile = new clpkmcc_profile[R.PL.size()];
+	for (size_t Idx = 0; Idx < R.PL.size(); ++Idx) {
+		const KernelProfile& KP = R.PL[Idx];
+		clpkmcc_profile& Out = Result->Profile[Idx];
+		Out.Name = CopyString(KP.Name);
+		Out.NumOfParam = KP.NumOfParam;
+		Out.ReqPrvSize = KP.ReqPrvSize;
+		Out.ReqLocSize = KP.ReqLocSize;
+		Out.PrvLayout = static_cast<unsigned>(KP.PrvLayout);
+		Out.PristineName = CopyString(KP.PristineName);
+		Out.Compactable = KP.Compactable;
+		unsigned* Idxs = new unsigned[KP.LocPtrParamIdx.size()];
+		std::copy(KP.LocPtrParamIdx.begin(), KP.LocPtrParamIdx.end(), Idxs);
+		Out.LocPtrParamIdx = Idxs;
+		Out.NumOfLocPtrParam = KP.LocPtrParamIdx.size();
+		}
+	}
+}
+
+
+
+extern "C" unsigned clpkmcc_api_version() {
+	return CLPKMCC_API_VERSION;
+	}
+
+extern "C" bool clpkmcc_instrument(const char* Source, size_t SourceSize,
+                                   const char* Options, const char* Flags,
+                                   clpkmcc_result* Result) {
+
+	// Options of LLVM are process-wide, so they are parsed only once
+	std::call_once(FlagsParsed, [Flags]() {
+		std::vector<std::string> Args = CLPKM::SplitOptions({Flags ? Flags : ""});
+		std::vector<const char*> ArgVar = {"libclpkmcc"};
+		for (const auto& Arg : Args)
+			ArgVar.emplace_back(Arg.c_str());
+		FlagsValid = CLPKM::ParseFlags(static_cast<int>(ArgVar.size()),
+		                              ArgVar.data());
+		});
+
+	CLPKM::InstrumentResult R;
+	bool Succeed = false;
+
+	if (!FlagsValid) {
+		R.Source = "-   Driver:\n    Invalid flags: ";
+		R.Source.append(Flags ? Flags : "").append("\n");
+		}
+	else
+		Succeed = CLPKM::InstrumentSource(
+				llvm::StringRef(Source, SourceSize),
+				CLPKM::SplitOptions({Options ? Options : ""}), R);
+
+	Export(R, Result);
+	return Succeed;
+
+	}
+
+extern "C" void clpkmcc_free_result(clpkmcc_result* Result) {
+
+	for (size_t Idx = 0; Idx < Result->NumOfProfile; ++Idx) {
+		delete[] Result->Profile[Idx].Name;
+		delete[] Result->Profile[Idx].PristineName;
+		delete[] Result->Profile[Idx].LocPtrParamIdx;
+		}
+
+	delete[] Result->Profile;
+	delete[] Result->Source;
+	delete[] Result->Timing;
+	*Result = clpkmcc_result{};
+
+	}
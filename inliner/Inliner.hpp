@@ -0,0 +1,76 @@
+//===----------------------------------------------------------------------===//
+// CLPKMPP
+//
+// Inline calls to user functions into kernels, shared by clinliner and
+// clpkm-driver
+//===----------------------------------------------------------------------===//
+
+#ifndef __CLPKM__INLINER_HPP__
+#define __CLPKM__INLINER_HPP__
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Rewrite/Core/Rewriter.h"
+#include "llvm/Support/raw_ostream.h"
+
+
+
+using CallSiteTable = std::unordered_map<clang::FunctionDecl*,
+                                         std::deque<clang::CallExpr*>>;
+using RetStmtTable = std::unordered_map<clang::FunctionDecl*,
+                                        std::deque<clang::ReturnStmt*>>;
+using CodeSnippet = std::deque<std::string>;
+using CodeCache = std::unordered_map<clang::FunctionDecl*, CodeSnippet>;
+
+
+
+// The inlined source is written to Out, unless any error occurred
+class InlinerFrontendAction : public clang::ASTFrontendAction {
+public:
+	InlinerFrontendAction()
+	: Out(llvm::outs()), Nonce(0) { }
+
+	explicit InlinerFrontendAction(llvm::raw_ostream& O)
+	: Out(O), Nonce(0) { }
+
+	void EndSourceFileAction() override;
+
+	std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
+			clang::CompilerInstance &CI, llvm::StringRef file) override;
+
+	bool BeginInvocation(clang::CompilerInstance &CI) override;
+
+	void ExecuteAction() override;
+
+private:
+	llvm::raw_ostream& Out;
+
+	clang::Rewriter InlinerRewriter;
+	CallSiteTable   CST;
+	RetStmtTable    RST;
+	CodeCache       CC;
+	size_t          Nonce;
+
+	clang::SourceLocation ExpandStartLoc(clang::SourceLocation StartLoc);
+	clang::SourceLocation ExpandEndLoc(clang::SourceLocation EndLoc);
+	clang::SourceRange ExpandRange(clang::SourceRange Range);
+
+	// Generate code snippet for inlining
+	bool GenCodeSnippet(clang::FunctionDecl* FuncDecl,
+	                    std::vector<clang::FunctionDecl*>& CallChain);
+
+	bool PerformInline(clang::FunctionDecl* FuncDecl,
+	                   std::vector<clang::FunctionDecl*>& CallChain);
+
+	};
+
+
+
+#endif
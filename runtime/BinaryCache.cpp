@@ -0,0 +1,614 @@
+/*
+  BinaryCache.cpp
+
+  Shadow programs kept on disk (impl)
+
+*/
+
+#include "BinaryCache.hpp"
+#include "ErrorHandling.hpp"
+#include "LookupVendorImpl.hpp"
+#include "RuntimeKeeper.hpp"
+#include "ScheduleService.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+using namespace CLPKM;
+
+
+
+// Bump on any change to the entry or the index layout
+constexpr char     EntryMagic[] = "CLPKMBC1";
+// Bump on any change to the instrumented code the runtime expects, which
+// isn't reflected in the stamp of the compiler
+constexpr char     ABIVersion[] = "1";
+constexpr uint64_t IndexMagic = 0x325844494D4B504CULL;
+constexpr size_t   NumOfSlot = 1024;
+
+struct BinaryCache::IndexSlot {
+	// Both zero if the slot is free
+	uint64_t Hi;
+	uint64_t Lo;
+	uint64_t Size;
+	uint64_t LastUse;
+	};
+
+struct BinaryCache::IndexFile {
+	uint64_t  Magic;
+	// Logical clock, bumped on every lookup and insertion
+	uint64_t  Clock;
+	IndexSlot Slot[NumOfSlot];
+	};
+
+
+
+namespace {
+
+constexpr size_t DefaultLimit = 512;
+
+// FNV-1a, twice with different offsets, which is plenty as the key is stored
+// in the entry and compared on lookup
+void Hash(const std::string& Key, uint64_t& Hi, uint64_t& Lo) {
+	Hi = 0xcbf29ce484222325ULL;
+	Lo = 0x84222325cbf29ce4ULL;
+	for (unsigned char C : Key) {
+		Hi = (Hi ^ C) * 0x100000001b3ULL;
+		Lo = (Lo ^ C) * 0x100000001b3ULL;
+		}
+	}
+
+// Length-prefixed, so that fields can't run into each other
+void Append(std::string& Key, const std::string& Field) {
+	Key += std::to_string(Field.size());
+	Key += ':';
+	Key += Field;
+	}
+
+// The runtime has no preprocessor to find out whether headers included by the
+// source have changed since
+bool HasInclude(const std::string& Source) {
+	for (size_t Pos = Source.find('#'); Pos != std::string::npos;
+	     Pos = Source.find('#', Pos + 1)) {
+		size_t Dir = Source.find_first_not_of(" \t", Pos + 1);
+		if (Dir != std::string::npos && Source.compare(Dir, 7, "include") == 0)
+			return true;
+		}
+	return false;
+	}
+
+std::string EntryPath(const std::string& Dir, uint64_t Hi, uint64_t Lo) {
+	char Name[40];
+	snprintf(Name, sizeof(Name), "/%016" PRIx64 "%016" PRIx64 ".bin", Hi, Lo);
+	return Dir + Name;
+	}
+
+std::string GetDeviceString(cl_device_id Device, cl_device_info Param) {
+	auto venGetDevInfo = Lookup<OclAPI::clGetDeviceInfo>();
+	size_t Length = 0;
+	cl_int Ret = venGetDevInfo(Device, Param, 0, nullptr, &Length);
+	OCL_ASSERT(Ret);
+	std::string Str(Length, '\0');
+	Ret = venGetDevInfo(Device, Param, Length, Str.data(), nullptr);
+	OCL_ASSERT(Ret);
+	Str.resize(strlen(Str.c_str()));
+	return Str;
+	}
+
+std::string FileStamp(const std::string& Path) {
+	struct stat Stat;
+	if (stat(Path.c_str(), &Stat) != 0 || !S_ISREG(Stat.st_mode))
+		return std::string();
+	return std::to_string(Stat.st_size) + '@' + std::to_string(Stat.st_mtime);
+	}
+
+// Absolute paths a wrapper script refers to, e.g. the driver and the toolkit
+// in clpkm.sh, with $HOME expanded and quotes dropped
+std::vector<std::string> ScriptPaths(std::string Text) {
+	const char* Home = getenv("HOME");
+	for (const char* Var : {"${HOME}", "$HOME"}) {
+		for (size_t Pos = Text.find(Var); Pos != std::string::npos;
+		     Pos = Text.find(Var, Pos))
+			Text.replace(Pos, strlen(Var), Home ? Home : "");
+		}
+	Text.erase(std::remove(Text.begin(), Text.end(), '"'), Text.end());
+
+	std::vector<std::string> Paths;
+	for (size_t Pos = Text.find('/'); Pos != std::string::npos;
+	     Pos = Text.find('/', Pos)) {
+		size_t End = Text.find_first_of(" \t\n'=:;", Pos);
+		// Only paths starting a word, not the tail of a relative one
+		if (Pos == 0 || strchr(" \t\n'=:", Text[Pos - 1]))
+			Paths.emplace_back(Text, Pos, End - Pos);
+		Pos = End;
+		}
+	return Paths;
+	}
+
+// Stamps of the compiler and what it's made of, so that entries are
+// invalidated once CLPKMCC is rebuilt, or the toolkit, the slicing mode or
+// the flags in the wrapper script are changed
+std::string CompilerStamp(const std::string& Config) {
+	std::string Stamp;
+
+	for (size_t Pos = 0; Pos < Config.size(); ) {
+		size_t End = std::min(Config.find(' ', Pos), Config.size());
+		std::string Word = Config.substr(Pos, End - Pos);
+		Pos = End + 1;
+		// e.g. --toolkit=/path/to/toolkit.cl
+		if (size_t Eq = Word.find('='); Eq != std::string::npos)
+			Word.erase(0, Eq + 1);
+		// Looked up in PATH otherwise, which is left to the config
+		if (Word.find('/') != std::string::npos)
+			Append(Stamp, FileStamp(Word));
+		}
+
+	// The compiler itself, if it's a script
+	std::string Path = Config.substr(0, Config.find(' '));
+	std::ifstream In(Path, std::ios::binary);
+	char Shebang[2] = {};
+
+	if (Path.find('/') == std::string::npos ||
+	    !In.read(Shebang, sizeof(Shebang)) || Shebang[0] != '#' ||
+	    Shebang[1] != '!')
+		return Stamp;
+
+	std::string Script(Shebang, sizeof(Shebang));
+	Script.append(std::istreambuf_iterator<char>(In), {});
+	Append(Stamp, Script);
+
+	for (const std::string& Ref : ScriptPaths(Script))
+		Append(Stamp, FileStamp(Ref));
+
+	return Stamp;
+	}
+
+class Writer {
+public:
+	explicit Writer(std::string& O)
+	: Out(O) { }
+
+	void Num(uint64_t Val) {
+		Out.append(reinterpret_cast<const char*>(&Val), sizeof(Val));
+		}
+
+	void Str(const std::string& Val) {
+		Num(Val.size());
+		Out += Val;
+		}
+
+private:
+	std::string& Out;
+
+	};
+
+class Reader {
+public:
+	Reader(const std::string& I, size_t P)
+	: In(I), Pos(P), Good(true) { }
+
+	uint64_t Num() {
+		uint64_t Val = 0;
+		if (Pos + sizeof(Val) > In.size()) {
+			Good = false;
+			return 0;
+			}
+		memcpy(&Val, In.data() + Pos, sizeof(Val));
+		Pos += sizeof(Val);
+		return Val;
+		}
+
+	std::string Str() {
+		uint64_t Size = Num();
+		if (!Good || Size > In.size() - Pos) {
+			Good = false;
+			return std::string();
+			}
+		Pos += Size;
+		return In.substr(Pos - Size, Size);
+		}
+
+	bool isGood() const { return Good; }
+
+private:
+	const std::string& In;
+	size_t Pos;
+	bool   Good;
+
+	};
+
+std::string Serialize(const std::string& Key, const BinaryCache::Entry& E) {
+	std::string Out(EntryMagic, sizeof(EntryMagic) - 1);
+	Writer W(Out);
+	W.Str(Key);
+	W.Str(E.Source);
+	W.Num(E.PL.size());
+	for (const auto& KP : E.PL) {
+		W.Str(KP.Name);
+		W.Num(KP.NumOfParam);
+		W.Num(KP.ReqPrvSize);
+		W.Num(KP.ReqLocSize);
+		W.Num(static_cast<uint64_t>(KP.PrvLayout));
+		W.Str(KP.PristineName);
+		W.Num(KP.Compactable);
+		W.Num(KP.LocPtrParamIdx.size());
+		for (unsigned Idx : KP.LocPtrParamIdx)
+			W.Num(Idx);
+		}
+	W.Num(E.Binaries.size());
+	for (const auto& Bin : E.Binaries)
+		W.Str(Bin);
+	return Out;
+	}
+
+bool Deserialize(const std::string& In, const std::string& Key,
+                 BinaryCache::Entry& E) {
+	constexpr size_t MagicSize = sizeof(EntryMagic) - 1;
+	if (In.compare(0, MagicSize, EntryMagic) != 0)
+		return false;
+	Reader R(In, MagicSize);
+	// Two keys sharing the hash, or a stale entry of the same name
+	if (R.Str() != Key)
+		return false;
+	E.Source = R.Str();
+	E.PL.resize(std::min<uint64_t>(R.Num(), In.size()));
+	for (auto& KP : E.PL) {
+		KP.Name = R.Str();
+		KP.NumOfParam = R.Num();
+		KP.ReqPrvSize = R.Num();
+		KP.ReqLocSize = R.Num();
+		KP.PrvLayout = static_cast<KernelProfile::prv_layout>(R.Num());
+		KP.PristineName = R.Str();
+		KP.Compactable = R.Num();
+		KP.LocPtrParamIdx.resize(std::min<uint64_t>(R.Num(), In.size()));
+		for (unsigned& Idx : KP.LocPtrParamIdx)
+			Idx = R.Num();
+		}
+	E.Binaries.resize(std::min<uint64_t>(R.Num(), In.size()));
+	for (auto& Bin : E.Binaries)
+		Bin = R.Str();
+	return R.isGood();
+	}
+
+// Unlocked on scope exit
+class FileLock {
+public:
+	explicit FileLock(int F)
+	: Fd(F) { while (flock(Fd, LOCK_EX) == -1 && errno == EINTR); }
+
+	~FileLock() { flock(Fd, LOCK_UN); }
+
+private:
+	int Fd;
+
+	};
+
+}
+
+
+
+BinaryCache::BinaryCache()
+: Limit(DefaultLimit * 1024 * 1024), IndexFd(-1), Index(nullptr) {
+
+	auto& RT = getRuntimeKeeper();
+	const char* D = getenv("CLPKM_BINARY_CACHE");
+
+	if (D == nullptr || *D == '\0')
+		return;
+
+	// In MiB
+	if (const char* L = getenv("CLPKM_BINARY_CACHE_LIMIT")) {
+		char* End = nullptr;
+		unsigned long long Mebi = strtoull(L, &End, 10);
+		if (End != L && *End == '\0')
+			Limit = static_cast<uint64_t>(Mebi) * 1024 * 1024;
+		else
+			RT.Log("==CLPKM== Unrecognised binary cache limit: \"%s\"\n", L);
+		}
+
+	Dir = D;
+
+	if (mkdir(Dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		RT.Log(RuntimeKeeper::loglevel::ERROR,
+		       "==CLPKM== Failed to create binary cache \"%s\": %s\n",
+		       Dir.c_str(), StrError(errno).c_str());
+		return;
+		}
+
+	std::string IndexPath = Dir + "/index";
+	IndexFd = open(IndexPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+	if (IndexFd == -1) {
+		RT.Log(RuntimeKeeper::loglevel::ERROR,
+		       "==CLPKM== Failed to open binary cache index \"%s\": %s\n",
+		       IndexPath.c_str(), StrError(errno).c_str());
+		return;
+		}
+
+	FileLock Lock(IndexFd);
+	struct stat Stat;
+
+	// A new index, or one of another layout, is reset, which leaves existing
+	// entries unaccounted for until they're overwritten
+	bool Reset = (fstat(IndexFd, &Stat) != 0 ||
+	              static_cast<size_t>(Stat.st_size) != sizeof(IndexFile));
+
+	if (Reset && (ftruncate(IndexFd, 0) != 0 ||
+	              ftruncate(IndexFd, sizeof(IndexFile)) != 0)) {
+		RT.Log(RuntimeKeeper::loglevel::ERROR,
+		       "==CLPKM== Failed to resize binary cache index: %s\n",
+		       StrError(errno).c_str());
+		return;
+		}
+
+	void* Addr = mmap(nullptr, sizeof(IndexFile), PROT_READ | PROT_WRITE,
+	                  MAP_SHARED, IndexFd, 0);
+
+	if (Addr == MAP_FAILED) {
+		RT.Log(RuntimeKeeper::loglevel::ERROR,
+		       "==CLPKM== Failed to map binary cache index: %s\n",
+		       StrError(errno).c_str());
+		return;
+		}
+
+	Index = static_cast<IndexFile*>(Addr);
+
+	if (Index->Magic != IndexMagic) {
+		memset(Index, 0, sizeof(IndexFile));
+		Index->Magic = IndexMagic;
+		}
+
+	}
+
+BinaryCache::~BinaryCache() {
+	if (Index != nullptr)
+		munmap(Index, sizeof(IndexFile));
+	if (IndexFd != -1)
+		close(IndexFd);
+	}
+
+std::string BinaryCache::MakeKey(const std::string& Source,
+                                 const char* Options,
+                                 const std::vector<cl_device_id>& Devices) {
+
+	if (HasInclude(Source))
+		return std::string();
+
+	const std::string& Config = getScheduleService().getCompilerPath();
+	std::string Key;
+
+	Append(Key, EntryMagic);
+	Append(Key, ABIVersion);
+	Append(Key, Config);
+	Append(Key, CompilerStamp(Config));
+	Append(Key, Options ? Options : "");
+
+	for (cl_device_id Device : Devices) {
+		Append(Key, GetDeviceString(Device, CL_DEVICE_NAME));
+		Append(Key, GetDeviceString(Device, CL_DEVICE_VERSION));
+		Append(Key, GetDeviceString(Device, CL_DRIVER_VERSION));
+		}
+
+	Append(Key, Source);
+	return Key;
+
+	}
+
+BinaryCache::IndexSlot* BinaryCache::FindSlot(uint64_t Hi, uint64_t Lo) {
+	for (auto& Slot : Index->Slot) {
+		if (Slot.Hi == Hi && Slot.Lo == Lo)
+			return &Slot;
+		}
+	return nullptr;
+	}
+
+bool BinaryCache::Find(const std::string& Key, Entry& E) {
+
+	if (!isEnabled() || Key.empty())
+		return false;
+
+	uint64_t Hi, Lo;
+	Hash(Key, Hi, Lo);
+
+	std::ifstream In(EntryPath(Dir, Hi, Lo), std::ios::binary);
+
+	if (!In)
+		return false;
+
+	std::string Data(std::istreambuf_iterator<char>(In), {});
+
+	if (!Deserialize(Data, Key, E))
+		return false;
+
+	// Benign if the slot is evicted or reused meanwhile, which only makes
+	// some entry look recently used
+	for (auto& Slot : Index->Slot) {
+		if (__atomic_load_n(&Slot.Hi, __ATOMIC_RELAXED) == Hi &&
+		    __atomic_load_n(&Slot.Lo, __ATOMIC_RELAXED) == Lo) {
+			uint64_t Now = __atomic_add_fetch(&Index->Clock, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&Slot.LastUse, Now, __ATOMIC_RELAXED);
+			break;
+			}
+		}
+
+	return true;
+
+	}
+
+void BinaryCache::Save(const std::string& Key, const Entry& E) {
+
+	if (!isEnabled() || Key.empty())
+		return;
+
+	auto& RT = getRuntimeKeeper();
+	std::string Data = Serialize(Key, E);
+
+	if (Data.size() > Limit)
+		return;
+
+	uint64_t Hi, Lo;
+	Hash(Key, Hi, Lo);
+
+	// Written to a temporary file and renamed, so others never see a partial
+	// entry
+	std::string Path = EntryPath(Dir, Hi, Lo);
+	std::string TmpPath = Path + ".XXXXXX";
+	int Fd = mkstemp(TmpPath.data());
+	bool Succeed = (Fd != -1);
+
+	for (size_t Offset = 0; Succeed && Offset < Data.size(); ) {
+		ssize_t Ret = write(Fd, Data.data() + Offset, Data.size() - Offset);
+		if (Ret >= 0)
+			Offset += Ret;
+		else
+			Succeed = (errno == EINTR);
+		}
+
+	if (Fd != -1)
+		Succeed &= (close(Fd) == 0);
+
+	if (!Succeed) {
+		RT.Log(RuntimeKeeper::loglevel::ERROR,
+		       "==CLPKM== Failed to write binary cache entry \"%s\": %s\n",
+		       TmpPath.c_str(), StrError(errno).c_str());
+		if (Fd != -1)
+			unlink(TmpPath.c_str());
+		return;
+		}
+
+	std::lock_guard<std::mutex> Guard(Mutex);
+	FileLock Lock(IndexFd);
+
+	// Replacing an entry of the same name frees its space first
+	IndexSlot* Mine = FindSlot(Hi, Lo);
+
+	if (Mine != nullptr)
+		Mine->Size = 0;
+	else if ((Mine = FindSlot(0, 0)) != nullptr)
+		Mine->Size = 0;
+
+	uint64_t Total = 0;
+
+	for (const auto& Slot : Index->Slot)
+		Total += Slot.Size;
+
+	// Evict the least recently used until the new entry fits
+	while (Mine == nullptr || Total + Data.size() > Limit) {
+
+		IndexSlot* Victim = nullptr;
+
+		for (auto& Slot : Index->Slot) {
+			if (&Slot != Mine && (Slot.Hi != 0 || Slot.Lo != 0) &&
+			    (Victim == nullptr || Slot.LastUse < Victim->LastUse))
+				Victim = &Slot;
+			}
+
+		// Nothing left but entries not accounted for
+		if (Victim == nullptr)
+			break;
+
+		unlink(EntryPath(Dir, Victim->Hi, Victim->Lo).c_str());
+
+		Total -= Victim->Size;
+		memset(Victim, 0, sizeof(IndexSlot));
+
+		if (Mine == nullptr)
+			Mine = Victim;
+
+		}
+
+	if (rename(TmpPath.c_str(), Path.c_str()) != 0) {
+		RT.Log(RuntimeKeeper::loglevel::ERROR,
+		       "==CLPKM== Failed to publish binary cache entry \"%s\": %s\n",
+		       Path.c_str(), StrError(errno).c_str());
+		unlink(TmpPath.c_str());
+		memset(Mine, 0, sizeof(IndexSlot));
+		return;
+		}
+
+	Mine->Hi = Hi;
+	Mine->Lo = Lo;
+	Mine->Size = Data.size();
+	Mine->LastUse = __atomic_add_fetch(&Index->Clock, 1, __ATOMIC_RELAXED);
+
+	}
+
+bool BinaryCache::GetBinaries(cl_program Program,
+                              const std::vector<cl_device_id>& Devices,
+                              std::vector<std::string>& Binaries) {
+
+	auto venGetProgramInfo = Lookup<OclAPI::clGetProgramInfo>();
+	auto venGetProgramBuildInfo = Lookup<OclAPI::clGetProgramBuildInfo>();
+
+	// With a notify callback, the vendor may not have finished yet
+	for (cl_device_id Device : Devices) {
+		cl_build_status Status = CL_BUILD_NONE;
+		if (venGetProgramBuildInfo(Program, Device, CL_PROGRAM_BUILD_STATUS,
+		                           sizeof(Status), &Status, nullptr) != CL_SUCCESS ||
+		    Status != CL_BUILD_SUCCESS)
+			return false;
+		}
+
+	cl_uint NumOfDevice = 0;
+
+	if (venGetProgramInfo(Program, CL_PROGRAM_NUM_DEVICES, sizeof(NumOfDevice),
+	                      &NumOfDevice, nullptr) != CL_SUCCESS)
+		return false;
+
+	// Binaries are reported in the order of the program's devices, which may
+	// be more than the devices built for
+	std::vector<cl_device_id> ProgDevices(NumOfDevice);
+	std::vector<size_t> Sizes(NumOfDevice, 0);
+
+	if (venGetProgramInfo(Program, CL_PROGRAM_DEVICES,
+	                      sizeof(cl_device_id) * NumOfDevice,
+	                      ProgDevices.data(), nullptr) != CL_SUCCESS ||
+	    venGetProgramInfo(Program, CL_PROGRAM_BINARY_SIZES,
+	                      sizeof(size_t) * NumOfDevice, Sizes.data(),
+	                      nullptr) != CL_SUCCESS)
+		return false;
+
+	std::vector<std::string> All(NumOfDevice);
+	std::vector<unsigned char*> Ptrs(NumOfDevice, nullptr);
+
+	for (cl_uint Idx = 0; Idx < NumOfDevice; ++Idx) {
+		All[Idx].resize(Sizes[Idx]);
+		if (Sizes[Idx] > 0)
+			Ptrs[Idx] = reinterpret_cast<unsigned char*>(All[Idx].data());
+		}
+
+	if (venGetProgramInfo(Program, CL_PROGRAM_BINARIES,
+	                      sizeof(unsigned char*) * NumOfDevice, Ptrs.data(),
+	                      nullptr) != CL_SUCCESS)
+		return false;
+
+	Binaries.clear();
+
+	for (cl_device_id Device : Devices) {
+		auto It = std::find(ProgDevices.begin(), ProgDevices.end(), Device);
+		if (It == ProgDevices.end() || All[It - ProgDevices.begin()].empty())
+			return false;
+		Binaries.emplace_back(std::move(All[It - ProgDevices.begin()]));
+		}
+
+	return true;
+
+	}
+
+BinaryCache& CLPKM::getBinaryCache(void) {
+	static BinaryCache Cache;
+	return Cache;
+	}
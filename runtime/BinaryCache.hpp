@@ -0,0 +1,98 @@
+/*
+  BinaryCache.hpp
+
+  Shadow programs built before, including what the vendor compiler emitted,
+  kept on disk so that later runs skip both CLPKMCC and the vendor build
+
+*/
+
+#ifndef __CLPKM__BINARY_CACHE_HPP__
+#define __CLPKM__BINARY_CACHE_HPP__
+
+
+
+#include "KernelProfile.hpp"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <CL/opencl.h>
+
+
+
+namespace CLPKM {
+
+// Entries live in the directory set by CLPKM_BINARY_CACHE, named after the
+// hash of their key, and are indexed by a file mapped by every process using
+// the cache, which keeps the total size within CLPKM_BINARY_CACHE_LIMIT MiB
+// by evicting the least recently used
+class BinaryCache {
+public:
+	struct Entry {
+		// Instrumented source and its kernel profiles
+		std::string Source;
+		ProfileList PL;
+
+		// Vendor binaries, in the order of the devices the key is made of
+		std::vector<std::string> Binaries;
+		};
+
+	~BinaryCache();
+
+	bool isEnabled() const { return Index != nullptr; }
+
+	// Keyed by the original source, build options, the compiler, including the
+	// toolkit and flags of its wrapper script, and each device's name and
+	// driver version
+	// Returns an empty key if the program shall not be cached
+	std::string MakeKey(const std::string& Source, const char* Options,
+	                    const std::vector<cl_device_id>& Devices);
+
+	// False if not found
+	bool Find(const std::string& Key, Entry& E);
+
+	void Save(const std::string& Key, const Entry& E);
+
+	// Retrieve binaries of a built program in the order of Devices
+	// False if any of them is not built successfully
+	static bool GetBinaries(cl_program Program,
+	                        const std::vector<cl_device_id>& Devices,
+	                        std::vector<std::string>& Binaries);
+
+private:
+	BinaryCache(const BinaryCache& ) = delete;
+	BinaryCache& operator=(const BinaryCache& ) = delete;
+
+	BinaryCache();
+
+	struct IndexSlot;
+	struct IndexFile;
+
+	// Shall be called with IndexFd locked
+	IndexSlot* FindSlot(uint64_t Hi, uint64_t Lo);
+
+	std::string Dir;
+	uint64_t    Limit;
+
+	// Mapped index, shared among processes
+	// Lookups only bump the timestamp of the slot atomically, while insertion
+	// and eviction are done with the file locked
+	int        IndexFd;
+	IndexFile* Index;
+
+	// flock doesn't exclude threads sharing the descriptor
+	std::mutex Mutex;
+
+	friend BinaryCache& getBinaryCache(void);
+
+	};
+
+BinaryCache& getBinaryCache(void);
+
+}
+
+
+
+#endif
@@ -0,0 +1,203 @@
+/*
+  BufferPool.cpp
+
+  Pool of device buffers (impl)
+
+*/
+
+
+
+#include "BufferPool.hpp"
+
+using namespace CLPKM;
+
+
+
+clMemObj BufferPool::Acquire(cl_context Context, size_t Size, cl_int* Ret) {
+
+	const unsigned Class = ClassOf(Size);
+	const bool Pooled = (SizeOf(Class) >= Size && SizeOf(Class) <= Limit);
+
+	Pinned Found{NULL, nullptr};
+
+	if (Pooled && Take(Context, false, Class, Found)) {
+		*Ret = CL_SUCCESS;
+		return std::move(Found.Mem);
+		}
+
+	auto venCreateBuffer = Lookup<OclAPI::clCreateBuffer>();
+	const size_t AllocSize = Pooled ? SizeOf(Class) : Size;
+
+	clMemObj Mem = venCreateBuffer(Context, CL_MEM_READ_WRITE, AllocSize,
+	                               nullptr, Ret);
+
+	// Idle buffers may be what's eating up the memory
+	if ((*Ret == CL_MEM_OBJECT_ALLOCATION_FAILURE ||
+	     *Ret == CL_OUT_OF_RESOURCES) && Trim(Context) > 0)
+		Mem = venCreateBuffer(Context, CL_MEM_READ_WRITE, AllocSize, nullptr, Ret);
+
+	return Mem;
+
+	}
+
+BufferPool::Pinned BufferPool::AcquirePinned(cl_context Context,
+                                             cl_command_queue Queue,
+                                             size_t Size, cl_int* Ret) {
+
+	const unsigned Class = ClassOf(Size);
+	const bool Pooled = (SizeOf(Class) >= Size && SizeOf(Class) <= Limit);
+
+	Pinned Found{NULL, nullptr};
+
+	if (Pooled && Take(Context, true, Class, Found)) {
+		*Ret = CL_SUCCESS;
+		return Found;
+		}
+
+	const size_t AllocSize = Pooled ? SizeOf(Class) : Size;
+
+	Found.Mem = Lookup<OclAPI::clCreateBuffer>()(
+			Context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, AllocSize, nullptr,
+			Ret);
+	if (*Ret != CL_SUCCESS)
+		return Found;
+
+	Found.Ptr = Lookup<OclAPI::clEnqueueMapBuffer>()(
+			Queue, Found.Mem.get(), CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0,
+			AllocSize, 0, nullptr, nullptr, Ret);
+	if (*Ret != CL_SUCCESS)
+		Found.Mem.Release();
+
+	return Found;
+
+	}
+
+void BufferPool::Recycle(clMemObj&& Mem) {
+
+	// Take over so that it's released on return if not pooled
+	Pinned In{std::move(Mem), nullptr};
+
+	if (!In.Mem)
+		return;
+
+	Put(false, In);
+
+	}
+
+void BufferPool::Recycle(Pinned&& P, cl_command_queue Queue) {
+
+	Pinned In{std::move(P.Mem), P.Ptr};
+
+	if (!In.Mem || Put(true, In))
+		return;
+
+	// Not pooled, unmap before release
+	Lookup<OclAPI::clEnqueueUnmapMemObject>()(
+			Queue, In.Mem.get(), In.Ptr, 0, nullptr, nullptr);
+
+	}
+
+size_t BufferPool::Trim(cl_context Context, cl_command_queue Queue) {
+
+	// Release outside the lock
+	std::array<Bin, 2> Victim;
+	size_t Freed = 0;
+
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		auto It = Pool.find(Context);
+		if (It == Pool.end())
+			return 0;
+		Victim[0].swap(It->second[0]);
+		if (Queue != NULL) {
+			Victim[1].swap(It->second[1]);
+			Pool.erase(It);
+			Retired.insert(Context);
+			}
+		for (auto& Classes : Victim)
+			for (size_t Class = 0; Class < Classes.size(); ++Class)
+				Freed += Classes[Class].size() * SizeOf(Class);
+		BytesHeld -= Freed;
+	}
+
+	for (auto& Entries : Victim[1]) {
+		for (auto& P : Entries) {
+			Lookup<OclAPI::clEnqueueUnmapMemObject>()(
+					Queue, P.Mem.get(), P.Ptr, 0, nullptr, nullptr);
+			}
+		}
+
+	return Freed;
+
+	}
+
+BufferPool::Stats BufferPool::getStats() {
+	std::lock_guard<std::mutex> Lock(Mutex);
+	return Stats{Hit, Miss, BytesHeld};
+	}
+
+unsigned BufferPool::ClassOf(size_t Size) {
+	unsigned Class = MinClass;
+	while (SizeOf(Class) < Size && Class + 1 < sizeof(size_t) * 8)
+		++Class;
+	return Class;
+	}
+
+bool BufferPool::Take(cl_context Context, bool IsPinned, unsigned Class,
+                      Pinned& Out) {
+
+	std::lock_guard<std::mutex> Lock(Mutex);
+	Bin& Classes = Pool[Context][IsPinned];
+
+	// In use again, e.g. a new queue is created on it
+	Retired.erase(Context);
+
+	if (Classes.size() <= Class || Classes[Class].empty()) {
+		++Miss;
+		return false;
+		}
+
+	Out = std::move(Classes[Class].back());
+	Classes[Class].pop_back();
+	BytesHeld -= SizeOf(Class);
+	++Hit;
+
+	return true;
+
+	}
+
+bool BufferPool::Put(bool IsPinned, Pinned& In) {
+
+	auto venGetMemObjectInfo = Lookup<OclAPI::clGetMemObjectInfo>();
+
+	size_t Size = 0;
+	cl_context Context = NULL;
+
+	if (venGetMemObjectInfo(In.Mem.get(), CL_MEM_SIZE, sizeof(Size), &Size,
+	                        nullptr) != CL_SUCCESS ||
+	    venGetMemObjectInfo(In.Mem.get(), CL_MEM_CONTEXT, sizeof(Context),
+	                        &Context, nullptr) != CL_SUCCESS)
+		return false;
+
+	const unsigned Class = ClassOf(Size);
+
+	// Exact-size ones don't belong to any class
+	if (SizeOf(Class) != Size)
+		return false;
+
+	std::lock_guard<std::mutex> Lock(Mutex);
+
+	// Still in flight when the last queue of the context was released
+	if (BytesHeld + Size > Limit || Retired.count(Context) > 0)
+		return false;
+
+	Bin& Classes = Pool[Context][IsPinned];
+	if (Classes.size() <= Class)
+		Classes.resize(Class + 1);
+
+	Classes[Class].emplace_back(std::move(In));
+	BytesHeld += Size;
+
+	return true;
+
+	}
@@ -0,0 +1,116 @@
+/*
+  BufferPool.hpp
+
+  Pool of device buffers for header and live values, so that launching the
+  same kernel over and over doesn't go through the allocator every time
+
+*/
+
+#ifndef __CLPKM__BUFFER_POOL_HPP__
+#define __CLPKM__BUFFER_POOL_HPP__
+
+
+
+#include "ResourceGuard.hpp"
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <CL/opencl.h>
+
+
+
+namespace CLPKM {
+
+// Buffers are binned into power-of-two size classes per context
+// Requests larger than the limit are served by exact-size buffers, which are
+// not pooled
+class BufferPool {
+public:
+	struct Stats {
+		uint64_t Hit;
+		uint64_t Miss;
+		size_t   BytesHeld;
+		};
+
+	// Host-accessible staging buffer, which is mapped on creation and stays
+	// mapped until it's released, so it's only pinned once
+	struct Pinned {
+		clMemObj Mem;
+		void*    Ptr;
+		};
+
+	BufferPool()
+	: Limit(DefaultLimit), BytesHeld(0), Hit(0), Miss(0) { }
+
+	~BufferPool() = default;
+
+	// Get a read-write buffer of at least Size bytes
+	// Idle buffers of the context are released and the allocation retried once
+	// if the vendor runs out of memory
+	clMemObj Acquire(cl_context Context, size_t Size, cl_int* Ret);
+
+	// Get a staging buffer of at least Size bytes, mapping it on Queue if it's
+	// newly created
+	Pinned AcquirePinned(cl_context Context, cl_command_queue Queue, size_t Size,
+	                     cl_int* Ret);
+
+	// Hand a buffer back to the pool
+	// It's released if it doesn't fit any size class or the pool is full
+	// Staging buffers are unmapped on Queue before being released
+	void Recycle(clMemObj&& Mem);
+	void Recycle(Pinned&& P, cl_command_queue Queue);
+
+	// Release idle buffers of the context, returning the number of bytes freed
+	// Staging buffers are only released if a queue to unmap them is given, in
+	// which case the context is taken as retired, and buffers of it handed back
+	// afterwards are released instead of pooled till it's used again
+	size_t Trim(cl_context Context, cl_command_queue Queue = NULL);
+
+	// Max number of bytes held, 0 to disable pooling
+	void setLimit(size_t L) { Limit = L; }
+
+	Stats getStats();
+
+	static constexpr size_t DefaultLimit = 256 * 1024 * 1024;
+
+private:
+	BufferPool(const BufferPool& ) = delete;
+	BufferPool& operator=(const BufferPool& ) = delete;
+
+	// Buffers smaller than this are rounded up to it
+	static constexpr unsigned MinClass = 8;
+
+	static unsigned ClassOf(size_t Size);
+	static size_t SizeOf(unsigned Class) { return size_t(1) << Class; }
+
+	// Find an idle buffer of the class, or count a miss
+	bool Take(cl_context Context, bool IsPinned, unsigned Class, Pinned& Out);
+
+	// Pool the buffer if it fits a class and there's room, or leave it as is
+	bool Put(bool IsPinned, Pinned& In);
+
+	// Indexed by size class, device buffers have a null Ptr
+	using Bin = std::vector<std::vector<Pinned>>;
+
+	std::mutex Mutex;
+	// [0] for device buffers and [1] for staging ones
+	std::unordered_map<cl_context, std::array<Bin, 2>> Pool;
+	std::unordered_set<cl_context> Retired;
+
+	size_t   Limit;
+	size_t   BytesHeld;
+	uint64_t Hit;
+	uint64_t Miss;
+
+	};
+
+}
+
+
+
+#endif
@@ -0,0 +1,126 @@
+/*
+  BuildService.cpp
+
+  Impl build service
+
+*/
+
+#include "BuildService.hpp"
+#include "RuntimeKeeper.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+
+using namespace CLPKM;
+
+
+
+BuildService::BuildService()
+: Stop(false) {
+
+	auto& RT = getRuntimeKeeper();
+
+	// CLPKMCC and the vendor compiler are mostly single-threaded, so a build
+	// per core keeps them all busy
+	size_t NumOfWorker = std::max(std::thread::hardware_concurrency(), 1u);
+
+	// 0 to build on the caller's thread
+	if (const char* Num = getenv("CLPKM_BUILD_WORKERS")) {
+		char* End = nullptr;
+		unsigned long Val = strtoul(Num, &End, 10);
+		if (End != Num && *End == '\0')
+			NumOfWorker = Val;
+		else
+			RT.Log("==CLPKM== Unrecognised number of build workers: \"%s\"\n", Num);
+		}
+
+	for (size_t Idx = 0; Idx < NumOfWorker; ++Idx)
+		Workers.emplace_back(&BuildService::Work, this);
+
+	}
+
+BuildService::~BuildService() {
+	this->Terminate();
+	}
+
+
+
+void BuildService::Submit(job Job, job Cancel) {
+
+	if (Workers.empty()) {
+		Job();
+		return;
+		}
+
+	{
+		std::unique_lock<std::mutex> Lock(Mutex);
+		if (!Stop) {
+			Jobs.emplace_back(std::move(Job), std::move(Cancel));
+			Lock.unlock();
+			Cond.notify_one();
+			return;
+			}
+		}
+
+	if (Cancel)
+		Cancel();
+
+	}
+
+void BuildService::Terminate() {
+
+	std::deque<std::pair<job, job>> Dropped;
+
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (Stop)
+			return;
+		Stop = true;
+		Dropped.swap(Jobs);
+		}
+
+	Cond.notify_all();
+
+	for (auto& W : Workers) {
+		if (W.joinable())
+			W.join();
+		}
+
+	// Outside the lock, as they may submit others
+	for (auto& Job : Dropped) {
+		if (Job.second)
+			Job.second();
+		}
+
+	}
+
+
+
+// Worker
+void BuildService::Work() {
+
+	for (;;) {
+
+		job Job;
+
+		{
+			std::unique_lock<std::mutex> Lock(Mutex);
+			Cond.wait(Lock, [this] { return Stop || !Jobs.empty(); });
+			if (Stop)
+				return;
+			Job = std::move(Jobs.front().first);
+			Jobs.pop_front();
+		}
+
+		Job();
+
+		}
+
+	}
+
+
+
+BuildService& CLPKM::getBuildService(void) {
+	static BuildService BS;
+	return BS;
+	}
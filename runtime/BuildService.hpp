@@ -0,0 +1,67 @@
+/*
+  BuildService.hpp
+
+  Worker threads to instrument and build shadow programs, so that
+  clBuildProgram given a notify callback returns right away
+
+*/
+
+#ifndef __CLPKM__BUILD_SERVICE_HPP__
+#define __CLPKM__BUILD_SERVICE_HPP__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+
+namespace CLPKM {
+
+class BuildService;
+BuildService& getBuildService(void);
+
+class BuildService {
+public:
+	using job = std::function<void()>;
+
+	// Run Job on a worker, in order of submission
+	// If there's no worker, it's run right away
+	// Cancel, if any, is run instead if the service is shut down before Job
+	// starts, e.g. to notify whoever waits for it
+	void Submit(job Job, job Cancel = job());
+
+	size_t getNumOfWorker() const { return Workers.size(); }
+
+	// Shutdown worker threads, cancelling jobs not started yet
+	void Terminate();
+
+private:
+	BuildService& operator=(const BuildService& ) = delete;
+	BuildService(const BuildService& ) = delete;
+
+	BuildService();
+	~BuildService();
+
+	void Work();
+
+	std::vector<std::thread> Workers;
+
+	std::mutex              Mutex;
+	std::condition_variable Cond;
+	// Job and how to cancel it
+	std::deque<std::pair<job, job>> Jobs;
+	bool                    Stop;
+
+	friend BuildService& getBuildService(void);
+
+	};
+
+} // namespace CLPKM
+
+
+
+#endif
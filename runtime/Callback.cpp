@@ -9,8 +9,11 @@
 
 #include "Callback.hpp"
 #include "ErrorHandling.hpp"
+#include "HeaderScan.hpp"
+#include "ResumeEngine.hpp"
 #include "ScheduleService.hpp"
 #include <algorithm>
+#include <memory>
 
 using namespace CLPKM;
 
@@ -52,7 +55,7 @@ cl_ulong getExecTime(cl_event Event) {
 
 	}
 
-void LogEventProfInfo(RuntimeKeeper& RT, cl_event Event) {
+cl_ulong LogEventProfInfo(RuntimeKeeper& RT, cl_event Event) {
 
 	// The timestamp is in nanosecs
 	constexpr double ToMilli = 0.000001f;
@@ -62,64 +65,33 @@ void LogEventProfInfo(RuntimeKeeper& RT, cl_event Event) {
 	       "==CLPKM==   prev work run for %f ms\n",
 	       ExecTime * ToMilli);
 
+	return ExecTime;
+
 	}
 
 // Return 0 if finished, 1 if yet finished, -1 if yet finished and require
 // updating header
-template <class I>
-int UpdateHeader(I First, I Last, size_t WorkGrpSize,
-                 std::vector<std::array<unsigned, 2>>& Bucket) {
+// If Remaining is not null, IDs of unfinished work-groups are put into it in
+// ascending order, and NumOfRemaining is set to the number of them
+int UpdateHeader(cl_int* Header, size_t NumOfThread, size_t WorkGrpSize,
+                 std::vector<std::array<unsigned, 2>>& Bucket,
+                 cl_uint* Remaining, size_t& NumOfRemaining) {
 
 	auto& RT = getRuntimeKeeper();
-	bool ShouldLog = RT.shouldLog(RuntimeKeeper::loglevel::DEBUG);
 
-	if (ShouldLog)
-		Bucket.resize(0);
+	INTER_ASSERT(NumOfThread % WorkGrpSize == 0,
+	             "gws can't be perfectly divided by lws");
 
-	int Progress = 0;
-
-	while (First != Last) {
-		// Rear is the margin of this work group
-		I Rear = First + WorkGrpSize;
-		INTER_ASSERT(Rear <= Last, "gws can't be perfectly divided by lws");
-		// Tag stores the last barrier blocking this work group
-		cl_int Tag = 0;
-		size_t TagCount = 0;
-		// Traverse all work items in this group
-		for (I Front = First; Front < Rear; ++Front) {
-			if (ShouldLog) {
-				auto Sign = *Front >> ((sizeof(*Front) << 3) - 1);
-				size_t Abs = (Sign ^ *Front) - Sign;
-				if (Abs >= Bucket.size())
-					Bucket.resize(Abs + 1);
-				++Bucket[Abs][Sign + 1];
-				}
-			// This work-item has finished the task
-			if (*Front == 0)
-				continue;
-			Progress |= 1;
-			// Checkpoint'd due to exceeding time slice
-			if (*Front > 0)
-				continue;
-			// If it's the first work-item in the group being blocked
-			if (Tag == 0)
-				Tag = *Front;
-			// Check if some work-items are blocked by different barrier
-			else
-				INTER_ASSERT(Tag == *Front, "some threads reach different barrier!");
-			++TagCount;
-			}
-		// If all work-items in the groups are being blocking by the same barrier,
-		// let them pass
-		if (TagCount == WorkGrpSize) {
-			for (I Front = First; Front < Rear; ++Front)
-				*Front = -Tag;
-			Progress = -1;
+	// Log the distribution before the scan lets blocked work-groups pass
+	if (RT.shouldLog(RuntimeKeeper::loglevel::DEBUG)) {
+		Bucket.resize(0);
+		for (size_t Idx = 0; Idx < NumOfThread; ++Idx) {
+			auto Sign = Header[Idx] >> ((sizeof(*Header) << 3) - 1);
+			size_t Abs = (Sign ^ Header[Idx]) - Sign;
+			if (Abs >= Bucket.size())
+				Bucket.resize(Abs + 1);
+			++Bucket[Abs][Sign + 1];
 			}
-		First = Rear;
-		}
-
-	if (ShouldLog) {
 		RT.Log("==CLPKM== Header: [\"0\": {%u, %u}", Bucket[0][1], Bucket[0][0]);
 		for (size_t Idx = 1; Idx < Bucket.size(); ++Idx) {
 			if (Bucket[Idx][1] || Bucket[Idx][0])
@@ -128,7 +100,172 @@ int UpdateHeader(I First, I Last, size_t WorkGrpSize,
 		RT.Log("]\n");
 		}
 
-	return Progress;
+	auto Result = ScanHeader(Header, NumOfThread / WorkGrpSize, WorkGrpSize,
+	                         Remaining);
+
+	INTER_ASSERT(!Result.Mismatch, "some threads reach different barrier!");
+
+	NumOfRemaining = Result.NumOfRemaining;
+	return Result.Progress;
+
+	}
+
+// Reduce the header on the device after the kernel, and read the summary
+void EnqueueReduceHeader(CallbackData* Work, size_t Slot, cl_event* EventRead) {
+
+	KernelInfo& KInfo = *Work->KInfo;
+	clEvent FillEvent(NULL);
+	clEvent ReduceEvent(NULL);
+
+	const cl_uint Zero = 0;
+
+	cl_int Ret = Lookup<OclAPI::clEnqueueFillBuffer>()(
+			Work->Queue, Work->Summary[Slot].get(), &Zero, sizeof(cl_uint), 0,
+			sizeof(Work->HostSummary[Slot]), 0, nullptr, &FillEvent.get());
+	OCL_ASSERT(Ret);
+
+	const cl_uint HeaderOffset = Work->HeaderOffset;
+	const cl_uint WorkGrpSize = Work->WorkGrpSize;
+	const size_t  NumOfWorkGrp = Work->NumOfThread / Work->WorkGrpSize;
+	cl_event      WaitingList[2] = {Work->Run[Slot].get(), FillEvent.get()};
+
+	// Arguments are captured on enqueue, so the kernel can be shared
+	std::unique_lock<std::mutex> LockPool(*KInfo.Mutex);
+
+	cl_kernel Reducer = KInfo.Reducer.get();
+	auto venSetKernelArg = Lookup<OclAPI::clSetKernelArg>();
+
+	Ret = venSetKernelArg(Reducer, 0, sizeof(cl_mem), &Work->DeviceHeader.get());
+	OCL_ASSERT(Ret);
+	Ret = venSetKernelArg(Reducer, 1, sizeof(cl_uint), &HeaderOffset);
+	OCL_ASSERT(Ret);
+	Ret = venSetKernelArg(Reducer, 2, sizeof(cl_uint), &WorkGrpSize);
+	OCL_ASSERT(Ret);
+	Ret = venSetKernelArg(Reducer, 3, sizeof(cl_mem), &Work->Summary[Slot].get());
+	OCL_ASSERT(Ret);
+	Ret = venSetKernelArg(Reducer, 4, sizeof(cl_mem), &Work->Launch.get());
+	OCL_ASSERT(Ret);
+
+	Ret = Lookup<OclAPI::clEnqueueNDRangeKernel>()(
+			Work->Queue, Reducer, 1, nullptr, &NumOfWorkGrp, nullptr,
+			2, WaitingList, &ReduceEvent.get());
+	OCL_ASSERT(Ret);
+
+	LockPool.unlock();
+
+	// Read back in order of slices, so that callbacks come in order too
+	cl_event ReadWaitingList[2] = {ReduceEvent.get(), Work->LastRead.get()};
+
+	Ret = Lookup<OclAPI::clEnqueueReadBuffer>()(
+			Work->Queue, Work->Summary[Slot].get(), CL_FALSE, 0,
+			sizeof(Work->HostSummary[Slot]), Work->HostSummary[Slot],
+			(ReadWaitingList[1] != NULL) ? 2 : 1, ReadWaitingList, EventRead);
+	OCL_ASSERT(Ret);
+
+	// The next slice is chained after this if pipelined
+	Work->LastReduce = std::move(ReduceEvent);
+
+	}
+
+// Decide how to launch the next run from the unfinished work-groups, and
+// upload the launch info after WaitEvent if it's not null
+// The table of work-groups is either built by the reducer on the device, or
+// put in HostLaunch by UpdateHeader
+void PlanLaunch(CallbackData* Work, size_t NumOfRemaining, cl_uint MinGrp,
+                cl_uint MaxGrp, cl_event WaitEvent, cl_event* Event) {
+
+	auto& RT = getRuntimeKeeper();
+	auto& HostLaunch = Work->HostLaunch;
+	const size_t NumOfWorkGrp = Work->NumOfThread / Work->WorkGrpSize;
+
+	size_t NumToUpload = LAUNCH_NUM_GRPS_PER_DIM;
+
+	// Nothing to skip, launch the whole NDRange as usual
+	if (NumOfRemaining >= NumOfWorkGrp) {
+		Work->NumOfLaunchedGrp = 0;
+		HostLaunch[LAUNCH_NUM_GRPS] = 0;
+		HostLaunch[LAUNCH_BASE] = ~static_cast<cl_uint>(0);
+		}
+	// The remaining work-groups are consecutive, no need to look up the table
+	// If pipelined, the plan applies to the slice after the one in flight,
+	// which doesn't match the table by then, so launch the whole range instead
+	else if (MaxGrp - MinGrp + 1 == NumOfRemaining || Work->Pipelined) {
+		Work->NumOfLaunchedGrp = MaxGrp - MinGrp + 1;
+		HostLaunch[LAUNCH_NUM_GRPS] = MaxGrp - MinGrp + 1;
+		HostLaunch[LAUNCH_BASE] = MinGrp;
+		}
+	else {
+		Work->NumOfLaunchedGrp = NumOfRemaining;
+		HostLaunch[LAUNCH_NUM_GRPS] = NumOfRemaining;
+		HostLaunch[LAUNCH_BASE] = ~static_cast<cl_uint>(0);
+		// Upload the table if it's built on the host
+		if (HostLaunch.size() > LAUNCH_TABLE)
+			NumToUpload = LAUNCH_TABLE + NumOfRemaining;
+		}
+
+	RT.Log(RuntimeKeeper::loglevel::INFO,
+	       "==CLPKM== Relaunch %zu of %zu work-groups (%s)\n",
+	       (Work->NumOfLaunchedGrp == 0) ? NumOfWorkGrp : Work->NumOfLaunchedGrp,
+	       NumOfWorkGrp,
+	       (Work->NumOfLaunchedGrp == 0) ? "whole"
+	       : (HostLaunch[LAUNCH_BASE] != ~static_cast<cl_uint>(0)) ? "consecutive"
+	       : "table");
+
+	// If pipelined, the next plan is made before this one is uploaded, so
+	// upload from a copy of the slot
+	const cl_uint* Src = HostLaunch.data();
+
+	if (Work->Pipelined) {
+		cl_uint* Staged = Work->StagedLaunch[Work->SlotOf(Work->NumOfEnqueued)];
+		std::copy(HostLaunch.begin(), HostLaunch.begin() + NumToUpload, Staged);
+		Src = Staged;
+		}
+
+	cl_int Ret = Lookup<OclAPI::clEnqueueWriteBuffer>()(
+			Work->Queue, Work->Launch.get(), CL_FALSE, 0,
+			NumToUpload * sizeof(cl_uint), Src,
+			(WaitEvent != NULL) ? 1 : 0, (WaitEvent != NULL) ? &WaitEvent : nullptr,
+			Event);
+	OCL_ASSERT(Ret);
+
+	}
+
+void CL_CALLBACK RecycleOnComplete(cl_event , cl_int ExecStatus,
+                                    void* UserData) {
+	std::unique_ptr<clMemObj> Mem(static_cast<clMemObj*>(UserData));
+	if (ExecStatus == CL_COMPLETE)
+		getRuntimeKeeper().getBufferPool().Recycle(std::move(*Mem));
+	}
+
+// Unmap the header on the device, and hand it back to the pool once it's
+// done
+void UnmapAndRecycle(CallbackData* Work) {
+
+	clEvent UnmapEvent(NULL);
+
+	cl_int Ret = Lookup<OclAPI::clEnqueueUnmapMemObject>()(
+			Work->Queue, Work->DeviceHeader.get(), Work->HostHeader, 0, nullptr,
+			&UnmapEvent.get());
+	OCL_ASSERT(Ret);
+
+	auto Mem = std::make_unique<clMemObj>(std::move(Work->DeviceHeader));
+
+	Ret = Lookup<OclAPI::clSetEventCallback>()(
+			UnmapEvent.get(), CL_COMPLETE, RecycleOnComplete, Mem.get());
+	OCL_ASSERT(Ret);
+
+	Mem.release();
+
+	Ret = ResumeEngine::Flush(Work->Queue);
+	OCL_ASSERT(Ret);
+
+	}
+
+// Only hand the completion to a resume worker, so that the vendor's callback
+// thread is never held up by scanning, planning or enqueuing
+void CL_CALLBACK OnReadComplete(cl_event Event, cl_int ExecStatus,
+                                void* UserData) {
+	getResumeEngine().Submit(ResumeOrFinish, Event, ExecStatus, UserData);
 	}
 
 void CallbackCleanup(CallbackData* Work) {
@@ -142,7 +279,8 @@ void CallbackCleanup(CallbackData* Work) {
 	// Return the kernel to kernel pool
 	std::unique_lock<std::mutex> LockPool(*KInfo.Mutex);
 
-	KInfo.Pool.emplace_back(std::move(Work->Kernel));
+	KInfo.Pool.emplace_back(PooledKernel{std::move(Work->Kernel),
+	                                     std::move(Work->BoundArgs)});
 
 	// Unlock and disassociate
 	LockPool.unlock();
@@ -150,6 +288,21 @@ void CallbackCleanup(CallbackData* Work) {
 
 	LockWork.release();
 
+	// Hand the buffers back for later launches
+	// The header can't be reused if it's still mapped
+	auto& BP = getRuntimeKeeper().getBufferPool();
+
+	if (Work->MapHeader)
+		Work->DeviceHeader.Release();
+
+	BP.Recycle(std::move(Work->DeviceHeader));
+	BP.Recycle(std::move(Work->LocalBuffer));
+	BP.Recycle(std::move(Work->PrivateBuffer));
+	BP.Recycle(std::move(Work->Summary[0]));
+	BP.Recycle(std::move(Work->Summary[1]));
+	BP.Recycle(std::move(Work->Launch));
+	BP.Recycle(std::move(Work->HostHeaderBuffer), Work->Queue);
+
 	delete Work;
 
 	}
@@ -167,39 +320,82 @@ void CLPKM::MetaEnqueue(CallbackData* Work, cl_uint NumWaiting,
 	auto& Srv = getScheduleService();
 	auto SC = Srv.Schedule(task_kind::COMPUTING);
 
+	const size_t Slot = Work->SlotOf(Work->NumOfEnqueued);
+
+	// In case of compact launch, lay out the work-groups along dimension 0
+	// The kernel finds out their IDs in the whole NDRange from the launch info
+	const size_t* GWO = Work->GWO.data();
+	const size_t* GWS = Work->GWS.data();
+	std::vector<size_t> CompactGWS;
+
+	if (Work->NumOfLaunchedGrp > 0) {
+		CompactGWS = Work->LWS;
+		CompactGWS[0] *= Work->NumOfLaunchedGrp;
+		GWO = nullptr;
+		GWS = CompactGWS.data();
+		}
+
 	// Enqueue kernel and read data
 	cl_int Ret = Lookup<OclAPI::clEnqueueNDRangeKernel>()(
-			Work->Queue, Work->Kernel.get(), Work->WorkDim, Work->GWO.data(),
-			Work->GWS.data(), Work->LWS.data(), NumWaiting, WaitingList,
-			&Work->PrevWork[0].get());
+			Work->Queue, Work->Kernel.get(), Work->WorkDim, GWO, GWS,
+			Work->LWS.data(), NumWaiting, WaitingList, &Work->Run[Slot].get());
 	OCL_ASSERT(Ret);
 
-	cl_int* HostHeader = Work->HostMetadata.data() + Work->HeaderOffset;
-	const size_t HeaderSize = Work->HostMetadata.size() - Work->HeaderOffset;
-
 	auto SM = Srv.Schedule(task_kind::MEMCPY);
 
-	Ret = Lookup<OclAPI::clEnqueueReadBuffer>()(
-		Work->Queue, Work->DeviceHeader.get(), CL_FALSE,
-		Work->HeaderOffset * sizeof(cl_int),
-		HeaderSize * sizeof(cl_int), HostHeader, 1,
-		&Work->PrevWork[0].get(), &EventRead.get());
-	OCL_ASSERT(Ret);
+	if (Work->Summary[Slot].get() != NULL)
+		EnqueueReduceHeader(Work, Slot, &EventRead.get());
+	// No copy is needed if the device shares memory with the host
+	else if (Work->MapHeader) {
+		void* Mapped = Lookup<OclAPI::clEnqueueMapBuffer>()(
+			Work->Queue, Work->DeviceHeader.get(), CL_FALSE,
+			CL_MAP_READ | CL_MAP_WRITE, Work->HeaderOffset * sizeof(cl_int),
+			Work->NumOfThread * sizeof(cl_int), 1, &Work->Run[Slot].get(),
+			&EventRead.get(), &Ret);
+		OCL_ASSERT(Ret);
+		Work->HostHeader = static_cast<cl_int*>(Mapped);
+		}
+	else {
+		Ret = Lookup<OclAPI::clEnqueueReadBuffer>()(
+			Work->Queue, Work->DeviceHeader.get(), CL_FALSE,
+			Work->HeaderOffset * sizeof(cl_int),
+			Work->NumOfThread * sizeof(cl_int), Work->HostHeader, 1,
+			&Work->Run[Slot].get(), &EventRead.get());
+		OCL_ASSERT(Ret);
+		}
 
 	// Set up callback to continue
-	// Note: This could lead to a problem! clSetEventCallback is a blocking call
-	//       under some systems, e.g. mesa. In such case, this call will only
-	//       return when the event is ready
+	// Note: clSetEventCallback is a blocking call under some systems, e.g.
+	//       mesa, which only returns when the event is ready. Resume workers
+	//       take the wait off the vendor's callback thread, but not off the
+	//       first enqueue
 	Ret = Lookup<OclAPI::clSetEventCallback>()(
-			EventRead.get(), CL_COMPLETE, ResumeOrFinish, Work);
+			EventRead.get(), CL_COMPLETE, OnReadComplete, Work);
 	OCL_ASSERT(Ret);
 
-	Ret = clFlush(Work->Queue);
+	++Work->NumOfEnqueued;
+	++Work->InFlight;
+
+	// Keep a reference so that the next read is chained after this
+	if (Work->Pipelined) {
+		Ret = Lookup<OclAPI::clRetainEvent>()(EventRead.get());
+		OCL_ASSERT(Ret);
+		Work->LastRead = std::move(EventRead);
+		}
+
+	Ret = ResumeEngine::Flush(Work->Queue);
 	OCL_ASSERT(Ret);
 
 	// If nothing went south, set to NULL so the guard won't release it
 	EventRead.get() = NULL;
 
+	// Queue the next slice right behind this one, which only depends on the
+	// header on the device
+	if (Work->Pipelined && Work->InFlight < 2) {
+		cl_event Reduce = Work->LastReduce.get();
+		MetaEnqueue(Work, 1, &Reduce);
+		}
+
 	}
 
 
@@ -215,6 +411,10 @@ void CL_CALLBACK CLPKM::ResumeOrFinish(cl_event Event, cl_int ExecStatus,
 	clEvent ThisEvent(Event);
 	std::unique_lock<std::recursive_mutex> LockWork(*Work->Mutex);
 
+	// Callbacks come in order of slices
+	const size_t Slot = Work->SlotOf(Work->Counter);
+	--Work->InFlight;
+
 	// Update timestamp
 	auto Now = std::chrono::high_resolution_clock::now();
 	std::chrono::duration<double, std::milli> Interval = Now - Work->LastCall;
@@ -227,24 +427,36 @@ void CL_CALLBACK CLPKM::ResumeOrFinish(cl_event Event, cl_int ExecStatus,
 	       Interval.count());
 	Work->LastCall = Now;
 
+	// A slice queued before the task finished, which has nothing to do
+	if (Work->Done) {
+		Work->Run[Slot].Release();
+		if (Work->InFlight > 0)
+			return;
+		LockWork.release();
+		CallbackCleanup(Work);
+		return;
+		}
+
 	// Step 1
 	// Check the status of associated run
 
-	for (size_t Idx : {1, 0}) {
-		if (Work->PrevWork[Idx].get() == NULL)
+	for (clEvent* Prev : {&Work->PrevWork, &Work->Run[Slot]}) {
+		if (Prev->get() == NULL)
 			continue;
 		cl_int Status = CL_SUCCESS;
 		Ret = Lookup<OclAPI::clGetEventInfo>()(
-				Work->PrevWork[Idx].get(), CL_EVENT_COMMAND_EXECUTION_STATUS,
+				Prev->get(), CL_EVENT_COMMAND_EXECUTION_STATUS,
 				sizeof(cl_int), &Status, nullptr);
 		// Status of the call to clGetEventInfo
 		OCL_ASSERT(Ret);
 		// Status of the event associated to previous enqueued commands
 		OCL_ASSERT(Status);
-		// Log execution time
-		LogEventProfInfo(RT, Work->PrevWork[Idx].get());
+		// Log execution time, and accumulate it if it's the kernel
+		cl_ulong ExecTime = LogEventProfInfo(RT, Prev->get());
+		if (Prev != &Work->PrevWork)
+			Work->ExecTime += ExecTime;
 		// Release so MetaEnqueue can use the slot
-		Work->PrevWork[Idx].Release();
+		Prev->Release();
 		}
 	// Status of the event associated to clEnqueueReadBuffer
 	OCL_ASSERT(ExecStatus);
@@ -253,9 +465,36 @@ void CL_CALLBACK CLPKM::ResumeOrFinish(cl_event Event, cl_int ExecStatus,
 
 	// Step 2
 	// Inspect header, summarizing progress
-	int Progress = UpdateHeader(Work->HostMetadata.begin() + Work->HeaderOffset,
-	                            Work->HostMetadata.end(), Work->WorkGrpSize,
-	                            Work->Bucket);
+	// The device has already let blocked work-groups pass if it reduced the
+	// header, so we never need to write it back
+	int     Progress = 0;
+	size_t  NumOfRemaining = 0;
+	cl_uint MinGrp = 0;
+	cl_uint MaxGrp = 0;
+
+	if (Work->Summary[Slot].get() != NULL) {
+		const cl_uint* Summary = Work->HostSummary[Slot];
+		RT.Log(RuntimeKeeper::loglevel::INFO,
+		       "==CLPKM== Header summary: %" PRIu32 " unfinished, %" PRIu32
+		       " finished\n", Summary[0], Summary[1]);
+		INTER_ASSERT(!Summary[2], "some threads reach different barrier!");
+		Progress = (Summary[0] > 0) ? 1 : 0;
+		NumOfRemaining = Summary[3];
+		MinGrp = ~Summary[4];
+		MaxGrp = Summary[5];
+		}
+	else {
+		const bool CollectGrp = (Work->Launch.get() != NULL);
+		cl_uint*   Remaining = CollectGrp
+		                       ? Work->HostLaunch.data() + LAUNCH_TABLE : nullptr;
+		Progress = UpdateHeader(Work->HostHeader, Work->NumOfThread,
+		                        Work->WorkGrpSize, Work->Bucket, Remaining,
+		                        NumOfRemaining);
+		if (NumOfRemaining > 0) {
+			MinGrp = Remaining[0];
+			MaxGrp = Remaining[NumOfRemaining - 1];
+			}
+		}
 
 	// If finished
 	if (Progress == 0) {
@@ -263,10 +502,25 @@ void CL_CALLBACK CLPKM::ResumeOrFinish(cl_event Event, cl_int ExecStatus,
 		RT.Log(RuntimeKeeper::loglevel::INFO,
 		       "==CLPKM== Task finished\n");
 
+		// The instrumented kernel runs slower than the pristine one, so the
+		// prediction tends to be conservative
+		{
+			std::chrono::duration<double, std::nano> WallTime = Now - Work->Launched;
+			std::lock_guard<std::mutex> LockPool(*Work->KInfo->Mutex);
+			Work->KInfo->RecordExecTime(Work->ExecTime, Work->NumOfThread);
+			Work->KInfo->RecordSliceOverhead(Work->ExecTime, WallTime.count());
+			}
+
 		Ret = Lookup<OclAPI::clSetUserEventStatus>()(Work->Final.get(), CL_COMPLETE);
 		// Note: if the call failed here, following commands are likely to get
 		//       stuck forever...
 		INTER_ASSERT(Ret == CL_SUCCESS, "failed to set user event status");
+		if (Work->MapHeader)
+			UnmapAndRecycle(Work);
+		// The slice queued behind still uses the buffers if pipelined
+		Work->Done = true;
+		if (Work->InFlight > 0)
+			return;
 		LockWork.release();
 		CallbackCleanup(Work);
 		return;
@@ -277,25 +531,73 @@ void CL_CALLBACK CLPKM::ResumeOrFinish(cl_event Event, cl_int ExecStatus,
 
 	// Step 3
 	// If yet finished, setting up following run
+	// If pipelined, the next slice is already in flight, so queue the one
+	// after it
+	if (Work->Pipelined) {
+
+		cl_event WaitingList[2] = {Work->LastReduce.get(), NULL};
+		clEvent  UploadEvent(NULL);
+
+		// Upload after the slice in flight, which reads the launch info
+		if (Work->Launch.get() != NULL) {
+			auto S = getScheduleService().Schedule(task_kind::MEMCPY);
+			PlanLaunch(Work, NumOfRemaining, MinGrp, MaxGrp,
+			           Work->Run[Work->SlotOf(Work->NumOfEnqueued - 1)].get(),
+			           &UploadEvent.get());
+			WaitingList[1] = UploadEvent.get();
+			}
+
+		MetaEnqueue(Work, (WaitingList[1] != NULL) ? 2 : 1, WaitingList);
+		return;
+
+		}
+
 	cl_uint   NumOfWaiting = 0;
 	cl_event* WaitingList = nullptr;
 
-	// If need to update the header
-	if (Progress < 0) {
+	// The mapped header must be given back before the next run, which also
+	// brings the update to the device
+	if (Work->MapHeader) {
 
-		cl_int* HostHeader = Work->HostMetadata.data() + Work->HeaderOffset;
-		const size_t HeaderSize = Work->HostMetadata.size() - Work->HeaderOffset;
+		Ret = Lookup<OclAPI::clEnqueueUnmapMemObject>()(
+				Work->Queue, Work->DeviceHeader.get(), Work->HostHeader, 0, nullptr,
+				&Work->PrevWork.get());
+		OCL_ASSERT(Ret);
+
+		NumOfWaiting = 1;
+		WaitingList = &Work->PrevWork.get();
+
+		}
+	// If need to update the header
+	else if (Progress < 0) {
 
 		auto S = getScheduleService().Schedule(task_kind::MEMCPY);
 
 		Ret = Lookup<OclAPI::clEnqueueWriteBuffer>()(
 				Work->Queue, Work->DeviceHeader.get(), CL_FALSE,
-				Work->HeaderOffset * sizeof(cl_int), HeaderSize * sizeof(cl_int),
-				HostHeader, 0, nullptr, &Work->PrevWork[1].get());
+				Work->HeaderOffset * sizeof(cl_int), Work->NumOfThread * sizeof(cl_int),
+				Work->HostHeader, 0, nullptr, &Work->PrevWork.get());
 		OCL_ASSERT(Ret);
 
 		NumOfWaiting = 1;
-		WaitingList = &Work->PrevWork[1].get();
+		WaitingList = &Work->PrevWork.get();
+
+		}
+
+	// Relaunch only the unfinished work-groups if possible
+	// Uploading launch info is chained after updating the header, so that the
+	// next run only waits for one event
+	if (Work->Launch.get() != NULL) {
+
+		auto S = getScheduleService().Schedule(task_kind::MEMCPY);
+
+		clEvent PrevEvent = std::move(Work->PrevWork);
+
+		PlanLaunch(Work, NumOfRemaining, MinGrp, MaxGrp, PrevEvent.get(),
+		           &Work->PrevWork.get());
+
+		NumOfWaiting = 1;
+		WaitingList = &Work->PrevWork.get();
 
 		}
 
@@ -304,8 +606,40 @@ void CL_CALLBACK CLPKM::ResumeOrFinish(cl_event Event, cl_int ExecStatus,
 	}
 catch (const __ocl_error& OclError) {
 	auto* Work = static_cast<CallbackData*>(UserData);
-	cl_int Ret = Lookup<OclAPI::clSetUserEventStatus>()(
-			Work->Final.get(), OclError);
-	INTER_ASSERT(Ret == CL_SUCCESS, "failed to set user event status");
+	std::unique_lock<std::recursive_mutex> LockWork(*Work->Mutex);
+	if (!Work->Done) {
+		cl_int Ret = Lookup<OclAPI::clSetUserEventStatus>()(
+				Work->Final.get(), OclError);
+		INTER_ASSERT(Ret == CL_SUCCESS, "failed to set user event status");
+		Work->Done = true;
+		}
+	// Wait for slices still in flight
+	if (Work->InFlight > 0)
+		return;
+	LockWork.release();
 	CallbackCleanup(Work);
 	}
+
+void CL_CALLBACK CLPKM::PristineFinish(cl_event Event, cl_int ExecStatus,
+                                       void* UserData) try {
+
+	std::unique_ptr<PristineData> Data(static_cast<PristineData*>(UserData));
+	auto& RT = getRuntimeKeeper();
+
+	// Don't learn from failed runs
+	if (ExecStatus != CL_COMPLETE)
+		return;
+
+	cl_ulong ExecTime = getExecTime(Event);
+
+	RT.Log(RuntimeKeeper::loglevel::INFO,
+	       "\n==CLPKM== Pristine kernel %s finished in %f ms\n",
+	       Data->KInfo->Profile->PristineName.c_str(), ExecTime * 0.000001f);
+
+	std::lock_guard<std::mutex> Lock(*Data->KInfo->Mutex);
+	Data->KInfo->RecordExecTime(ExecTime, Data->NumOfThread);
+
+	}
+catch (const __ocl_error& ) {
+	// The error is logged, and there's nothing to clean up
+	}
@@ -11,6 +11,7 @@
 #include "ResourceGuard.hpp"
 #include "RuntimeKeeper.hpp"
 #include <chrono>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
@@ -20,27 +21,49 @@
 
 namespace CLPKM {
 
+// Indices to CallbackData::HostLaunch
+enum launch_info : size_t {
+	LAUNCH_NUM_GRPS = 0,
+	LAUNCH_BASE,
+	LAUNCH_NUM_GRPS_PER_DIM,
+	LAUNCH_GWO = LAUNCH_NUM_GRPS_PER_DIM + 3,
+	LAUNCH_TABLE = LAUNCH_GWO + 3
+	};
+
 struct CallbackData {
 
 	CallbackData() = delete;
 
-	CallbackData(cl_command_queue Q, clKernel&& K, KernelInfo* KI, cl_uint D,
+	CallbackData(cl_command_queue Q, PooledKernel&& K,
+	             std::shared_ptr<KernelInfo> KI, cl_uint D,
 	             std::vector<size_t>&& IGWO, std::vector<size_t>&& IGWS,
-	             std::vector<size_t>&& ILWS, size_t IWGS,
-	             clMemObj&& DH, clMemObj&& LB, clMemObj&& PB,
+	             std::vector<size_t>&& ILWS, size_t IWGS, size_t NT,
+	             clMemObj&& DH, clMemObj&& LB, clMemObj&& PB, clMemObj&& S,
+	             clMemObj&& SS, bool P, clMemObj&& L, std::vector<cl_uint>&& HL,
+	             BufferPool::Pinned&& HH, bool MH,
 	             std::vector<cl_int>&& HM, size_t HO, clEvent&& E, clEvent&& F,
 	             std::chrono::high_resolution_clock::time_point TP)
-	: Queue(Q), Kernel(std::move(K)), KInfo(KI), WorkDim(D),
+	: Queue(Q), Kernel(std::move(K.Kernel)), BoundArgs(std::move(K.Bound)),
+	  KInfo(std::move(KI)), WorkDim(D),
 	  GWO(std::move(IGWO)), GWS(std::move(IGWS)), LWS(std::move(ILWS)), WorkGrpSize(IWGS),
+	  NumOfThread(NT),
 	  DeviceHeader(std::move(DH)), LocalBuffer(std::move(LB)), PrivateBuffer(std::move(PB)),
-	  HostMetadata(std::move(HM)), HeaderOffset(HO), PrevWork{NULL, std::move(E)},
-	  Final(std::move(F)), LastCall(TP), Counter(0),
+	  Summary{std::move(S), std::move(SS)}, HostSummary{}, Pipelined(P),
+	  Run{NULL, NULL}, LastReduce(NULL), LastRead(NULL), NumOfEnqueued(0),
+	  InFlight(0), Done(false), Launch(std::move(L)),
+	  HostLaunch(std::move(HL)), StagedLaunch{}, NumOfLaunchedGrp(0),
+	  HostHeaderBuffer(std::move(HH)),
+	  HostHeader(static_cast<cl_int*>(HostHeaderBuffer.Ptr)), MapHeader(MH),
+	  HostMetadata(std::move(HM)), HeaderOffset(HO), PrevWork(std::move(E)),
+	  Final(std::move(F)), Launched(TP), LastCall(TP), Counter(0), ExecTime(0),
 	  Mutex(std::make_unique<std::recursive_mutex>()) { }
 
 	// Shadow queue and kernel to run
 	cl_command_queue Queue;
 	clKernel         Kernel;
-	KernelInfo*      KInfo;
+	// Arguments bound on Kernel, handed back to the pool with it
+	KernelArgs::fingerprint BoundArgs;
+	std::shared_ptr<KernelInfo> KInfo;
 
 	// Needed for enqueue
 	cl_uint WorkDim;
@@ -48,13 +71,59 @@ struct CallbackData {
 	std::vector<size_t> GWS;
 	std::vector<size_t> LWS;
 	size_t WorkGrpSize;
+	size_t NumOfThread;
 
 	// Record so that we can release the resources
 	clMemObj DeviceHeader;
 	clMemObj LocalBuffer;
 	clMemObj PrivateBuffer;
 
-	// The vector is not necessary here but I don't want to reallocate a buffer
+	// If the header is reduced on the device, the summary is read back instead
+	// See __clpkm_reduce_header in toolkit.cl for the layout
+	// There is one for each slot if the work is pipelined
+	clMemObj Summary[2];
+	cl_uint  HostSummary[2][6];
+
+	// If pipelined, the next slice is queued right behind the current one on
+	// the device, before the summary of the current one is read back
+	// In-flight slices alternate between two slots, while the header is shared
+	// as the slices are chained by events
+	const bool Pipelined;
+	clEvent    Run[2];
+	clEvent    LastReduce;
+	clEvent    LastRead;
+	unsigned   NumOfEnqueued;
+	unsigned   InFlight;
+	// Set once the task is finished or failed, and slices still in flight are
+	// drained before cleaning up
+	bool       Done;
+
+	size_t SlotOf(unsigned Seq) const { return Pipelined ? (Seq % 2) : 0; }
+
+	// Launch info for resuming only unfinished work-groups, if the kernel is
+	// compactable
+	// See __get_compact_linear_id in toolkit.cl for the layout
+	// The table of work-groups is only kept on the host if the header is
+	// scanned on the host
+	clMemObj Launch;
+	std::vector<cl_uint> HostLaunch;
+	// Plans being uploaded for each slot if pipelined
+	cl_uint StagedLaunch[2][LAUNCH_NUM_GRPS_PER_DIM];
+
+	// Number of work-groups launched in the last run, or 0 for the whole
+	// NDRange
+	size_t NumOfLaunchedGrp;
+
+	// Where the header is scanned if it's scanned on the host
+	// It's either read back into a pinned staging buffer mapped for the whole
+	// lifetime, or the header on the device mapped after each run if the
+	// device shares memory with the host
+	BufferPool::Pinned HostHeaderBuffer;
+	cl_int*            HostHeader;
+	const bool         MapHeader;
+
+	// Size table of dynamic local buffers, kept until the work is done as it's
+	// written asynchronously
 	// HeaderOffset indicates where the header starts
 	std::vector<cl_int> HostMetadata;
 	const size_t HeaderOffset;
@@ -64,16 +133,20 @@ struct CallbackData {
 	// cl_event associated to the later can be retrieved from the arguments to
 	// the callback while it's not possible for the first command. As a result,
 	// we must save the cl_event to track the status of the first command. Such
-	// event is placed at PrevWork[0].
-	// In case of first run, PrevWork[1] refers to the command to write header to
-	// the device.
-	clEvent PrevWork[2];
+	// event is placed at Run[SlotOf(Seq)].
+	// PrevWork refers to the command to prepare the next run, e.g. writing
+	// header to the device in case of first run.
+	clEvent PrevWork;
 	clEvent Final;
 
 	// Profiling related stuff
+	std::chrono::high_resolution_clock::time_point Launched;
 	std::chrono::high_resolution_clock::time_point LastCall;
 	unsigned Counter;
 
+	// Accumulated execution time of the kernel in nanosecs
+	cl_ulong ExecTime;
+
 	std::vector<std::array<unsigned, 2>> Bucket;
 
 	std::unique_ptr<std::recursive_mutex> Mutex;
@@ -83,6 +156,14 @@ struct CallbackData {
 void MetaEnqueue(CallbackData* , cl_uint , cl_event* );
 void CL_CALLBACK ResumeOrFinish(cl_event , cl_int , void* );
 
+// Record execution time of the uninstrumented clone
+struct PristineData {
+	std::shared_ptr<KernelInfo> KInfo;
+	size_t      NumOfThread;
+	};
+
+void CL_CALLBACK PristineFinish(cl_event , cl_int , void* );
+
 }
 
 
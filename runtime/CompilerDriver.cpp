@@ -7,11 +7,14 @@
 
 #include "CompilerDriver.hpp"
 #include "ErrorHandling.hpp"
+#include "InstrumentAPI.hpp"
+#include "RuntimeKeeper.hpp"
 #include "ScheduleService.hpp"
 
 #include <cstring>
 #include <vector>
 
+#include <dlfcn.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
@@ -43,6 +46,88 @@ namespace {
 			}
 		return Offset;
 		}
+
+	// The compiler is a plugin if its path ends with ".so", in which case
+	// words following the path are flags to it
+	bool IsPlugin(const std::string& Path) {
+		size_t End = Path.find(' ');
+		if (End == std::string::npos)
+			End = Path.size();
+		return (End >= 3 && Path.compare(End - 3, 3, ".so") == 0);
+		}
+
+	struct Plugin {
+		clpkmcc_instrument_t  Instrument = nullptr;
+		clpkmcc_free_result_t FreeResult = nullptr;
+		std::string Flags;
+		std::string Error;
+		};
+
+	// Loaded on first use and never unloaded
+	// The plugin comes with its own LLVM, which shall not be mixed up with
+	// the one a vendor implementation may have brought in
+	Plugin LoadPlugin(const std::string& Config) {
+		Plugin P;
+		size_t End = Config.find(' ');
+		std::string Path = Config.substr(0, End);
+		if (End != std::string::npos)
+			P.Flags = Config.substr(End + 1);
+		void* Handle = dlopen(Path.c_str(), RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND);
+		if (Handle == nullptr) {
+			P.Error = dlerror();
+			return P;
+			}
+		auto Version = reinterpret_cast<clpkmcc_api_version_t>(
+				dlsym(Handle, "clpkmcc_api_version"));
+		auto Instrument = reinterpret_cast<clpkmcc_instrument_t>(
+				dlsym(Handle, "clpkmcc_instrument"));
+		auto FreeResult = reinterpret_cast<clpkmcc_free_result_t>(
+				dlsym(Handle, "clpkmcc_free_result"));
+		if (Version == nullptr || Instrument == nullptr)
+			P.Error = Path + " is not a CLPKMCC plugin";
+		else if (Version() != CLPKMCC_API_VERSION || FreeResult == nullptr)
+			P.Error = Path + " is built against another version of the runtime";
+		else {
+			P.Instrument = Instrument;
+			P.FreeResult = FreeResult;
+			}
+		return P;
+		}
+
+	bool CompileInProcess(const std::string& Config, std::string& Source,
+	                      const char* Options, ProfileList& PL) {
+		static const Plugin P = LoadPlugin(Config);
+		if (P.Instrument == nullptr) {
+			Source = "Failed to load CLPKMCC plugin: " + P.Error;
+			return false;
+			}
+		clpkmcc_result Result = {};
+		bool Succeed = P.Instrument(Source.data(), Source.size(),
+		                            Options ? Options : "", P.Flags.c_str(),
+		                            &Result);
+		if (Result.TimingSize > 0)
+			CLPKM::getRuntimeKeeper().Log(CLPKM::RuntimeKeeper::loglevel::INFO,
+			                              "==CLPKM== CLPKMCC stages:\n%s",
+			                              Result.Timing);
+		Source.assign(Result.Source, Result.SourceSize);
+		if (Succeed) {
+			PL.clear();
+			for (size_t Idx = 0; Idx < Result.NumOfProfile; ++Idx) {
+				const clpkmcc_profile& In = Result.Profile[Idx];
+				KernelProfile& KP = PL.emplace_back(In.Name, In.NumOfParam);
+				KP.ReqPrvSize = In.ReqPrvSize;
+				KP.ReqLocSize = In.ReqLocSize;
+				KP.PrvLayout = static_cast<KernelProfile::prv_layout>(In.PrvLayout);
+				KP.PristineName = In.PristineName;
+				KP.Compactable = In.Compactable;
+				KP.LocPtrParamIdx.assign(In.LocPtrParamIdx,
+				                         In.LocPtrParamIdx + In.NumOfLocPtrParam);
+				}
+			}
+		// Allocated by the plugin, so released by it as well
+		P.FreeResult(&Result);
+		return Succeed;
+		}
 }
 
 
@@ -50,6 +135,11 @@ namespace {
 bool CLPKM::Compile(std::string& Source, const char* Options, ProfileList& PL) {
 	using pipe_t = int[2];
 
+	const std::string& CompilerPath = getScheduleService().getCompilerPath();
+
+	if (IsPlugin(CompilerPath))
+		return CompileInProcess(CompilerPath, Source, Options, PL);
+
 	pid_t Pid = 0;
 	pipe_t SrcPipe = {-1, -1}, OutPipe = {-1, -1}, YamlPipe = {-1, -1};
 	std::string Out, Yaml;
@@ -61,14 +151,21 @@ bool CLPKM::Compile(std::string& Source, const char* Options, ProfileList& PL) {
 		Succeed &= CloseFd(OutPipe[1]);
 		Succeed &= CloseFd(YamlPipe[0]);
 		Succeed &= CloseFd(YamlPipe[1]);
-		if (Pid != 0)
-			kill(Pid, SIGTERM);
 		if (!Succeed)
 			Source = StrError(errno);
+		// Reap it, or every failed build, speculative ones included, leaves a
+		// zombie behind
+		// Pid is -1 if fork failed, which must not be passed to kill
+		if (Pid > 0 && kill(Pid, SIGTERM) == 0)
+			waitpid(Pid, nullptr, 0);
 		return Succeed;
 		};
 
-	if (pipe(SrcPipe) || pipe(OutPipe) || pipe(YamlPipe))
+	// Builds may fork concurrently, and a child holding the write end of
+	// another's pipe keeps it from seeing EOF
+	// The flag is cleared on the descriptors the child dups to stdio
+	if (pipe2(SrcPipe, O_CLOEXEC) || pipe2(OutPipe, O_CLOEXEC) ||
+	    pipe2(YamlPipe, O_CLOEXEC))
 		return Cleanup();
 
 	Pid = fork();
@@ -90,9 +187,8 @@ bool CLPKM::Compile(std::string& Source, const char* Options, ProfileList& PL) {
 		         !CloseFd(YamlPipe[0]) || !CloseFd(YamlPipe[1]))
 			ErrorMsg = StrError(errno);
 		// It won't return unless something went south
-		else if (execlp(CLPKM::getScheduleService().getCompilerPath().c_str(),
-		                CLPKM::getScheduleService().getCompilerPath().c_str(),
-		                Options, NULL) == -1)
+		else if (execlp(CompilerPath.c_str(), CompilerPath.c_str(), Options,
+		                NULL) == -1)
 			ErrorMsg = StrError(errno);
 
 		FullWrite(STDERR_FILENO, ErrorMsg.data(), ErrorMsg.size());
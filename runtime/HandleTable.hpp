@@ -0,0 +1,110 @@
+/*
+  HandleTable.hpp
+
+  Map from OpenCL handles to their info, sharded so that threads touching
+  different handles rarely contend on the same lock
+
+*/
+
+#ifndef __CLPKM__HANDLE_TABLE_HPP__
+#define __CLPKM__HANDLE_TABLE_HPP__
+
+
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+
+
+namespace CLPKM {
+
+// Entries are reference counted, so that a lookup only holds the lock of the
+// shard for the lookup itself, and an entry erased meanwhile stays alive
+// until the last one holding it is done
+template <class Handle, class Info, size_t NumOfShard = 16>
+class HandleTable {
+public:
+	using info_ptr = std::shared_ptr<Info>;
+
+	// Null if not found
+	info_ptr find(Handle H) const {
+		const Shard& S = getShard(H);
+		boost::shared_lock<boost::shared_mutex> Lock(S.Mutex);
+		auto It = S.Map.find(H);
+		return (It != S.Map.end()) ? It->second : nullptr;
+		}
+
+	// False if H is already there
+	bool emplace(Handle H, Info&& I) {
+		auto Ptr = std::make_shared<Info>(std::move(I));
+		Shard& S = getShard(H);
+		boost::unique_lock<boost::shared_mutex> Lock(S.Mutex);
+		return S.Map.emplace(H, std::move(Ptr)).second;
+		}
+
+	// Replace the entry of H, or insert one if there's none
+	// Those holding the old entry keep seeing it as it was
+	void insert_or_assign(Handle H, Info&& I) {
+		auto Ptr = std::make_shared<Info>(std::move(I));
+		Shard& S = getShard(H);
+		boost::unique_lock<boost::shared_mutex> Lock(S.Mutex);
+		S.Map[H] = std::move(Ptr);
+		}
+
+	// Return the entry removed, or null if not found
+	info_ptr erase(Handle H) {
+		Shard& S = getShard(H);
+		boost::unique_lock<boost::shared_mutex> Lock(S.Mutex);
+		auto It = S.Map.find(H);
+		if (It == S.Map.end())
+			return nullptr;
+		info_ptr Ptr = std::move(It->second);
+		S.Map.erase(It);
+		return Ptr;
+		}
+
+	// Whether Pred(Handle, const Info&) holds for any entry
+	// Shards are visited one by one, so this is not a snapshot
+	template <class P>
+	bool any_of(P&& Pred) const {
+		for (const Shard& S : Shards) {
+			boost::shared_lock<boost::shared_mutex> Lock(S.Mutex);
+			for (const auto& Entry : S.Map)
+				if (Pred(Entry.first, static_cast<const Info&>(*Entry.second)))
+					return true;
+			}
+		return false;
+		}
+
+private:
+	// Padded to a cache line so that shards don't false-share
+	struct alignas(64) Shard {
+		mutable boost::shared_mutex Mutex;
+		std::unordered_map<Handle, info_ptr> Map;
+		};
+
+	// Handles are pointers, whose low bits are mostly zeros
+	static size_t getShardIdx(Handle H) {
+		uint64_t Val = reinterpret_cast<uintptr_t>(H);
+		Val ^= Val >> 17;
+		Val *= UINT64_C(0x9E3779B97F4A7C15);
+		return (Val >> 32) % NumOfShard;
+		}
+
+	Shard& getShard(Handle H) { return Shards[getShardIdx(H)]; }
+	const Shard& getShard(Handle H) const { return Shards[getShardIdx(H)]; }
+
+	Shard Shards[NumOfShard];
+
+	};
+
+}
+
+
+
+#endif
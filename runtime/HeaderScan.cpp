@@ -0,0 +1,354 @@
+/*
+  HeaderScan.cpp
+
+  Inspect the header read back from the device (impl)
+
+*/
+
+
+
+#include "HeaderScan.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CLPKM_SCAN_X86
+#include <immintrin.h>
+#endif
+
+using namespace CLPKM;
+
+
+
+namespace {
+
+// Summary of a work-group
+// Tags are the min and max of negative entries, i.e. barriers blocking
+// work-items, which shall be the same
+struct GroupStat {
+	cl_int  Or;
+	cl_uint NumOfBlocked;
+	cl_int  TagMin;
+	cl_int  TagMax;
+	};
+
+using group_scanner = GroupStat (*)(const cl_int* , size_t );
+
+inline void Accumulate(GroupStat& GS, cl_int Val) {
+	GS.Or |= Val;
+	if (Val < 0) {
+		++GS.NumOfBlocked;
+		GS.TagMin = std::min(GS.TagMin, Val);
+		GS.TagMax = std::max(GS.TagMax, Val);
+		}
+	}
+
+GroupStat ScanGroupScalar(const cl_int* First, size_t Size) {
+	GroupStat GS{0, 0, 0, INT32_MIN};
+	for (size_t Idx = 0; Idx < Size; ++Idx)
+		Accumulate(GS, First[Idx]);
+	return GS;
+	}
+
+#ifdef CLPKM_SCAN_X86
+// Merge per-lane summaries, and take care of the tail
+template <size_t N>
+GroupStat Reduce(const cl_int (&Or)[N], const cl_int (&Cnt)[N],
+                 const cl_int (&Min)[N], const cl_int (&Max)[N],
+                 const cl_int* Tail, size_t TailSize) {
+	GroupStat GS{0, 0, 0, INT32_MIN};
+	for (size_t Lane = 0; Lane < N; ++Lane) {
+		GS.Or |= Or[Lane];
+		GS.NumOfBlocked += Cnt[Lane];
+		GS.TagMin = std::min(GS.TagMin, Min[Lane]);
+		GS.TagMax = std::max(GS.TagMax, Max[Lane]);
+		}
+	for (size_t Idx = 0; Idx < TailSize; ++Idx)
+		Accumulate(GS, Tail[Idx]);
+	return GS;
+	}
+
+// SSE2 has no min/max of 32-bit integers, blend with the comparison instead
+__attribute__((target("sse2")))
+GroupStat ScanGroupSSE2(const cl_int* First, size_t Size) {
+
+	const __m128i IntMin = _mm_set1_epi32(INT32_MIN);
+
+	__m128i Or = _mm_setzero_si128();
+	__m128i Cnt = _mm_setzero_si128();
+	__m128i Min = _mm_setzero_si128();
+	__m128i Max = IntMin;
+
+	size_t Idx = 0;
+
+	for (; Idx + 4 <= Size; Idx += 4) {
+		__m128i Val = _mm_loadu_si128(reinterpret_cast<const __m128i*>(First + Idx));
+		// All ones if blocked by a barrier
+		__m128i Neg = _mm_srai_epi32(Val, 31);
+		Or = _mm_or_si128(Or, Val);
+		Cnt = _mm_sub_epi32(Cnt, Neg);
+		// The value if blocked, or 0 for min and INT_MIN for max
+		__m128i ForMin = _mm_and_si128(Val, Neg);
+		__m128i ForMax = _mm_or_si128(ForMin, _mm_andnot_si128(Neg, IntMin));
+		__m128i Lt = _mm_cmplt_epi32(ForMin, Min);
+		Min = _mm_or_si128(_mm_and_si128(Lt, ForMin), _mm_andnot_si128(Lt, Min));
+		__m128i Gt = _mm_cmpgt_epi32(ForMax, Max);
+		Max = _mm_or_si128(_mm_and_si128(Gt, ForMax), _mm_andnot_si128(Gt, Max));
+		}
+
+	alignas(16) cl_int LaneOr[4], LaneCnt[4], LaneMin[4], LaneMax[4];
+	_mm_store_si128(reinterpret_cast<__m128i*>(LaneOr), Or);
+	_mm_store_si128(reinterpret_cast<__m128i*>(LaneCnt), Cnt);
+	_mm_store_si128(reinterpret_cast<__m128i*>(LaneMin), Min);
+	_mm_store_si128(reinterpret_cast<__m128i*>(LaneMax), Max);
+
+	return Reduce(LaneOr, LaneCnt, LaneMin, LaneMax, First + Idx, Size - Idx);
+
+	}
+
+__attribute__((target("avx2")))
+GroupStat ScanGroupAVX2(const cl_int* First, size_t Size) {
+
+	const __m256i IntMin = _mm256_set1_epi32(INT32_MIN);
+
+	__m256i Or = _mm256_setzero_si256();
+	__m256i Cnt = _mm256_setzero_si256();
+	__m256i Min = _mm256_setzero_si256();
+	__m256i Max = IntMin;
+
+	size_t Idx = 0;
+
+	for (; Idx + 8 <= Size; Idx += 8) {
+		__m256i Val = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i*>(First + Idx));
+		__m256i Neg = _mm256_srai_epi32(Val, 31);
+		Or = _mm256_or_si256(Or, Val);
+		Cnt = _mm256_sub_epi32(Cnt, Neg);
+		Min = _mm256_min_epi32(Min, _mm256_and_si256(Val, Neg));
+		Max = _mm256_max_epi32(Max, _mm256_blendv_epi8(IntMin, Val, Neg));
+		}
+
+	alignas(32) cl_int LaneOr[8], LaneCnt[8], LaneMin[8], LaneMax[8];
+	_mm256_store_si256(reinterpret_cast<__m256i*>(LaneOr), Or);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(LaneCnt), Cnt);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(LaneMin), Min);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(LaneMax), Max);
+
+	return Reduce(LaneOr, LaneCnt, LaneMin, LaneMax, First + Idx, Size - Idx);
+
+	}
+#endif
+
+group_scanner getGroupScanner(scan_isa ISA) {
+	switch (ISA) {
+#ifdef CLPKM_SCAN_X86
+	case scan_isa::AVX2:
+		return ScanGroupAVX2;
+	case scan_isa::SSE2:
+		return ScanGroupSSE2;
+#endif
+	default:
+		return ScanGroupScalar;
+		}
+	}
+
+// Scan work-groups [FirstGrp, LastGrp)
+// IDs of unfinished work-groups are put from Remaining[FirstGrp]
+HeaderScanResult ScanChunk(group_scanner Scan, cl_int* Header,
+                           size_t FirstGrp, size_t LastGrp, size_t WorkGrpSize,
+                           cl_uint* Remaining) {
+
+	HeaderScanResult Result{0, 0, false};
+
+	for (size_t GrpId = FirstGrp; GrpId < LastGrp; ++GrpId) {
+		cl_int* First = Header + GrpId * WorkGrpSize;
+		GroupStat GS = Scan(First, WorkGrpSize);
+		// All work-items have finished
+		if (GS.Or == 0)
+			continue;
+		if (Result.Progress == 0)
+			Result.Progress = 1;
+		if (GS.NumOfBlocked > 0 && GS.TagMin != GS.TagMax)
+			Result.Mismatch = true;
+		// If all work-items in the groups are being blocking by the same
+		// barrier, let them pass
+		else if (GS.NumOfBlocked == WorkGrpSize) {
+			std::fill(First, First + WorkGrpSize, -GS.TagMin);
+			Result.Progress = -1;
+			}
+		if (Remaining != nullptr)
+			Remaining[FirstGrp + Result.NumOfRemaining] = GrpId;
+		++Result.NumOfRemaining;
+		}
+
+	return Result;
+
+	}
+
+// A few threads to scan large headers, the calling thread included
+class ScanWorkerPool {
+public:
+	ScanWorkerPool(unsigned NumOfWorker)
+	: Job(nullptr), NumOfTask(0), Next(0), NumOfBusy(0), Generation(0),
+	  Stop(false) {
+		for (unsigned Idx = 0; Idx < NumOfWorker; ++Idx)
+			Workers.emplace_back(&ScanWorkerPool::Work, this);
+		}
+
+	~ScanWorkerPool() {
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			Stop = true;
+		}
+		WakeUp.notify_all();
+		for (auto& Worker : Workers)
+			Worker.join();
+		}
+
+	size_t size() const { return Workers.size(); }
+
+	// Run Func(0), Func(1), ... Func(N - 1) and wait for all of them
+	void Run(size_t N, const std::function<void(size_t)>& Func) {
+		std::lock_guard<std::mutex> LockRun(RunMutex);
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			Job = &Func;
+			NumOfTask = N;
+			Next = 0;
+			NumOfBusy = Workers.size();
+			++Generation;
+		}
+		WakeUp.notify_all();
+		Drain();
+		std::unique_lock<std::mutex> Lock(Mutex);
+		Done.wait(Lock, [this] { return (NumOfBusy == 0); });
+		Job = nullptr;
+		}
+
+private:
+	void Drain() {
+		for (size_t Task; (Task = Next.fetch_add(1)) < NumOfTask; )
+			(*Job)(Task);
+		}
+
+	void Work() {
+		uint64_t Seen = 0;
+		std::unique_lock<std::mutex> Lock(Mutex);
+		for (;;) {
+			WakeUp.wait(Lock, [&] { return (Stop || Generation != Seen); });
+			if (Stop)
+				return;
+			Seen = Generation;
+			Lock.unlock();
+			Drain();
+			Lock.lock();
+			if (--NumOfBusy == 0)
+				Done.notify_one();
+			}
+		}
+
+	std::mutex RunMutex;
+	std::mutex Mutex;
+	std::condition_variable WakeUp;
+	std::condition_variable Done;
+
+	const std::function<void(size_t)>* Job;
+	size_t              NumOfTask;
+	std::atomic<size_t> Next;
+	size_t              NumOfBusy;
+	uint64_t            Generation;
+	bool                Stop;
+
+	std::vector<std::thread> Workers;
+
+	};
+
+ScanWorkerPool& getScanWorkerPool() {
+	static ScanWorkerPool Pool(
+			std::min(3u, std::max(std::thread::hardware_concurrency(), 1u) - 1));
+	return Pool;
+	}
+
+// Don't bother other threads for headers smaller than 1 MiB per chunk
+constexpr size_t MinItemsPerChunk = (1 << 20) / sizeof(cl_int);
+
+}
+
+
+
+scan_isa CLPKM::getScanISA(void) {
+#ifdef CLPKM_SCAN_X86
+	static const scan_isa ISA = __builtin_cpu_supports("avx2") ? scan_isa::AVX2
+	                          : __builtin_cpu_supports("sse2") ? scan_isa::SSE2
+	                          : scan_isa::SCALAR;
+	return ISA;
+#else
+	return scan_isa::SCALAR;
+#endif
+	}
+
+const char* CLPKM::getScanISAName(scan_isa ISA) {
+	switch (ISA) {
+	case scan_isa::AVX2:
+		return "avx2";
+	case scan_isa::SSE2:
+		return "sse2";
+	default:
+		return "scalar";
+		}
+	}
+
+HeaderScanResult CLPKM::ScanHeader(cl_int* Header, size_t NumOfWorkGrp,
+                                   size_t WorkGrpSize, cl_uint* Remaining,
+                                   scan_isa ISA, bool Parallel) {
+
+	group_scanner Scan = getGroupScanner(ISA);
+	size_t NumOfChunk = 1;
+
+	if (Parallel) {
+		NumOfChunk = std::min({getScanWorkerPool().size() + 1,
+		                       NumOfWorkGrp * WorkGrpSize / MinItemsPerChunk,
+		                       NumOfWorkGrp});
+		}
+
+	if (NumOfChunk <= 1)
+		return ScanChunk(Scan, Header, 0, NumOfWorkGrp, WorkGrpSize, Remaining);
+
+	std::vector<HeaderScanResult> Results(NumOfChunk);
+
+	auto Bound = [&](size_t Chunk) -> size_t {
+		return NumOfWorkGrp * Chunk / NumOfChunk;
+		};
+
+	getScanWorkerPool().Run(NumOfChunk, [&](size_t Chunk) {
+			Results[Chunk] = ScanChunk(Scan, Header, Bound(Chunk), Bound(Chunk + 1),
+			                           WorkGrpSize, Remaining);
+			});
+
+	// Merge, packing the IDs of unfinished work-groups
+	HeaderScanResult Result{0, 0, false};
+
+	for (size_t Chunk = 0; Chunk < NumOfChunk; ++Chunk) {
+		const auto& Part = Results[Chunk];
+		if (Part.Progress < 0)
+			Result.Progress = -1;
+		else if (Result.Progress == 0)
+			Result.Progress = Part.Progress;
+		Result.Mismatch |= Part.Mismatch;
+		if (Remaining != nullptr && Part.NumOfRemaining > 0) {
+			memmove(Remaining + Result.NumOfRemaining, Remaining + Bound(Chunk),
+			        Part.NumOfRemaining * sizeof(cl_uint));
+			}
+		Result.NumOfRemaining += Part.NumOfRemaining;
+		}
+
+	return Result;
+
+	}
@@ -0,0 +1,56 @@
+/*
+  HeaderScan.hpp
+
+  Inspect the header read back from the device, vectorized and split across
+  threads if it's large
+
+*/
+
+#ifndef __CLPKM__HEADER_SCAN_HPP__
+#define __CLPKM__HEADER_SCAN_HPP__
+
+
+
+#include <cstddef>
+#include <cstdint>
+
+#include <CL/opencl.h>
+
+
+
+namespace CLPKM {
+
+// Instruction sets that the scan is implemented with
+enum class scan_isa : uint8_t {
+	SCALAR = 0,
+	SSE2,
+	AVX2
+	};
+
+struct HeaderScanResult {
+	// 0 if finished, 1 if yet finished, -1 if yet finished and the header is
+	// updated
+	int    Progress;
+	size_t NumOfRemaining;
+	// Some work-items in a work-group reach different barriers
+	bool   Mismatch;
+	};
+
+// The best one supported by this CPU
+scan_isa getScanISA(void);
+const char* getScanISAName(scan_isa );
+
+// Scan the header of NumOfWorkGrp work-groups, letting work-groups whose
+// work-items are all blocked by the same barrier pass
+// If Remaining is not null, IDs of unfinished work-groups are put into it in
+// ascending order
+// Large headers are split across a few worker threads if Parallel is true
+HeaderScanResult ScanHeader(cl_int* Header, size_t NumOfWorkGrp,
+                            size_t WorkGrpSize, cl_uint* Remaining,
+                            scan_isa ISA = getScanISA(), bool Parallel = true);
+
+}
+
+
+
+#endif
@@ -0,0 +1 @@
+../driver/InstrumentAPI.hpp
\ No newline at end of file
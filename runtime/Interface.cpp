@@ -7,18 +7,22 @@
 
 
 
+#include "BuildService.hpp"
 #include "Callback.hpp"
-#include "CompilerDriver.hpp"
 #include "ErrorHandling.hpp"
 #include "KernelProfile.hpp"
 #include "LookupVendorImpl.hpp"
 #include "ResourceGuard.hpp"
 #include "RuntimeKeeper.hpp"
 #include "ScheduleService.hpp"
+#include "Speculator.hpp"
 #include "Support.hpp"
 
 #include <algorithm>
+#include <cinttypes>
 #include <cstring>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <numeric>
 #include <string>
@@ -69,17 +73,32 @@ cl_command_queue clCreateCommandQueue(cl_context Context, cl_device_id Device,
 	clQueue ShadowQueue = venCreateCommandQueue(Context, Device, Property, &Ret);
 	OCL_ASSERT(Ret);
 
+	// Create the preemption flag and map it for good
+	clMemObj PreemptFlag = Lookup<OclAPI::clCreateBuffer>()(
+			Context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, sizeof(cl_int),
+			nullptr, &Ret);
+	OCL_ASSERT(Ret);
+
+	auto* MappedPreemptFlag = static_cast<cl_int*>(
+			Lookup<OclAPI::clEnqueueMapBuffer>()(
+					ShadowQueue.get(), PreemptFlag.get(), CL_TRUE,
+					CL_MAP_READ | CL_MAP_WRITE, 0, sizeof(cl_int), 0, nullptr,
+					nullptr, &Ret));
+	OCL_ASSERT(Ret);
+
 	auto& RT = getRuntimeKeeper();
 	auto& QT = RT.getQueueTable();
 
 	QueueInfo NewInfo(Context, Device, std::move(ShadowQueue),
-	                  !(Properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE));
+	                  QueryDeviceInfo(Device),
+	                  !(Properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE),
+	                  std::move(PreemptFlag), MappedPreemptFlag);
 
 	// Create a slot for the queue
-	boost::unique_lock<boost::upgrade_mutex> Lock(RT.getQTLock());
+	const bool Inserted = QT.emplace(RawQueue, std::move(NewInfo));
+	INTER_ASSERT(Inserted, "insertion to queue table didn't take place");
 
-	const auto It = QT.emplace(RawQueue, std::move(NewInfo));
-	INTER_ASSERT(It.second, "insertion to queue table didn't take place");
+	getScheduleService().RegisterPreemptFlag(MappedPreemptFlag);
 
 	// If we reach here, things shall be fine
 	// Set to NULL to prevent it from being released
@@ -112,10 +131,9 @@ cl_int clReleaseCommandQueue(cl_command_queue Queue) try {
 	auto& RT = getRuntimeKeeper();
 	auto& QT = RT.getQueueTable();
 
-	boost::upgrade_lock<boost::upgrade_mutex> RdLock(RT.getQTLock());
-	const auto It = QT.find(Queue);
+	const auto InfoPtr = QT.find(Queue);
 
-	if (It == QT.end())
+	if (InfoPtr == nullptr)
 		return CL_INVALID_COMMAND_QUEUE;
 
 	// Put mutex here to prevent multi-threads got old reference count and
@@ -130,8 +148,29 @@ cl_int clReleaseCommandQueue(cl_command_queue Queue) try {
 	OCL_ASSERT(Ret);
 
 	if (RefCount <= 1) {
-		boost::upgrade_to_unique_lock<boost::upgrade_mutex> WrLock(RdLock);
-		QT.erase(It);
+		auto& Info = *InfoPtr;
+		getScheduleService().UnregisterPreemptFlag(Info.MappedPreemptFlag);
+		Ret = Lookup<OclAPI::clEnqueueUnmapMemObject>()(
+				Info.ShadowQueue.get(), Info.PreemptFlag.get(),
+				Info.MappedPreemptFlag, 0, nullptr, nullptr);
+		OCL_ASSERT(Ret);
+		// Drop idle buffers once the last queue of the context is gone
+		bool ContextInUse = QT.any_of([&](cl_command_queue Q, const auto& I) {
+				return (Q != Queue && I.Context == Info.Context);
+				});
+		if (!ContextInUse) {
+			auto& BP = RT.getBufferPool();
+			size_t Freed = BP.Trim(Info.Context, Info.ShadowQueue.get());
+			auto Stats = BP.getStats();
+			uint64_t Total = Stats.Hit + Stats.Miss;
+			RT.Log(RuntimeKeeper::loglevel::INFO,
+			       "==CLPKM== Buffer pool: %" PRIu64 "/%" PRIu64 " hits (%.1f%%), "
+			       "%s freed, %s held\n", Stats.Hit, Total,
+			       (Total > 0) ? 100.0 * Stats.Hit / Total : 0.0,
+			       ToHumanReadable(Freed).c_str(),
+			       ToHumanReadable(Stats.BytesHeld).c_str());
+			}
+		QT.erase(Queue);
 		}
 
 	return venReleaseCommandQueue(Queue);
@@ -156,20 +195,29 @@ cl_int clGetProgramBuildInfo(cl_program Program, cl_device_id Device,
 	auto& RT = getRuntimeKeeper();
 	auto& PT = RT.getProgramTable();
 
-	boost::shared_lock<boost::upgrade_mutex> RdLock(RT.getPTLock());
-	const auto It = PT.find(Program);
+	const auto Info = PT.find(Program);
 
 	// Found
-	if (It != PT.end()) {
+	if (Info != nullptr) {
 		// If its shadow is valid, use shadow
-		if (It->second.ShadowProgram.get() != NULL)
-			Program = It->second.ShadowProgram.get();
-		// If not, we can intercept CL_PROGRAM_BUILD_LOG
+		if (Info->ShadowProgram.get() != NULL)
+			Program = Info->ShadowProgram.get();
+		// If not, it's either being built or failed to instrument
+		else if (ParamName == CL_PROGRAM_BUILD_STATUS) {
+			if (ParamVal != nullptr && ParamValSize < sizeof(cl_build_status))
+				return CL_INVALID_VALUE;
+			if (ParamVal != nullptr)
+				*static_cast<cl_build_status*>(ParamVal) =
+						Info->InProgress ? CL_BUILD_IN_PROGRESS : CL_BUILD_ERROR;
+			if (ParamValSizeRet != nullptr)
+				*ParamValSizeRet = sizeof(cl_build_status);
+			return CL_SUCCESS;
+			}
 		else if (ParamName == CL_PROGRAM_BUILD_LOG) {
-			if (ParamVal != nullptr && ParamValSize > It->second.BuildLog.size())
-				strcpy(static_cast<char*>(ParamVal), It->second.BuildLog.c_str());
+			if (ParamVal != nullptr && ParamValSize > Info->BuildLog.size())
+				strcpy(static_cast<char*>(ParamVal), Info->BuildLog.c_str());
 			if (ParamValSizeRet != nullptr)
-				*ParamValSizeRet = It->second.BuildLog.size() + 1;
+				*ParamValSizeRet = Info->BuildLog.size() + 1;
 			return CL_SUCCESS;
 			}
 		}
@@ -180,6 +228,31 @@ cl_int clGetProgramBuildInfo(cl_program Program, cl_device_id Device,
 	}
 
 
+cl_program clCreateProgramWithSource(cl_context Context, cl_uint Count,
+                                     const char** Strings,
+                                     const size_t* Lengths,
+                                     cl_int* ErrorRet) {
+
+	cl_program Program = Lookup<OclAPI::clCreateProgramWithSource>()(
+			Context, Count, Strings, Lengths, ErrorRet);
+
+	if (Program == NULL ||
+	    getScheduleService().getPriority() != ScheduleService::priority::LOW)
+		return Program;
+
+	// Most applications set up buffers between creating and building the
+	// program, which hides the latency of CLPKMCC
+	// It's only a guess, so anything going wrong is left to clBuildProgram
+	try {
+		getSpeculator().Start(Program, GetProgramSource(Program));
+		}
+	catch (const __ocl_error& ) { }
+	catch (const std::bad_alloc& ) { }
+
+	return Program;
+
+	}
+
 cl_int clBuildProgram(cl_program Program,
                       cl_uint NumOfDevice, const cl_device_id* DeviceList,
                       const char* Options,
@@ -195,132 +268,73 @@ cl_int clBuildProgram(cl_program Program,
 		}
 
 	// FIXME: we can't handle clBuildProgram on the same program twice atm
-	std::string Source;
-	size_t SourceLength = 0;
-
-	auto venGetProgramInfo = Lookup<OclAPI::clGetProgramInfo>();
-	cl_int Ret = venGetProgramInfo(Program, CL_PROGRAM_SOURCE, 0, nullptr,
-	                               &SourceLength);
-	OCL_ASSERT(Ret);
-
-	// Must be greater than zero because the size includes null terminator
-	INTER_ASSERT(SourceLength > 0, "clGetProgramInfo returned zero source length");
+	std::string Source = GetProgramSource(Program);
 
 	// If the program is created via clCreateProgramWithBinary or is a built-in
 	// kernel, it returns a null string
-	if (SourceLength == 1) {
+	if (Source.empty()) {
 		// TODO: we may want to support this?
 		INTER_ASSERT(false, "build program from binary is yet impl'd");
 		}
 
-	// Retrieve the source to instrument and remove the null terminator
-	Source.resize(SourceLength, '\0');
-	Ret = venGetProgramInfo(Program, CL_PROGRAM_SOURCE, SourceLength,
-	                        Source.data(), nullptr);
-	OCL_ASSERT(Ret);
-	Source.resize(SourceLength - 1);
-
+	auto venGetProgramInfo = Lookup<OclAPI::clGetProgramInfo>();
 	cl_context Context;
 
 	// Retrieve the context to build a new program
-	Ret = venGetProgramInfo(Program, CL_PROGRAM_CONTEXT, sizeof(Context),
-	                        &Context, nullptr);
+	cl_int Ret = venGetProgramInfo(Program, CL_PROGRAM_CONTEXT, sizeof(Context),
+	                               &Context, nullptr);
 	OCL_ASSERT(Ret);
 
-	auto& RT = getRuntimeKeeper();
-	auto& PT = RT.getProgramTable();
-	ProfileList PL;
-
-	// Now invoke CLPKMCC
-	if (!CLPKM::Compile(Source, Options, PL)) {
-
-		RT.Log(RuntimeKeeper::loglevel::DEBUG,
-		       "==CLPKM== Build program failed! Build log:\n"
-		       "------------[ cut here ]------------\n"
-		       "%s\n"
-		       "------------[ cut here ]------------\n",
-		       Source.c_str());
-
-		// Build log is put in source
-		ProgramInfo NewEntry(Context, NULL, std::move(Source), ProfileList());
-
-		boost::unique_lock<boost::upgrade_mutex> Lock(RT.getPTLock());
-		const auto It = PT.emplace(Program, std::move(NewEntry));
-
-		// FIXME: this is possible when a program is built serveral times
-		INTER_ASSERT(It.second, "insertion to program table didn't take place");
-
-		return CL_BUILD_PROGRAM_FAILURE;
+	auto& PT = getRuntimeKeeper().getProgramTable();
 
+	// Reject another build while one is in progress, as the vendor does
+	if (!PT.emplace(Program, ProgramInfo(Context))) {
+		auto Info = PT.find(Program);
+		if (Info != nullptr && Info->InProgress)
+			return CL_INVALID_OPERATION;
+		// FIXME: this is possible, if build a program serveral times
+		INTER_ASSERT(false, "insertion to program table didn't take place");
 		}
 
-	const char* Ptr = Source.data();
-	const size_t Len = Source.size();
+	// The caller is blocked till it's done, as the spec says
+	if (Notify == nullptr)
+		return BuildShadowProgram(Program, Context, std::move(Source),
+		                          NumOfDevice, DeviceList, Options);
 
-	// Build a new program with instrumented code
-	cl_program RawShadowProgram = Lookup<OclAPI::clCreateProgramWithSource>()(
-			Context, 1, &Ptr, &Len, &Ret);
+	// Kept alive till the build is done, in case it's released meanwhile
+	Ret = Lookup<OclAPI::clRetainProgram>()(Program);
+	if (Ret != CL_SUCCESS)
+		PT.erase(Program);
 	OCL_ASSERT(Ret);
 
-	clProgram ShadowProgram = RawShadowProgram;
-
-	ProgramInfo NewEntry(Context, std::move(ShadowProgram), std::string(),
-	                     std::move(PL));
-
-	boost::unique_lock<boost::upgrade_mutex> Lock(RT.getPTLock());
-	const auto It = PT.emplace(Program, std::move(NewEntry));
-
-	// FIXME: this is possible, if build a program serveral times
-	INTER_ASSERT(It.second, "insertion to program table didn't take place");
-
-	// Call the vendor's impl to build the instrumented code
-	Ret = venBuildProgram(RawShadowProgram, NumOfDevice, DeviceList, Options,
-	                      Notify, UserData);
-
-	// Return immediately if not in debug mode
-	if (!RT.shouldLog(RuntimeKeeper::loglevel::DEBUG))
-		return Ret;
-
-	// Do not try to retrieve device list here because it seems to be expensive
-	if (!DeviceList) {
-		RT.Log("==CLPKM== Device list not specified, skipping logging build log\n");
-		return Ret;
-		}
-
-	auto venGetProgramBuildInfo = Lookup<OclAPI::clGetProgramBuildInfo>();
-
-	size_t LogLength = 0;
-	std::string VendorLog;
-
-	cl_int DRet = venGetProgramBuildInfo(
-			RawShadowProgram, DeviceList[0], CL_PROGRAM_BUILD_LOG,
-			0, nullptr, &LogLength);
-
-	if (DRet != CL_SUCCESS) {
-		RT.Log("==CLPKM== Failed to query size of vendor build log, ret %"
-		       PRId32 "\n", DRet);
-		return Ret;
-		}
-
-	VendorLog.resize(LogLength, '\0');
-
-	DRet = venGetProgramBuildInfo(
-			RawShadowProgram, DeviceList[0], CL_PROGRAM_BUILD_LOG,
-			LogLength, VendorLog.data(), nullptr);
-
-	if (DRet != CL_SUCCESS) {
-		RT.Log("==CLPKM== Failed to retrieve vendor build log, ret %" PRId32 "\n",
-		       DRet);
-		return Ret;
-		}
-
-	RT.Log("\n==CLPKM== Vendor compiler build log:\n"
-	       "------------[ cut here ]------------\n"
-	       "%s\n"
-	       "------------[ cut here ]------------\n",
-	       VendorLog.c_str());
+	std::vector<cl_device_id> Devices;
+	if (DeviceList != nullptr)
+		Devices.assign(DeviceList, DeviceList + NumOfDevice);
+
+	const bool HasOptions = (Options != nullptr);
+	std::string Opts = HasOptions ? Options : "";
+
+	getBuildService().Submit(
+			[=, Source = std::move(Source), Devices = std::move(Devices),
+			 Opts = std::move(Opts)]() mutable {
+		BuildShadowProgram(Program, Context, std::move(Source), Devices.size(),
+		                   Devices.empty() ? nullptr : Devices.data(),
+		                   HasOptions ? Opts.c_str() : nullptr);
+		// Notified with the program of the user, not the shadow
+		Notify(Program, UserData);
+		clReleaseProgram(Program);
+		},
+			[=]() {
+		// Not started before the runtime shuts down, which fails the build
+		getRuntimeKeeper().getProgramTable().insert_or_assign(
+				Program, ProgramInfo(Context, NULL,
+				                     "Build cancelled as CLPKM is shutting down",
+				                     ProfileList()));
+		Notify(Program, UserData);
+		clReleaseProgram(Program);
+		});
 
-	return Ret;
+	return CL_SUCCESS;
 
 	}
 catch (const __ocl_error& OclError) {
@@ -340,22 +354,21 @@ cl_kernel clCreateKernel(cl_program Program, const char* Name, cl_int* Ret) try
 	auto& RT = getRuntimeKeeper();
 	auto& PT = RT.getProgramTable();
 
-	boost::shared_lock<boost::upgrade_mutex> RdLock(RT.getPTLock());
-	const auto It = PT.find(Program);
+	const auto ProgInfoPtr = PT.find(Program);
 
-	if (It == PT.end()) {
+	if (ProgInfoPtr == nullptr) {
 		if (Ret != nullptr)
 			*Ret = CL_INVALID_PROGRAM;
 		return NULL;
 		}
 
-	if (It->second.ShadowProgram.get() == NULL) {
+	if (ProgInfoPtr->ShadowProgram.get() == NULL) {
 		if (Ret != nullptr)
 			*Ret = CL_INVALID_PROGRAM_EXECUTABLE;
 		return NULL;
 		}
 
-	auto& List = It->second.KernelProfileList;
+	auto& List = ProgInfoPtr->KernelProfileList;
 	auto Pos = std::find_if(List.begin(), List.end(), [&](auto& Entry) -> bool {
 		return strcmp(Name, Entry.Name.c_str()) == 0;
 		});
@@ -366,7 +379,7 @@ cl_kernel clCreateKernel(cl_program Program, const char* Name, cl_int* Ret) try
 		return NULL;
 		}
 
-	auto& ProgInfo = It->second;
+	auto& ProgInfo = *ProgInfoPtr;
 	cl_context Context = ProgInfo.Context;
 	cl_program ShadowProg = ProgInfo.ShadowProgram.get();
 
@@ -378,12 +391,11 @@ cl_kernel clCreateKernel(cl_program Program, const char* Name, cl_int* Ret) try
 		return NULL;
 
 	clKernel KernelWrap = RawKernel;
-	KernelInfo NewInfo(Context, ShadowProg, &(*Pos));
-
-	boost::unique_lock<boost::upgrade_mutex> WrLock(RT.getKTLock());
+	KernelInfo NewInfo(Context, ShadowProg, &(*Pos), ProgInfoPtr);
 
-	const auto KTIt = RT.getKernelTable().emplace(RawKernel, std::move(NewInfo));
-	INTER_ASSERT(KTIt.second, "insertion to kernel table didn't table place");
+	const bool Inserted = RT.getKernelTable().emplace(RawKernel,
+	                                                  std::move(NewInfo));
+	INTER_ASSERT(Inserted, "insertion to kernel table didn't table place");
 
 	KernelWrap.get() = NULL;
 
@@ -427,35 +439,115 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue Queue,
 	auto& QT = RT.getQueueTable();
 	auto& KT = RT.getKernelTable();
 
-	boost::shared_lock<boost::upgrade_mutex> QTLock(RT.getQTLock());
-	boost::shared_lock<boost::upgrade_mutex> KTLock(RT.getKTLock());
+	// Tables are only locked for lookups, and the entries are kept alive by
+	// reference even if they are released meanwhile
 	const auto QueueEntry = QT.find(Queue);
 	const auto KTEntry = KT.find(K);
 
 	// Step 0 - 1
 	// Pre-check
-	if (QueueEntry == QT.end())
+	if (QueueEntry == nullptr)
 		return CL_INVALID_COMMAND_QUEUE;
 
-	if (KTEntry == KT.end())
+	if (KTEntry == nullptr)
 		return CL_INVALID_KERNEL;
 
 	if ((NumOfWaiting > 0 && !WaitingList) || (NumOfWaiting <= 0 && WaitingList))
 		return CL_INVALID_EVENT_WAIT_LIST;
 
 	// FIXME: Shall we also lock ProgramTable?
-	auto& QueueInfo = QueueEntry->second;
-	auto& KernelInfo = KTEntry->second;
+	auto& QueueInfo = *QueueEntry;
+	auto& KernelInfo = *KTEntry;
 	auto& Profile = *KernelInfo.Profile;
 	cl_int Ret = CL_SUCCESS;
 
 	if (KernelInfo.Context != QueueInfo.Context)
 		return CL_INVALID_CONTEXT;
 
+	const auto& DevInfo = *QueueInfo.DevInfo;
+
+	if (WorkDim < 1 || WorkDim > DevInfo.MaxDim)
+		return CL_INVALID_WORK_DIMENSION;
+
+	if (GWS == nullptr ||
+	    std::any_of(GWS, GWS + WorkDim, [](size_t S) -> bool { return !S; }))
+		return CL_INVALID_GLOBAL_WORK_SIZE;
+
 	// Step 0 - 2
-	// Prep Kernel
-	clKernel KernelWrap = NULL;
+	// Run the uninstrumented clone if nothing could preempt it
+	const size_t NumOfItem = std::accumulate(GWS, GWS + WorkDim, size_t(1),
+	                                         std::multiplies<size_t>());
 	std::unique_lock<std::mutex> PoolLock(*KernelInfo.Mutex);
+
+	if (!Profile.PristineName.empty() && KernelInfo.ExecTimePerItem >= 0 &&
+	    KernelInfo.ExecTimePerItem * NumOfItem <= Srv.getPristineBudget() &&
+	    Srv.isClear(task_kind::COMPUTING)) {
+
+		if (KernelInfo.Pristine.get() == NULL) {
+			KernelInfo.Pristine = Lookup<OclAPI::clCreateKernel>()(
+					KernelInfo.Program, Profile.PristineName.c_str(), &Ret);
+			OCL_ASSERT(Ret);
+			}
+
+		cl_kernel Pristine = KernelInfo.Pristine.get();
+		const double Predicted = KernelInfo.ExecTimePerItem * NumOfItem;
+		std::unique_lock<std::mutex> PristineLock(*KernelInfo.PristineMutex);
+
+		Ret = KernelInfo.Args.Bind(Pristine, KernelInfo.PristineBound);
+		OCL_ASSERT(Ret);
+
+		// Not to be held under the blocker mutex, see PristineMutex
+		PoolLock.unlock();
+
+		RT.Log(RuntimeKeeper::loglevel::INFO,
+		       "\n==CLPKM== Enqueue kernel %s (pristine, predicted %f ms)\n",
+		       Profile.Name.c_str(), Predicted * 0.000001f);
+
+		std::vector<cl_event> NewWaitingList(WaitingList, WaitingList + NumOfWaiting);
+		std::lock_guard<std::mutex> BlockerLock(*QueueInfo.BlockerMutex);
+
+		if (QueueInfo.TaskBlocker.get() != NULL)
+			NewWaitingList.emplace_back(QueueInfo.TaskBlocker.get());
+
+		// Run on the shadow queue for profiling, and let the user's queue wait
+		clEvent Final = NULL;
+
+		Ret = Lookup<OclAPI::clEnqueueNDRangeKernel>()(
+				QueueInfo.ShadowQueue.get(), Pristine, WorkDim, GWO, GWS, LWS,
+				NewWaitingList.size(),
+				NewWaitingList.size() ? NewWaitingList.data() : nullptr,
+				&Final.get());
+		OCL_ASSERT(Ret);
+
+		// Arguments are captured, and the kernel is free to use now
+		PristineLock.unlock();
+
+		// Owned by the callback once it's registered
+		std::unique_ptr<PristineData> Data(new PristineData{KTEntry, NumOfItem});
+
+		Ret = Lookup<OclAPI::clSetEventCallback>()(
+				Final.get(), CL_COMPLETE, PristineFinish, Data.get());
+		OCL_ASSERT(Ret);
+
+		Data.release();
+
+		Ret = clFlush(QueueInfo.ShadowQueue.get());
+		OCL_ASSERT(Ret);
+
+		Ret = Lookup<OclAPI::clEnqueueMarkerWithWaitList>()(Queue, 1, &Final.get(),
+		                                                    Event);
+		OCL_ASSERT(Ret);
+
+		if (QueueInfo.ShallReorder)
+			QueueInfo.TaskBlocker = std::move(Final);
+
+		return CL_SUCCESS;
+
+		}
+
+	// Step 0 - 3
+	// Prep Kernel
+	PooledKernel KernelWrap{NULL, {}};
 	size_t PoolSize = KernelInfo.Pool.size();
 
 	if (PoolSize > 0) {
@@ -463,27 +555,38 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue Queue,
 		KernelInfo.Pool.pop_back();
 		}
 	else {
-		KernelWrap = Lookup<OclAPI::clCreateKernel>()(
+		KernelWrap.Kernel = Lookup<OclAPI::clCreateKernel>()(
 				KernelInfo.Program, Profile.Name.c_str(), &Ret);
 		OCL_ASSERT(Ret);
 		}
 
-	cl_kernel Kernel = KernelWrap.get();
-	PoolLock.unlock();
+	cl_kernel Kernel = KernelWrap.Kernel.get();
+
+	const bool ScanOnDevice =
+			(RT.getHeaderScan() == RuntimeKeeper::header_scan::DEVICE);
 
-	cl_uint MaxDim = 0;
+	if (ScanOnDevice && KernelInfo.Reducer.get() == NULL) {
+		KernelInfo.Reducer = Lookup<OclAPI::clCreateKernel>()(
+				KernelInfo.Program, "__clpkm_reduce_header", &Ret);
+		OCL_ASSERT(Ret);
+		}
 
-	Ret = Lookup<OclAPI::clGetDeviceInfo>()(
-			QueueInfo.Device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(cl_uint),
-			&MaxDim, nullptr);
+	// Rebind only arguments set since this instance was last launched
+	Ret = KernelInfo.Args.Bind(Kernel, KernelWrap.Bound);
 	OCL_ASSERT(Ret);
 
-	if (WorkDim < 1 || WorkDim > MaxDim)
-		return CL_INVALID_WORK_DIMENSION;
+	// Take sizes of dynamically sized local buffers along with the arguments
+	const size_t NumOfDynLocParam = Profile.LocPtrParamIdx.size();
+	std::vector<cl_int> HostMetadata(NumOfDynLocParam);
+	size_t TotalReqLocSize = Profile.ReqLocSize;
 
-	if (GWS == nullptr ||
-	    std::any_of(GWS, GWS + WorkDim, [](size_t S) -> bool { return !S; }))
-		return CL_INVALID_GLOBAL_WORK_SIZE;
+	for (size_t Idx = 0; Idx < NumOfDynLocParam; ++Idx) {
+		size_t Size = KernelInfo.Args.getSize(Profile.LocPtrParamIdx[Idx]);
+		HostMetadata[Idx] = static_cast<cl_int>(Size);
+		TotalReqLocSize += Size;
+		}
+
+	PoolLock.unlock();
 
 	// Step 1
 	// Compute total number of work-groups and work-items
@@ -492,8 +595,7 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue Queue,
 
 	std::vector<size_t> RealLWS =
 			(LWS == nullptr)
-			? FindWorkGroupSize(Kernel, QueueInfo.Device, WorkDim, MaxDim,
-			                    GWS, &Ret)
+			? FindWorkGroupSize(KernelInfo, Kernel, DevInfo, WorkDim, GWS)
 			: std::vector<size_t>(LWS, LWS + WorkDim);
 
 	for (size_t Idx = 0; Idx < WorkDim; Idx++) {
@@ -505,15 +607,10 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue Queue,
 
 	size_t WorkGrpSize = NumOfThread / NumOfWorkGrp;
 
-	// Calculate requested local buffer size, including statically and
-	// dynamically sized local buffer
-	const size_t NumOfDynLocParam = Profile.LocPtrParamIdx.size();
-	size_t TotalReqLocSize = Profile.ReqLocSize;
-
-	for (auto ParamIdx : Profile.LocPtrParamIdx)
-		TotalReqLocSize += KernelInfo.Args[ParamIdx].first;
-
+	// TotalReqLocSize includes statically and dynamically sized local buffer
 	size_t MetadataSize = (NumOfDynLocParam + NumOfThread) * sizeof(cl_int);
+	// ReqPrvSize is padded to 4 bytes, so the interleaved layout takes up
+	// exactly the same space as the contiguous one
 	size_t PrivateBufferSize = Profile.ReqPrvSize * NumOfThread;
 	size_t LocalBufferSize = TotalReqLocSize * NumOfWorkGrp;
 
@@ -522,7 +619,7 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue Queue,
 		                              + LocalBufferSize;
 		RT.Log("\n==CLPKM== Enqueue kernel %p (%s, %s)\n"
 		       "==CLPKM==   metadata:  %s [4 Bytes x (%zu DSLB + %zu work-items)]\n"
-		       "==CLPKM==   __private: %s [%zu Bytes x %zu work-items]\n"
+		       "==CLPKM==   __private: %s [%zu Bytes x %zu work-items, %s]\n"
 		       "==CLPKM==   __local:   %s [%zu Bytes x %zu work-groups]\n"
 		       "==CLPKM== Additionally required: %s (%zu) in total\n",
 		       Kernel, Profile.Name.c_str(), (PoolSize > 0) ? "pooled" : "new",
@@ -530,6 +627,8 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue Queue,
 		       NumOfDynLocParam, NumOfThread,
 		       ToHumanReadable(PrivateBufferSize).c_str(),
 		       Profile.ReqPrvSize, NumOfThread,
+		       (Profile.PrvLayout == KernelProfile::prv_layout::INTERLEAVED)
+		       ? "interleaved" : "contiguous",
 		       ToHumanReadable(LocalBufferSize).c_str(),
 		       TotalReqLocSize, NumOfWorkGrp,
 		       ToHumanReadable(AdditionallyRequired).c_str(), AdditionallyRequired);
@@ -537,69 +636,116 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue Queue,
 
 	// Step 2
 	// Prepare header and live value buffers
-	auto venCreateBuffer = Lookup<OclAPI::clCreateBuffer>();
+	// They are drawn from the pool, which may hand out larger ones
+	auto& BP = RT.getBufferPool();
+
+	clMemObj DeviceMetadata = BP.Acquire(QueueInfo.Context, MetadataSize, &Ret);
+	OCL_ASSERT(Ret);
 
-	clMemObj DeviceMetadata = clMemObj(
-			venCreateBuffer(QueueInfo.Context, CL_MEM_READ_WRITE,
-			                MetadataSize, nullptr, &Ret));
+	clMemObj LocalBuffer = LocalBufferSize > 0
+	                       ? BP.Acquire(QueueInfo.Context, LocalBufferSize, &Ret)
+	                       : clMemObj(NULL);
 	OCL_ASSERT(Ret);
 
-	clMemObj LocalBuffer = clMemObj(
-			LocalBufferSize > 0
-			? venCreateBuffer(QueueInfo.Context, CL_MEM_READ_WRITE,
-			                  LocalBufferSize,
-			                  nullptr, &Ret)
-			: NULL);
+	clMemObj PrivateBuffer = PrivateBufferSize > 0
+	                         ? BP.Acquire(QueueInfo.Context, PrivateBufferSize,
+	                                      &Ret)
+	                         : clMemObj(NULL);
 	OCL_ASSERT(Ret);
 
-	clMemObj PrivateBuffer = clMemObj(
-			PrivateBufferSize > 0
-			? venCreateBuffer(QueueInfo.Context, CL_MEM_READ_WRITE,
-			                  PrivateBufferSize,
-			                  nullptr, &Ret)
-			: NULL);
+	clMemObj Summary = ScanOnDevice
+	                   ? BP.Acquire(QueueInfo.Context, 6 * sizeof(cl_uint), &Ret)
+	                   : clMemObj(NULL);
+	OCL_ASSERT(Ret);
+
+	// Pipelined slices read back summaries in turn
+	const bool Pipelined =
+			(RT.getResumeMode() == RuntimeKeeper::resume_mode::PIPELINED);
+
+	clMemObj SpecSummary = Pipelined
+	                       ? BP.Acquire(QueueInfo.Context, 6 * sizeof(cl_uint), &Ret)
+	                       : clMemObj(NULL);
+	OCL_ASSERT(Ret);
+
+	// If the header is scanned on the host, devices sharing memory with the
+	// host map it directly, while others read it back into pinned memory
+	const bool MapHeader = (!ScanOnDevice && DevInfo.HostUnifiedMem == CL_TRUE);
+
+	BufferPool::Pinned HostHeader =
+			(!ScanOnDevice && !MapHeader)
+			? BP.AcquirePinned(QueueInfo.Context, QueueInfo.ShadowQueue.get(),
+			                   NumOfThread * sizeof(cl_int), &Ret)
+			: BufferPool::Pinned{NULL, nullptr};
+	OCL_ASSERT(Ret);
+
+	// Launch info for compact launch
+	// The table of work-groups is kept on the host only if the header is
+	// scanned on the host
+	std::vector<cl_uint> HostLaunch;
+
+	if (Profile.Compactable) {
+		HostLaunch.resize(LAUNCH_TABLE + (ScanOnDevice ? 0 : NumOfWorkGrp));
+		HostLaunch[LAUNCH_NUM_GRPS] = 0;
+		HostLaunch[LAUNCH_BASE] = ~static_cast<cl_uint>(0);
+		for (size_t Dim = 0; Dim < 3; ++Dim) {
+			HostLaunch[LAUNCH_NUM_GRPS_PER_DIM + Dim] = (Dim < WorkDim)
+			                                            ? GWS[Dim] / RealLWS[Dim] : 1;
+			HostLaunch[LAUNCH_GWO + Dim] = (Dim < WorkDim && GWO) ? GWO[Dim] : 0;
+			}
+		}
+
+	clMemObj Launch = Profile.Compactable
+	                  ? BP.Acquire(QueueInfo.Context,
+	                               (LAUNCH_TABLE + NumOfWorkGrp) * sizeof(cl_uint),
+	                               &Ret)
+	                  : clMemObj(NULL);
 	OCL_ASSERT(Ret);
 
 	// Step 3
 	// Initialize the header, creating a new waiting event list to include
 	// the initializing event
-	auto venEnqWrBuf = Lookup<OclAPI::clEnqueueWriteBuffer>();
+	// The header is filled on the device, and the host only uploads the size
+	// table of dynamically sized local buffers
+	clEvent WriteMetadataEvent(NULL);
 
 	// cl_int, i.e. signed 2's complement 32-bit integer, shall suffice
-	std::vector<cl_int> HostMetadata(NumOfDynLocParam + NumOfThread, 1);
-	clEvent WriteMetadataEvent(NULL);
+	const cl_int Start = 1;
 
-	// Prepare size info for dynamically sized local buffer
-	for (size_t Idx = 0; Idx < NumOfDynLocParam; ++Idx) {
-		HostMetadata[Idx] = reinterpret_cast<const cl_int&>(
-				KernelInfo.Args[Profile.LocPtrParamIdx[Idx]]);
+	Ret = Lookup<OclAPI::clEnqueueFillBuffer>()(
+			QueueInfo.ShadowQueue.get(), DeviceMetadata.get(), &Start,
+			sizeof(cl_int), NumOfDynLocParam * sizeof(cl_int),
+			NumOfThread * sizeof(cl_int), 0, nullptr, &WriteMetadataEvent.get());
+	OCL_ASSERT(Ret);
+
+	// Write the size table and launch info after filling, so one event covers
+	// all of them
+	if (NumOfDynLocParam > 0) {
+		clEvent FillEvent = std::move(WriteMetadataEvent);
+		Ret = Lookup<OclAPI::clEnqueueWriteBuffer>()(
+				QueueInfo.ShadowQueue.get(), DeviceMetadata.get(), CL_FALSE, 0,
+				NumOfDynLocParam * sizeof(cl_int), HostMetadata.data(), 1,
+				&FillEvent.get(), &WriteMetadataEvent.get());
+		OCL_ASSERT(Ret);
 		}
 
-	// Write metadata and put the event to the end of NewWaitingList
-	Ret = venEnqWrBuf(QueueInfo.ShadowQueue.get(), DeviceMetadata.get(), CL_FALSE,
-	                  0, MetadataSize, HostMetadata.data(), 0, nullptr,
-	                  &WriteMetadataEvent.get());
-	OCL_ASSERT(Ret);
+	if (Launch.get() != NULL) {
+		clEvent PrevEvent = std::move(WriteMetadataEvent);
+		Ret = Lookup<OclAPI::clEnqueueWriteBuffer>()(
+				QueueInfo.ShadowQueue.get(), Launch.get(), CL_FALSE, 0,
+				LAUNCH_TABLE * sizeof(cl_uint), HostLaunch.data(), 1,
+				&PrevEvent.get(), &WriteMetadataEvent.get());
+		OCL_ASSERT(Ret);
+		}
 
 	// Hold original waiting list, in addition to the event of writing header
 	std::vector<cl_event> NewWaitingList(WaitingList, WaitingList + NumOfWaiting);
 
 	NewWaitingList.emplace_back(WriteMetadataEvent.get());
 
-	std::lock_guard<std::mutex> BlockerLock(*QueueInfo.BlockerMutex);
-
-	if (QueueInfo.TaskBlocker.get() != NULL)
-		NewWaitingList.emplace_back(QueueInfo.TaskBlocker.get());
-
 	// Step 4
-	// Set up  kernel arguments
+	// Set up CLPKM arguments, which follow the user's ones bound above
 	auto venSetKernelArg = Lookup<OclAPI::clSetKernelArg>();
-	unsigned Idx = 0;
-
-	for (const auto& KArg : KernelInfo.Args) {
-		Ret = venSetKernelArg(Kernel, Idx++, KArg.first, KArg.second);
-		OCL_ASSERT(Ret);
-		}
+	cl_uint Idx = KernelInfo.Args.size();
 
 	// FIXME: uint64_t degrade to cl_uint
 	cl_uint Threshold = Srv.getCRThreshold();
@@ -612,6 +758,11 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue Queue,
 	OCL_ASSERT(Ret);
 	Ret = venSetKernelArg(Kernel, Idx++, sizeof(cl_uint), &Threshold);
 	OCL_ASSERT(Ret);
+	Ret = venSetKernelArg(Kernel, Idx++, sizeof(cl_mem),
+	                      &QueueInfo.PreemptFlag.get());
+	OCL_ASSERT(Ret);
+	Ret = venSetKernelArg(Kernel, Idx++, sizeof(cl_mem), &Launch.get());
+	OCL_ASSERT(Ret);
 
 	// Step 5
 	// Set up the works
@@ -626,16 +777,24 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue Queue,
 
 	// New callback
 	auto Work = std::make_unique<CallbackData>(
-			QueueInfo.ShadowQueue.get(), std::move(KernelWrap), &KernelInfo,
+			QueueInfo.ShadowQueue.get(), std::move(KernelWrap), KTEntry,
 			WorkDim, GWO ? std::vector<size_t>(GWO, GWO + WorkDim)
 			             : std::vector<size_t>(WorkDim, 0),
 			std::vector<size_t>(GWS, GWS + WorkDim),
-			std::move(RealLWS), WorkGrpSize, std::move(DeviceMetadata),
-			std::move(LocalBuffer), std::move(PrivateBuffer),
-			std::move(HostMetadata), NumOfDynLocParam,
+			std::move(RealLWS), WorkGrpSize, NumOfThread, std::move(DeviceMetadata),
+			std::move(LocalBuffer), std::move(PrivateBuffer), std::move(Summary),
+			std::move(SpecSummary), Pipelined, std::move(Launch), std::move(HostLaunch), std::move(HostHeader),
+			MapHeader, std::move(HostMetadata), NumOfDynLocParam,
 			std::move(WriteMetadataEvent), Final.get(),
 			std::chrono::high_resolution_clock::now());
 
+	// Only the part that orders this task after the previous one on the queue
+	// needs the blocker
+	std::lock_guard<std::mutex> BlockerLock(*QueueInfo.BlockerMutex);
+
+	if (QueueInfo.TaskBlocker.get() != NULL)
+		NewWaitingList.emplace_back(QueueInfo.TaskBlocker.get());
+
 	// This throws exception on error
 	MetaEnqueue(Work.get(), NewWaitingList.size(), NewWaitingList.data());
 
@@ -647,7 +806,7 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue Queue,
 		QueueInfo.TaskBlocker = std::move(Final);
 
 	// Prevent it from being released
-	KernelWrap.get() = NULL;
+	KernelWrap.Kernel.get() = NULL;
 	Work.release();
 
 	// Note: Some application keeps enqueuing task without calling clFinish or so
@@ -675,13 +834,12 @@ cl_int clRetainKernel(cl_kernel K) {
 	auto& RT = getRuntimeKeeper();
 	auto& KT = RT.getKernelTable();
 
-	boost::shared_lock<boost::upgrade_mutex> RdLock(RT.getKTLock());
-	const auto It = KT.find(K);
+	const auto KIPtr = KT.find(K);
 
-	if (It == KT.end())
+	if (KIPtr == nullptr)
 		return CL_INVALID_KERNEL;
 
-	auto& KI = It->second;
+	auto& KI = *KIPtr;
 
 	std::lock_guard<std::mutex> Lock(*KI.Mutex);
 
@@ -701,28 +859,22 @@ cl_int clReleaseKernel(cl_kernel K) {
 	auto& RT = getRuntimeKeeper();
 	auto& KT = RT.getKernelTable();
 
-	boost::upgrade_lock<boost::upgrade_mutex> RdLock(RT.getKTLock());
-	const auto It = KT.find(K);
+	const auto KIPtr = KT.find(K);
 
-	if (It == KT.end())
+	if (KIPtr == nullptr)
 		return CL_INVALID_KERNEL;
 
-	auto& KI = It->second;
-
-	std::unique_lock<std::mutex> KILock(*KI.Mutex);
+	auto& KI = *KIPtr;
 
-	if (--KI.RefCount > 0)
-		return CL_SUCCESS;
+	{
+		std::lock_guard<std::mutex> KILock(*KI.Mutex);
+		if (--KI.RefCount > 0)
+			return CL_SUCCESS;
+	}
 
 	// If the reference count is 0
-	// Is deadlock possible here?
-	boost::upgrade_to_unique_lock<boost::upgrade_mutex> WrLock(RdLock);
-
-	// Unlock and disassociate the mutex
-	KILock.unlock();
-	KILock.release();
-
-	KT.erase(It);
+	// Works in flight still hold the info, which goes away with the last one
+	KT.erase(K);
 
 	return venReleaseKernel(K);
 
@@ -738,11 +890,8 @@ cl_int clReleaseProgram(cl_program Program) try {
 	auto& RT = getRuntimeKeeper();
 	auto& PT = RT.getProgramTable();
 
-	boost::upgrade_lock<boost::upgrade_mutex> RdLock(RT.getPTLock());
-	const auto It = PT.find(Program);
-
-	// Maybe a program never being built
-	if (It == PT.end())
+	// Maybe a program never being built nor instrumented
+	if (PT.find(Program) == nullptr && !getSpeculator().isPending(Program))
 		return venReleaseProgram(Program);
 
 	// Avoid from getting old reference count
@@ -756,8 +905,9 @@ cl_int clReleaseProgram(cl_program Program) try {
 	OCL_ASSERT(Ret);
 
 	if (RefCount <= 1) {
-		boost::upgrade_to_unique_lock<boost::upgrade_mutex> WrLock(RdLock);
-		PT.erase(It);
+		PT.erase(Program);
+		if (auto Speculated = getSpeculator().Take(Program))
+			Speculated->Cancel();
 		}
 
 	return venReleaseProgram(Program);
@@ -778,16 +928,14 @@ cl_int clSetKernelArg(cl_kernel K, cl_uint ArgIndex, size_t ArgSize,
 	auto& RT = getRuntimeKeeper();
 	auto& KT = RT.getKernelTable();
 
-	boost::shared_lock<boost::upgrade_mutex> KTLock(RT.getKTLock());
 	const auto KTEntry = KT.find(K);
 
-	if (KTEntry == KT.end())
+	if (KTEntry == nullptr)
 		return CL_INVALID_KERNEL;
 
-	auto& KI = KTEntry->second;
-	auto& KIArgs = KI.Args;
+	auto& KI = *KTEntry;
 
-	if (ArgIndex >= KIArgs.size())
+	if (ArgIndex >= KI.Args.size())
 		return CL_INVALID_ARG_INDEX;
 
 	const auto& DynLocParams = KI.Profile->LocPtrParamIdx;
@@ -815,10 +963,10 @@ cl_int clSetKernelArg(cl_kernel K, cl_uint ArgIndex, size_t ArgSize,
 	// The key is never used, only for sanity check
 	cl_int Ret = venSetKernelArg(K, ArgIndex, ArgSize, ArgValue);
 
-	// Only record on success
+	// Only record on success, copying the value as the user may reuse it
 	if (Ret == CL_SUCCESS) {
-		KIArgs[ArgIndex].first = ArgSize;
-		KIArgs[ArgIndex].second = ArgValue;
+		std::lock_guard<std::mutex> Lock(*KI.Mutex);
+		KI.Args.Set(ArgIndex, ArgSize, ArgValue);
 		}
 
 	return Ret;
@@ -0,0 +1,97 @@
+/*
+  KernelArgs.cpp
+
+  Kernel arguments (impl)
+
+*/
+
+#include "KernelArgs.hpp"
+#include "LookupVendorImpl.hpp"
+
+#include <cstring>
+
+using namespace CLPKM;
+
+
+
+namespace {
+
+// Values are placed at this alignment, enough for any OpenCL C type
+constexpr size_t ArgAlign = 16;
+
+constexpr size_t AlignUp(size_t Size) {
+	return (Size + ArgAlign - 1) & ~(ArgAlign - 1);
+	}
+
+}
+
+
+
+void KernelArgs::Set(cl_uint Idx, size_t Size, const void* Value) {
+
+	Slot& S = Slots[Idx];
+
+	if (S.HasValue)
+		LiveSize -= S.Capacity;
+
+	S.Size = Size;
+	S.HasValue = (Value != nullptr);
+	S.Stamp = NextStamp++;
+
+	if (!S.HasValue)
+		return;
+
+	// Reuse the space if it fits, or take a new chunk at the end
+	if (Size > S.Capacity) {
+		S.Offset = Arena.size();
+		S.Capacity = AlignUp(Size);
+		Arena.resize(S.Offset + S.Capacity);
+		}
+
+	LiveSize += S.Capacity;
+	memcpy(Arena.data() + S.Offset, Value, Size);
+
+	if (Arena.size() > 2 * LiveSize + 256)
+		Compact();
+
+	}
+
+cl_int KernelArgs::Bind(cl_kernel Kernel, fingerprint& Bound) const {
+
+	auto venSetKernelArg = Lookup<OclAPI::clSetKernelArg>();
+
+	Bound.resize(Slots.size(), 0);
+
+	for (cl_uint Idx = 0; Idx < Slots.size(); ++Idx) {
+		const Slot& S = Slots[Idx];
+		if (Bound[Idx] == S.Stamp)
+			continue;
+		cl_int Ret = venSetKernelArg(Kernel, Idx, S.Size, getValue(Idx));
+		if (Ret != CL_SUCCESS)
+			return Ret;
+		Bound[Idx] = S.Stamp;
+		}
+
+	return CL_SUCCESS;
+
+	}
+
+void KernelArgs::Compact() {
+
+	std::vector<unsigned char> NewArena;
+	NewArena.reserve(LiveSize);
+
+	for (Slot& S : Slots) {
+		if (!S.HasValue) {
+			S.Capacity = 0;
+			continue;
+			}
+		size_t Offset = NewArena.size();
+		NewArena.insert(NewArena.end(), Arena.begin() + S.Offset,
+		                Arena.begin() + S.Offset + S.Capacity);
+		S.Offset = Offset;
+		}
+
+	Arena = std::move(NewArena);
+
+	}
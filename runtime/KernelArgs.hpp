@@ -0,0 +1,75 @@
+/*
+  KernelArgs.hpp
+
+  Kernel arguments set by the user, copied by value so that they remain
+  valid for deferred launches, and rebound onto pooled kernels only if they
+  have changed since
+
+*/
+
+#ifndef __CLPKM__KERNEL_ARGS_HPP__
+#define __CLPKM__KERNEL_ARGS_HPP__
+
+
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <CL/opencl.h>
+
+
+
+namespace CLPKM {
+
+class KernelArgs {
+public:
+	// What a kernel instance has bound, i.e. the stamp of each argument at the
+	// time it was set on the instance
+	using fingerprint = std::vector<uint64_t>;
+
+	explicit KernelArgs(size_t NumOfArg)
+	: Slots(NumOfArg, Slot{0, 0, 0, false, 0}), LiveSize(0), NextStamp(1) { }
+
+	size_t size() const { return Slots.size(); }
+
+	// Value is null for __local buffers, in which case only the size is kept
+	void Set(cl_uint Idx, size_t Size, const void* Value);
+
+	size_t getSize(cl_uint Idx) const { return Slots[Idx].Size; }
+
+	// Null if it has no value
+	const void* getValue(cl_uint Idx) const {
+		const Slot& S = Slots[Idx];
+		return S.HasValue ? Arena.data() + S.Offset : nullptr;
+		}
+
+	// Set arguments whose stamp differs from Bound on Kernel, updating Bound
+	// Every argument is set on an instance with an empty fingerprint
+	cl_int Bind(cl_kernel Kernel, fingerprint& Bound) const;
+
+private:
+	struct Slot {
+		size_t   Size;
+		size_t   Offset;
+		size_t   Capacity;
+		bool     HasValue;
+		// Bumped on every set, 0 if never set
+		uint64_t Stamp;
+		};
+
+	// Move live values to the front once the arena is mostly garbage
+	void Compact();
+
+	std::vector<Slot>          Slots;
+	std::vector<unsigned char> Arena;
+	size_t                     LiveSize;
+	uint64_t                   NextStamp;
+
+	};
+
+}
+
+
+
+#endif
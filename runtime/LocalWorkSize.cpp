@@ -0,0 +1,218 @@
+/*
+  LocalWorkSize.cpp
+
+  Pick the local work size (impl)
+
+*/
+
+#include "LocalWorkSize.hpp"
+#include "RuntimeKeeper.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+using namespace CLPKM;
+
+
+
+namespace {
+
+// Assumed share of slicing overhead for kernels that have never finished
+constexpr double DefaultSliceOverhead = 0.5;
+
+// How much a work-group as large as the kernel allows costs in yield latency,
+// relative to throughput, if a launch is all overhead
+constexpr double YieldWeight = 0.25;
+
+// Divisors of N no greater than Limit, in ascending order
+std::vector<size_t> getDivisors(size_t N, size_t Limit) {
+	std::vector<size_t> Low, High;
+	for (size_t D = 1; D * D <= N; ++D) {
+		if (N % D)
+			continue;
+		if (D <= Limit)
+			Low.emplace_back(D);
+		if (N / D != D && N / D <= Limit)
+			High.emplace_back(N / D);
+		}
+	Low.insert(Low.end(), High.rbegin(), High.rend());
+	return Low;
+	}
+
+// Higher is better
+double Score(const LWSModel& Model, size_t WorkGrpSize, size_t NumOfItem) {
+
+	const double NumOfGrp = static_cast<double>(NumOfItem / WorkGrpSize);
+	const size_t Multiple = std::max<size_t>(Model.PreferredMultiple, 1);
+	const double NumOfCU = std::max<cl_uint>(Model.NumOfComputeUnit, 1);
+
+	// Share of SIMD lanes doing work, and of compute units busy in the last
+	// wave
+	double Lane = static_cast<double>(WorkGrpSize) /
+	              ((WorkGrpSize + Multiple - 1) / Multiple * Multiple);
+	double Balance = NumOfGrp / (std::ceil(NumOfGrp / NumOfCU) * NumOfCU);
+	// Per work-group cost, e.g. dispatching and scanning its header, is
+	// amortized over more work-items
+	double Amortized = static_cast<double>(WorkGrpSize) /
+	                   (WorkGrpSize + Multiple);
+	double Throughput = Lane * Balance * Amortized;
+
+	// The cost of preemption weighs as much as slicing takes of a launch
+	double Share = (Model.SliceOverhead < 0) ? DefaultSliceOverhead
+	                                         : Model.SliceOverhead;
+
+	// Live values saved per checkpoint, relative to the least possible
+	// Those of __local are saved per work-group, so smaller groups save more
+	double PerItem = Model.ReqPrvSize + sizeof(cl_int);
+	double Footprint = Model.ReqLocSize * NumOfGrp + PerItem * NumOfItem;
+	double MinFootprint = Model.ReqLocSize * static_cast<double>(NumOfItem) /
+	                      Model.MaxWorkGrpSize + PerItem * NumOfItem;
+	double Bloat = 1.0 - MinFootprint / Footprint;
+
+	// A work-group only yields at a barrier once all its work-items get there
+	double Latency = static_cast<double>(WorkGrpSize) / Model.MaxWorkGrpSize;
+
+	return Throughput * (1.0 - Share * Bloat) - Share * YieldWeight * Latency;
+
+	}
+
+}
+
+
+
+std::vector<size_t> CLPKM::SelectLocalWorkSize(const LWSModel& Model,
+                                               size_t WorkDim,
+                                               const size_t* GWS) {
+
+	const size_t MaxWorkGrpSize = std::max<size_t>(Model.MaxWorkGrpSize, 1);
+	size_t NumOfItem = 1;
+
+	std::vector<std::vector<size_t>> Divisors(WorkDim);
+
+	for (size_t Dim = 0; Dim < WorkDim; ++Dim) {
+		NumOfItem *= GWS[Dim];
+		Divisors[Dim] = getDivisors(GWS[Dim], std::min(Model.MaxWorkItemSize[Dim],
+		                                               MaxWorkGrpSize));
+		}
+
+	std::vector<size_t> Try(WorkDim, 1);
+	std::vector<size_t> Best(WorkDim, 1);
+	size_t BestSize = 1;
+	double BestScore = Score(Model, 1, NumOfItem);
+
+	// Depth-first over dimensions, pruning once the product exceeds the limit
+	// Divisors are ascending, so the rest of a dimension can be skipped then
+	auto Visit = [&](auto& Self, size_t Dim, size_t Size) -> void {
+		if (Dim == WorkDim) {
+			double S = Score(Model, Size, NumOfItem);
+			// Prefer larger groups on a tie
+			if (S > BestScore + 1e-9 || (S > BestScore - 1e-9 && Size > BestSize)) {
+				Best = Try;
+				BestSize = Size;
+				BestScore = S;
+				}
+			return;
+			}
+		for (size_t D : Divisors[Dim]) {
+			if (Size * D > MaxWorkGrpSize)
+				break;
+			Try[Dim] = D;
+			Self(Self, Dim + 1, Size * D);
+			}
+		Try[Dim] = 1;
+		};
+
+	Visit(Visit, 0, 1);
+
+	return Best;
+
+	}
+
+
+
+LWSStore::LWSStore() {
+
+	const char* File = getenv("CLPKM_LWS_CACHE");
+
+	if (File == nullptr || *File == '\0')
+		return;
+
+	Path = File;
+
+	// Missing file is fine, it's created on first save
+	std::ifstream In(Path);
+	std::string Line;
+
+	// Later entries override earlier ones
+	while (std::getline(In, Line)) {
+		size_t Pos = Line.rfind('\t');
+		if (Pos == std::string::npos)
+			continue;
+		std::vector<size_t> LWS;
+		std::istringstream SS(Line.substr(Pos + 1));
+		size_t Val = 0;
+		char   Sep = ',';
+		while (Sep == ',' && SS >> Val) {
+			LWS.emplace_back(Val);
+			Sep = '\0';
+			SS >> Sep;
+			}
+		if (!LWS.empty())
+			Entries[Line.substr(0, Pos)] = std::move(LWS);
+		}
+
+	}
+
+std::string LWSStore::MakeKey(const std::string& DevName,
+                              const std::string& KernelName, size_t WorkDim,
+                              const size_t* GWS, size_t LocSize,
+                              size_t OverheadBucket) {
+	std::string Key = DevName + '\t' + KernelName + '\t';
+	for (size_t Dim = 0; Dim < WorkDim; ++Dim) {
+		if (Dim > 0)
+			Key += ',';
+		Key += std::to_string(GWS[Dim]);
+		}
+	Key += '\t';
+	Key += std::to_string(LocSize);
+	Key += '\t';
+	Key += std::to_string(OverheadBucket);
+	return Key;
+	}
+
+bool LWSStore::Find(const std::string& Key, std::vector<size_t>& LWS) {
+	std::lock_guard<std::mutex> Lock(Mutex);
+	auto It = Entries.find(Key);
+	if (It == Entries.end())
+		return false;
+	LWS = It->second;
+	return true;
+	}
+
+void LWSStore::Save(const std::string& Key, const std::vector<size_t>& LWS) {
+
+	std::lock_guard<std::mutex> Lock(Mutex);
+
+	Entries[Key] = LWS;
+
+	// Append, so an interrupted run loses at most the last entry
+	std::ofstream Out(Path, std::ios::app);
+	Out << Key << '\t';
+	for (size_t Dim = 0; Dim < LWS.size(); ++Dim)
+		Out << (Dim ? "," : "") << LWS[Dim];
+	Out << '\n';
+
+	if (!Out)
+		getRuntimeKeeper().Log(RuntimeKeeper::loglevel::ERROR,
+		                       "==CLPKM== Failed to write LWS cache \"%s\"\n",
+		                       Path.c_str());
+
+	}
+
+LWSStore& CLPKM::getLWSStore(void) {
+	static LWSStore Store;
+	return Store;
+	}
@@ -0,0 +1,91 @@
+/*
+  LocalWorkSize.hpp
+
+  Pick the local work size for launches not specifying one, weighing
+  throughput against the cost of preempting the kernel
+
+*/
+
+#ifndef __CLPKM__LOCAL_WORK_SIZE_HPP__
+#define __CLPKM__LOCAL_WORK_SIZE_HPP__
+
+
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <CL/opencl.h>
+
+
+
+namespace CLPKM {
+
+// What the selector knows about the kernel and the device
+struct LWSModel {
+	// Device limit on each dimension, and the kernel's limit in total
+	const size_t* MaxWorkItemSize;
+	size_t        MaxWorkGrpSize;
+
+	// CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, i.e. the SIMD width
+	size_t  PreferredMultiple;
+	cl_uint NumOfComputeUnit;
+
+	// Live values saved on each checkpoint, of __local per work-group,
+	// including dynamically sized ones, and of __private per work-item
+	size_t ReqLocSize;
+	size_t ReqPrvSize;
+
+	// Observed share of a launch's time not spent running slices, negative
+	// if the kernel has never finished
+	double SliceOverhead;
+	};
+
+// Enumerate the divisor lattice of GWS, skipping sizes beyond the limits,
+// and return the candidate scoring the best
+std::vector<size_t> SelectLocalWorkSize(const LWSModel& Model, size_t WorkDim,
+                                        const size_t* GWS);
+
+// Local work sizes chosen before, persisted to the file set by
+// CLPKM_LWS_CACHE so later runs skip the selection
+class LWSStore {
+public:
+	// Keyed by device name, kernel name, global work size, the bytes of
+	// __local memory per work-group, which depends on the arguments, and the
+	// bucket the slice overhead falls in, so that the choice is revised once
+	// the overhead measured drifts from what it's made with
+	static std::string MakeKey(const std::string& DevName,
+	                           const std::string& KernelName, size_t WorkDim,
+	                           const size_t* GWS, size_t LocSize,
+	                           size_t OverheadBucket);
+
+	bool isEnabled() const { return !Path.empty(); }
+
+	// False if not found
+	bool Find(const std::string& Key, std::vector<size_t>& LWS);
+
+	void Save(const std::string& Key, const std::vector<size_t>& LWS);
+
+private:
+	LWSStore(const LWSStore& ) = delete;
+	LWSStore& operator=(const LWSStore& ) = delete;
+
+	LWSStore();
+
+	std::string Path;
+	std::mutex  Mutex;
+	std::unordered_map<std::string, std::vector<size_t>> Entries;
+
+	friend LWSStore& getLWSStore(void);
+
+	};
+
+LWSStore& getLWSStore(void);
+
+}
+
+
+
+#endif
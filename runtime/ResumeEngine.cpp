@@ -0,0 +1,193 @@
+/*
+  ResumeEngine.cpp
+
+  Impl resume engine
+
+*/
+
+#include "ErrorHandling.hpp"
+#include "ResumeEngine.hpp"
+#include "LookupVendorImpl.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace CLPKM;
+
+
+
+namespace {
+
+// Queues to flush at the end of the batch, if the thread is a worker
+thread_local std::vector<cl_command_queue>* PendingFlush = nullptr;
+
+}
+
+
+
+ResumeEngine::ResumeEngine()
+: Stop(false) {
+
+	auto& RT = getRuntimeKeeper();
+	size_t NumOfWorker = 1;
+
+	// 0 to resume in vendor callbacks
+	if (const char* Num = getenv("CLPKM_RESUME_WORKERS")) {
+		char* End = nullptr;
+		unsigned long Val = strtoul(Num, &End, 10);
+		if (End != Num && *End == '\0')
+			NumOfWorker = Val;
+		else
+			RT.Log("==CLPKM== Unrecognised number of resume workers: \"%s\"\n", Num);
+		}
+
+	for (size_t Idx = 0; Idx < NumOfWorker; ++Idx) {
+		auto W = std::make_unique<Worker>();
+		W->Head = nullptr;
+		W->EventFd = eventfd(0, EFD_CLOEXEC);
+		INTER_ASSERT(W->EventFd >= 0, "eventfd failed: %s",
+		             StrError(errno).c_str());
+		W->Thread = std::thread(&ResumeEngine::Work, this, std::ref(*W));
+		Workers.emplace_back(std::move(W));
+		}
+
+	}
+
+ResumeEngine::~ResumeEngine() {
+	this->Terminate();
+	}
+
+
+
+void ResumeEngine::Submit(handler Handler, cl_event Event, cl_int ExecStatus,
+                          void* UserData) {
+
+	if (Workers.empty() || Stop.load(std::memory_order_relaxed)) {
+		Handler(Event, ExecStatus, UserData);
+		return;
+		}
+
+	// Pick by UserData so that its completions stay in order
+	auto Key = reinterpret_cast<uintptr_t>(UserData) >> 4;
+	Worker& W = *Workers[Key % Workers.size()];
+
+	auto* R = new Record{nullptr, Handler, Event, ExecStatus, UserData};
+
+	R->Next = W.Head.load(std::memory_order_relaxed);
+	while (!W.Head.compare_exchange_weak(R->Next, R, std::memory_order_release,
+	                                     std::memory_order_relaxed));
+
+	uint64_t One = 1;
+	int Ret = write(W.EventFd, &One, sizeof(One));
+	INTER_ASSERT(Ret > 0, "write to eventfd failed: %s", StrError(errno).c_str());
+
+	}
+
+cl_int ResumeEngine::Flush(cl_command_queue Queue) {
+
+	if (PendingFlush == nullptr)
+		return Lookup<OclAPI::clFlush>()(Queue);
+
+	if (std::find(PendingFlush->begin(), PendingFlush->end(),
+	              Queue) != PendingFlush->end())
+		return CL_SUCCESS;
+
+	// The user may release the queue before the batch ends, so keep it alive
+	// till it's flushed
+	cl_int Ret = Lookup<OclAPI::clRetainCommandQueue>()(Queue);
+	if (Ret != CL_SUCCESS)
+		return Ret;
+
+	PendingFlush->emplace_back(Queue);
+	return CL_SUCCESS;
+
+	}
+
+void ResumeEngine::Terminate() {
+
+	if (Stop.exchange(true))
+		return;
+
+	// Wake workers up, they finish what's left and quit
+	for (auto& W : Workers) {
+		uint64_t One = 1;
+		int Ret = write(W->EventFd, &One, sizeof(One));
+		INTER_ASSERT(Ret > 0, "write to eventfd failed: %s",
+		             StrError(errno).c_str());
+		}
+
+	for (auto& W : Workers) {
+		if (W->Thread.joinable())
+			W->Thread.join();
+		close(W->EventFd);
+		W->EventFd = -1;
+		}
+
+	}
+
+
+
+// Worker
+void ResumeEngine::Work(Worker& W) {
+
+	auto& RT = getRuntimeKeeper();
+	std::vector<cl_command_queue> Queues;
+
+	PendingFlush = &Queues;
+
+	for (;;) {
+
+		uint64_t Count = 0;
+		while (read(W.EventFd, &Count, sizeof(Count)) < 0)
+			INTER_ASSERT(errno == EINTR, "read from eventfd failed: %s",
+			             StrError(errno).c_str());
+
+		// Take the whole stack, and reverse it to the order of submission
+		Record* Batch = W.Head.exchange(nullptr, std::memory_order_acquire);
+		Record* Front = nullptr;
+
+		while (Batch != nullptr) {
+			Record* Next = Batch->Next;
+			Batch->Next = Front;
+			Front = Batch;
+			Batch = Next;
+			}
+
+		while (Front != nullptr) {
+			std::unique_ptr<Record> R(Front);
+			Front = R->Next;
+			R->Handler(R->Event, R->ExecStatus, R->UserData);
+			}
+
+		// Flush each queue once per batch, and drop the reference Flush took
+		for (cl_command_queue Queue : Queues) {
+			cl_int Ret = Lookup<OclAPI::clFlush>()(Queue);
+			if (Ret != CL_SUCCESS)
+				RT.Log(RuntimeKeeper::loglevel::ERROR,
+				       "\n==CLPKM== Failed to flush queue %p: %" PRId32 "\n",
+				       Queue, Ret);
+			Lookup<OclAPI::clReleaseCommandQueue>()(Queue);
+			}
+
+		Queues.clear();
+
+		if (Stop.load() && W.Head.load() == nullptr)
+			break;
+
+		}
+
+	PendingFlush = nullptr;
+
+	}
+
+
+
+auto CLPKM::getResumeEngine(void) -> ResumeEngine& {
+	static ResumeEngine E;
+	return E;
+	}
@@ -0,0 +1,81 @@
+/*
+  ResumeEngine.hpp
+
+  Worker threads to resume kernels, so that vendor callbacks only record the
+  completion and return
+
+*/
+
+#ifndef __CLPKM__RESUME_ENGINE_HPP__
+#define __CLPKM__RESUME_ENGINE_HPP__
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <CL/opencl.h>
+
+
+
+namespace CLPKM {
+
+class ResumeEngine;
+ResumeEngine& getResumeEngine(void);
+
+class ResumeEngine {
+public:
+	using handler = void (*)(cl_event , cl_int , void* );
+
+	// Run Handler(Event, ExecStatus, UserData) on a worker
+	// Completions with the same UserData are handled in order of submission
+	// If there's no worker, it's run right away
+	void Submit(handler Handler, cl_event Event, cl_int ExecStatus,
+	            void* UserData);
+
+	// Flush the queue, or defer it to the end of the batch if called on a
+	// worker, retaining it till then
+	static cl_int Flush(cl_command_queue Queue);
+
+	size_t getNumOfWorker() const { return Workers.size(); }
+
+	// Shutdown worker threads
+	void Terminate();
+
+private:
+	ResumeEngine& operator=(const ResumeEngine& ) = delete;
+	ResumeEngine(const ResumeEngine& ) = delete;
+
+	struct Record {
+		Record*  Next;
+		handler  Handler;
+		cl_event Event;
+		cl_int   ExecStatus;
+		void*    UserData;
+		};
+
+	// A lock-free stack that producers push onto, and the worker takes all of
+	// it at once
+	struct Worker {
+		std::atomic<Record*> Head;
+		int                  EventFd;
+		std::thread          Thread;
+		};
+
+	ResumeEngine();
+	~ResumeEngine();
+
+	void Work(Worker& );
+
+	std::vector<std::unique_ptr<Worker>> Workers;
+	std::atomic<bool> Stop;
+
+	friend ResumeEngine& getResumeEngine(void);
+
+	};
+
+} // namespace CLPKM
+
+
+
+#endif
@@ -16,7 +16,9 @@ using namespace CLPKM;
 
 
 // Override config if specified from environment variable
-RuntimeKeeper::RuntimeKeeper() : LogLevel(loglevel::FATAL) {
+RuntimeKeeper::RuntimeKeeper()
+: LogLevel(loglevel::FATAL), HeaderScan(header_scan::DEVICE),
+  ResumeMode(resume_mode::SYNC) {
 	if (const char* Level = getenv("CLPKM_LOGLEVEL")) {
 		if (!strcmp(Level, "error"))
 			LogLevel = loglevel::ERROR;
@@ -27,6 +29,27 @@ RuntimeKeeper::RuntimeKeeper() : LogLevel(loglevel::FATAL) {
 		else if (strcmp(Level, "fatal"))
 			this->Log("==CLPKM== Unrecognised log level: \"%s\"\n", Level);
 		}
+	if (const char* Scan = getenv("CLPKM_HEADER_SCAN")) {
+		if (!strcmp(Scan, "host"))
+			HeaderScan = header_scan::HOST;
+		else if (strcmp(Scan, "device"))
+			this->Log("==CLPKM== Unrecognised header scan: \"%s\"\n", Scan);
+		}
+	if (const char* Mode = getenv("CLPKM_RESUME_MODE")) {
+		if (!strcmp(Mode, "pipelined"))
+			ResumeMode = resume_mode::PIPELINED;
+		else if (strcmp(Mode, "sync"))
+			this->Log("==CLPKM== Unrecognised resume mode: \"%s\"\n", Mode);
+		}
+	// In MiB, 0 to disable pooling
+	if (const char* Limit = getenv("CLPKM_POOL_LIMIT")) {
+		char* End = nullptr;
+		unsigned long long Mebi = strtoull(Limit, &End, 10);
+		if (End != Limit && *End == '\0')
+			BP.setLimit(static_cast<size_t>(Mebi) * 1024 * 1024);
+		else
+			this->Log("==CLPKM== Unrecognised pool limit: \"%s\"\n", Limit);
+		}
 	}
 
 
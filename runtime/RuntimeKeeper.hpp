@@ -10,18 +10,24 @@
 
 
 
+#include "BufferPool.hpp"
+#include "HandleTable.hpp"
+#include "KernelArgs.hpp"
 #include "KernelProfile.hpp"
 #include "ResourceGuard.hpp"
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
-#include <boost/thread/shared_mutex.hpp>
 #include <CL/opencl.h>
 
 
@@ -29,18 +35,45 @@
 namespace CLPKM {
 
 // Helper classes
+// Device limits needed on every launch, queried once per device
+struct DeviceInfo {
+	cl_device_id        Device;
+	std::string         Name;
+	cl_uint             MaxDim;
+	std::vector<size_t> MaxWorkItemSize;
+	cl_uint             NumOfComputeUnit;
+	cl_bool             HostUnifiedMem;
+
+	DeviceInfo(cl_device_id D, std::string&& N, cl_uint MD,
+	           std::vector<size_t>&& MWIS, cl_uint NCU, cl_bool HUM)
+	: Device(D), Name(std::move(N)), MaxDim(MD),
+	  MaxWorkItemSize(std::move(MWIS)), NumOfComputeUnit(NCU),
+	  HostUnifiedMem(HUM) { }
+	};
+
 struct QueueInfo {
 	cl_context   Context;
 	cl_device_id Device;
 	clQueue      ShadowQueue;
 
+	std::shared_ptr<const DeviceInfo> DevInfo;
+
 	const bool ShallReorder;
 	clEvent    TaskBlocker;
 	std::unique_ptr<std::mutex> BlockerMutex;
 
-	QueueInfo(cl_context C, cl_device_id D, clQueue&& Q, bool SR)
-	: Context(C), Device(D), ShadowQueue(std::move(Q)), ShallReorder(SR),
-	  TaskBlocker(NULL), BlockerMutex(std::make_unique<std::mutex>()) { }
+	// Host-mapped flag raised by the schedule service to ask kernels running
+	// on this queue to checkpoint
+	clMemObj PreemptFlag;
+	cl_int*  MappedPreemptFlag;
+
+	QueueInfo(cl_context C, cl_device_id D, clQueue&& Q,
+	          std::shared_ptr<const DeviceInfo> DI, bool SR, clMemObj&& PF,
+	          cl_int* MPF)
+	: Context(C), Device(D), ShadowQueue(std::move(Q)), DevInfo(std::move(DI)),
+	  ShallReorder(SR),
+	  TaskBlocker(NULL), BlockerMutex(std::make_unique<std::mutex>()),
+	  PreemptFlag(std::move(PF)), MappedPreemptFlag(MPF) { }
 	};
 
 struct ProgramInfo {
@@ -49,27 +82,105 @@ struct ProgramInfo {
 	std::string BuildLog;
 	ProfileList KernelProfileList;
 
+	// Whether the shadow program is still being built in the background, in
+	// which case the entry is replaced once it's done
+	bool InProgress;
+
 	ProgramInfo(cl_context C, clProgram&& P, std::string&& BL, ProfileList&& PL)
 	: Context(C), ShadowProgram(std::move(P)), BuildLog(std::move(BL)),
-	  KernelProfileList(std::move(PL)) { }
+	  KernelProfileList(std::move(PL)), InProgress(false) { }
+
+	// Placeholder of a build in progress
+	explicit ProgramInfo(cl_context C)
+	: Context(C), ShadowProgram(NULL), BuildLog(), KernelProfileList(),
+	  InProgress(true) { }
 	};
 
-struct KernelInfo {
-	using karg_t = std::pair<size_t, const void*>;
+// Per-device info of a kernel
+struct KernelDeviceInfo {
+	cl_device_id Device;
+	size_t       WorkGrpSize;
+	size_t       PreferredMultiple;
+
+	// Local work sizes decided for launches not specifying one, keyed by the
+	// global work size, the bytes of __local memory per work-group and the
+	// bucketed slice overhead
+	std::map<std::vector<size_t>, std::vector<size_t>> LWSCache;
 
+	KernelDeviceInfo(cl_device_id D, size_t WGS, size_t PM)
+	: Device(D), WorkGrpSize(WGS), PreferredMultiple(PM) { }
+	};
+
+// An instance in the kernel pool, along with what it has bound
+struct PooledKernel {
+	clKernel                Kernel;
+	KernelArgs::fingerprint Bound;
+	};
+
+struct KernelInfo {
 	cl_context           Context;
 	cl_program           Program;
 	const KernelProfile* Profile;
-	std::vector<karg_t>  Args;
 
-	std::vector<clKernel>       Pool;
+	// Arguments set by the user, shall be accessed with Mutex held
+	KernelArgs           Args;
+
+	// Keep the program info, where Profile lives, even if the program is
+	// released before the kernel
+	std::shared_ptr<const ProgramInfo> ProgInfo;
+
+	std::vector<PooledKernel>   Pool;
 	size_t                      RefCount;
 	std::unique_ptr<std::mutex> Mutex;
 
-	KernelInfo(cl_context C, cl_program P, const KernelProfile* KP)
+	// The uninstrumented clone and the header reduction kernel, created on
+	// first use
+	// Arguments are captured on enqueue, so one instance suffices
+	clKernel Pristine;
+	clKernel Reducer;
+
+	// Held from binding arguments to the pristine clone till it's enqueued,
+	// which is done without Mutex, as Mutex is taken under the blocker mutex
+	// of queues by the header reducer
+	KernelArgs::fingerprint     PristineBound;
+	std::unique_ptr<std::mutex> PristineMutex;
+
+	// Moving average of execution time per work-item in nanosecs, negative if
+	// the kernel has never finished
+	double ExecTimePerItem;
+
+	// Moving average of the share of a launch's wall time not spent running
+	// slices, i.e. checkpointing, inspecting the header and resuming
+	// Negative if the kernel has never finished sliced
+	double SliceOverhead;
+
+	// Usually only a device or two
+	std::vector<KernelDeviceInfo> DevInfo;
+
+	KernelInfo(cl_context C, cl_program P, const KernelProfile* KP,
+	           std::shared_ptr<const ProgramInfo> PI)
 	: Context(C), Program(P), Profile(KP),
-	  Args(KP->NumOfParam, karg_t(0, nullptr)), RefCount(1),
-	  Mutex(std::make_unique<std::mutex>()) { }
+	  Args(KP->NumOfParam), ProgInfo(std::move(PI)),
+	  RefCount(1),
+	  Mutex(std::make_unique<std::mutex>()), Pristine(NULL), Reducer(NULL),
+	  PristineMutex(std::make_unique<std::mutex>()),
+	  ExecTimePerItem(-1), SliceOverhead(-1) { }
+
+	// Shall be called with Mutex held
+	void RecordExecTime(cl_ulong ExecTime, size_t NumOfThread) {
+		double Sample = static_cast<double>(ExecTime) / NumOfThread;
+		ExecTimePerItem = (ExecTimePerItem < 0)
+		                  ? Sample : (ExecTimePerItem * 3 + Sample) / 4;
+		}
+
+	// Shall be called with Mutex held
+	void RecordSliceOverhead(cl_ulong ExecTime, double WallTime) {
+		if (WallTime <= 0)
+			return;
+		double Sample = std::max(0.0, 1.0 - ExecTime / WallTime);
+		SliceOverhead = (SliceOverhead < 0)
+		                ? Sample : (SliceOverhead * 3 + Sample) / 4;
+		}
 	};
 
 struct EventLog {
@@ -79,9 +190,10 @@ struct EventLog {
 	cl_ulong End;
 	};
 
-using QueueTable = std::unordered_map<cl_command_queue, QueueInfo>;
-using ProgramTable = std::unordered_map<cl_program, ProgramInfo>;
-using KernelTable = std::unordered_map<cl_kernel, KernelInfo>;
+using DeviceTable = HandleTable<cl_device_id, DeviceInfo>;
+using QueueTable = HandleTable<cl_command_queue, QueueInfo>;
+using ProgramTable = HandleTable<cl_program, ProgramInfo>;
+using KernelTable = HandleTable<cl_kernel, KernelInfo>;
 using EventLogger = std::unordered_map<cl_event, EventLog>;
 using tlv_t = cl_uint;
 
@@ -98,19 +210,43 @@ public:
 		NUM_OF_LOGLEVEL
 		};
 
+	DeviceTable&  getDeviceTable() { return DT; }
 	QueueTable&   getQueueTable() { return QT; }
 	ProgramTable& getProgramTable() { return PT; }
 	KernelTable&  getKernelTable() { return KT; }
 	EventLogger&  getEventLogger() { return EL; }
+	BufferPool&   getBufferPool() { return BP; }
+
+	// Where to inspect the header after each slice
+	enum class header_scan : uint8_t {
+		// Reduce the header on the device, and read back only a summary
+		DEVICE = 0,
+		// Read back the whole header, which is needed to log its distribution
+		HOST
+		};
 
-	auto& getQTLock() { return QTLock; }
-	auto& getPTLock() { return PTLock; }
-	auto& getKTLock() { return KTLock; }
+	// How to resume the kernel after each slice
+	enum class resume_mode : uint8_t {
+		// Inspect the header, and then enqueue the next slice
+		SYNC = 0,
+		// Keep the next slice queued behind the current one on the device
+		// Only available if the header is reduced on the device
+		PIPELINED
+		};
 
 	bool shouldLog(loglevel Level) const {
 		return (LogLevel >= Level);
 		}
 
+	header_scan getHeaderScan() const {
+		return shouldLog(loglevel::DEBUG) ? header_scan::HOST : HeaderScan;
+		}
+
+	resume_mode getResumeMode() const {
+		return (getHeaderScan() == header_scan::DEVICE) ? ResumeMode
+		                                                : resume_mode::SYNC;
+		}
+
 	template <class ... T>
 	void Log(T&& ... FormatStr) {
 		fprintf(stderr, FormatStr...);
@@ -130,19 +266,20 @@ private:
 	RuntimeKeeper();
 
 	// Internal status
-	loglevel LogLevel;
+	loglevel    LogLevel;
+	header_scan HeaderScan;
+	resume_mode ResumeMode;
 
 	// Members
 	// OpenCL related stuff
+	DeviceTable  DT;
 	QueueTable   QT;
 	ProgramTable PT;
 	KernelTable  KT;
 	EventLogger  EL;
 
-	// Locks
-	boost::upgrade_mutex QTLock;
-	boost::upgrade_mutex PTLock;
-	boost::upgrade_mutex KTLock;
+	// Header and live value buffers, shared among kernels of a context
+	BufferPool BP;
 
 	// Wa-i! Sugo-i! Tanoshi-!
 	friend RuntimeKeeper& getRuntimeKeeper(void);
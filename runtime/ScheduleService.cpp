@@ -104,7 +104,7 @@ void CL_CALLBACK ScheduleService::SchedGuard::SchedEndOnEventCallback(
 // FIXME: change defaults to system bus
 ScheduleService::ScheduleService()
 : TermEventFd(-1), IsOnSystemBus(false), Priority(priority::LOW),
-  Bus(nullptr), Threshold(0), Bitmap(0) {
+  PristineBudget(10000000), Bus(nullptr), Threshold(0), Bitmap(0) {
 
 	auto& RT = getRuntimeKeeper();
 
@@ -122,6 +122,16 @@ ScheduleService::ScheduleService()
 			RT.Log("==CLPKM== Unrecognised bus type: \"%s\"\n", BusType);
 		}
 
+	// In millisecs, 0 to always run instrumented kernels
+	if (const char* Budget = getenv("CLPKM_PRISTINE_BUDGET")) {
+		char* End = nullptr;
+		double Milli = strtod(Budget, &End);
+		if (End != Budget && *End == '\0' && Milli >= 0)
+			PristineBudget = static_cast<uint64_t>(Milli * 1000000);
+		else
+			RT.Log("==CLPKM== Unrecognised pristine budget: \"%s\"\n", Budget);
+		}
+
 	TermEventFd = eventfd(0, EFD_CLOEXEC);
 	INTER_ASSERT(TermEventFd >= 0, "eventfd failed: %s", StrError(errno).c_str());
 
@@ -311,6 +321,33 @@ void ScheduleService::SchedEnd(task_kind K) {
 
 
 
+void ScheduleService::RegisterPreemptFlag(volatile cl_int* Flag) {
+
+	auto* LowPrioTask = std::get_if<low_prio_task>(&Task);
+	INTER_ASSERT(LowPrioTask, "Task is not a low_prio_task!");
+
+	constexpr auto Mask = static_cast<task_bitmap>(1) << static_cast<size_t>(
+			task_kind::COMPUTING);
+
+	std::lock_guard<std::mutex> Lock(Mutex);
+
+	*Flag = (Bitmap & Mask) ? 1 : 0;
+	LowPrioTask->PreemptFlag.emplace(Flag);
+
+	}
+
+void ScheduleService::UnregisterPreemptFlag(volatile cl_int* Flag) {
+
+	auto* LowPrioTask = std::get_if<low_prio_task>(&Task);
+	INTER_ASSERT(LowPrioTask, "Task is not a low_prio_task!");
+
+	std::lock_guard<std::mutex> Lock(Mutex);
+	LowPrioTask->PreemptFlag.erase(Flag);
+
+	}
+
+
+
 // Workers
 void ScheduleService::HighPrioProcWorker() {
 
@@ -454,6 +491,17 @@ void ScheduleService::LowPrioProcWorker() {
 				OldBitmap & (Bitmap ^ static_cast<task_bitmap>(-1));
 		task_bitmap Mask = 1;
 
+		// Ask running kernels to checkpoint as soon as possible, or tell them
+		// they may run to completion
+		constexpr auto ComputingMask = static_cast<task_bitmap>(1) <<
+				static_cast<size_t>(task_kind::COMPUTING);
+
+		if ((OldBitmap ^ Bitmap) & ComputingMask) {
+			cl_int Raise = (Bitmap & ComputingMask) ? 1 : 0;
+			for (auto* Flag : LowPrioTask->PreemptFlag)
+				*Flag = Raise;
+			}
+
 		OldBitmap = Bitmap;
 		Lock.unlock();
 
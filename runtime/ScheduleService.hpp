@@ -13,6 +13,7 @@
 #include <condition_variable>
 #include <mutex>
 #include <thread>
+#include <unordered_set>
 #include <systemd/sd-bus.h>
 #include <variant>
 
@@ -62,11 +63,22 @@ public:
 	const std::string& getCompilerPath() const { return CompilerPath; }
 
 	uint64_t getCRThreshold() const { return Threshold; }
+	uint64_t getPristineBudget() const { return PristineBudget; }
 	priority getPriority() const { return Priority; }
 
+	// Whether no high priority task of kind K is running at the moment
+	bool isClear(task_kind K) {
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return !(Bitmap & (static_cast<task_bitmap>(1) << static_cast<size_t>(K)));
+		}
+
 	// Call this function when the process want to do some task
 	SchedGuard Schedule(task_kind K) { return SchedGuard(K); }
 
+	// Flags to raise when high priority tasks start computing
+	void RegisterPreemptFlag(volatile cl_int* );
+	void UnregisterPreemptFlag(volatile cl_int* );
+
 	// Shutdown IPC worker thread
 	void Terminate();
 
@@ -79,6 +91,9 @@ private:
 	bool     IsOnSystemBus;
 	priority Priority;
 
+	// Max predicted duration in nanosecs of a kernel to run uninstrumented
+	uint64_t PristineBudget;
+
 	sd_bus*      Bus;
 
 	// Task related stuff
@@ -99,6 +114,7 @@ private:
 
 	typedef struct {
 		std::condition_variable CV[NumOfTaskKind];
+		std::unordered_set<volatile cl_int*> PreemptFlag;
 		} low_prio_task;
 
 	// Mutex to protect bitmap
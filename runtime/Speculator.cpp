@@ -0,0 +1,148 @@
+/*
+  Speculator.cpp
+
+  Instrument programs ahead of their build (impl)
+
+*/
+
+#include "BuildService.hpp"
+#include "CompilerDriver.hpp"
+#include "RuntimeKeeper.hpp"
+#include "Speculator.hpp"
+
+#include <functional>
+#include <utility>
+
+using namespace CLPKM;
+
+
+
+void Speculation::Run() {
+
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (State != state::PENDING)
+			return;
+		State = state::RUNNING;
+	}
+
+	Instrument();
+
+	}
+
+void Speculation::Cancel() {
+	std::lock_guard<std::mutex> Lock(Mutex);
+	if (State == state::PENDING)
+		State = state::DONE;
+	}
+
+bool Speculation::Join(std::string& Out, ProfileList& L) {
+
+	std::unique_lock<std::mutex> Lock(Mutex);
+
+	// Nobody has picked it up, e.g. workers are busy building others, so run
+	// it here instead of waiting behind them
+	if (State == state::PENDING) {
+		State = state::RUNNING;
+		Lock.unlock();
+		Instrument();
+		Lock.lock();
+		}
+
+	Cond.wait(Lock, [this] { return State == state::DONE; });
+
+	// Taken out of the speculator, so the result is used only once
+	Out = std::move(Result);
+	L = std::move(PL);
+	return Succeed;
+
+	}
+
+void Speculation::Instrument() {
+
+	std::string Out = Source;
+	ProfileList List;
+	bool Ret = false;
+
+	try {
+		Ret = CLPKM::Compile(Out, Options.empty() ? nullptr : Options.c_str(),
+		                     List);
+		}
+	catch (const std::exception& E) {
+		Out = std::string("Speculative instrumentation failed: ") + E.what();
+		}
+
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		Succeed = Ret;
+		Result = std::move(Out);
+		PL = std::move(List);
+		State = state::DONE;
+	}
+
+	Cond.notify_all();
+
+	}
+
+
+
+void Speculator::Start(cl_program Program, std::string Source) {
+
+	auto& BS = getBuildService();
+
+	// Without a worker it'd be run on the caller's thread, which gains nothing
+	// With workers, compilers may be forked concurrently with the build of
+	// other programs, which relies on their pipes being close-on-exec
+	if (BS.getNumOfWorker() == 0)
+		return;
+
+	std::string Options;
+
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		auto It = LastOptions.find(std::hash<std::string>()(Source));
+		if (It != LastOptions.end())
+			Options = It->second;
+	}
+
+	auto Spec = std::make_shared<Speculation>(std::move(Source),
+	                                          std::move(Options));
+
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		// The handle of a program released unbuilt may be reused
+		Pending[Program] = Spec;
+	}
+
+	BS.Submit([Spec] { Spec->Run(); });
+
+	}
+
+std::shared_ptr<Speculation> Speculator::Take(cl_program Program) {
+
+	std::lock_guard<std::mutex> Lock(Mutex);
+	auto It = Pending.find(Program);
+
+	if (It == Pending.end())
+		return nullptr;
+
+	auto Spec = std::move(It->second);
+	Pending.erase(It);
+	return Spec;
+
+	}
+
+bool Speculator::isPending(cl_program Program) {
+	std::lock_guard<std::mutex> Lock(Mutex);
+	return (Pending.find(Program) != Pending.end());
+	}
+
+void Speculator::Record(const std::string& Source, const char* Options) {
+	std::lock_guard<std::mutex> Lock(Mutex);
+	LastOptions[std::hash<std::string>()(Source)] = Options ? Options : "";
+	}
+
+Speculator& CLPKM::getSpeculator(void) {
+	static Speculator S;
+	return S;
+	}
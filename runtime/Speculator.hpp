@@ -0,0 +1,112 @@
+/*
+  Speculator.hpp
+
+  Instrument programs as soon as they're created, guessing the options they
+  will be built with, so that clBuildProgram finds the work done
+
+*/
+
+#ifndef __CLPKM__SPECULATOR_HPP__
+#define __CLPKM__SPECULATOR_HPP__
+
+
+
+#include "KernelProfile.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <CL/opencl.h>
+
+
+
+namespace CLPKM {
+
+// Instrumentation of a program started ahead of its build
+class Speculation {
+public:
+	Speculation(std::string&& S, std::string&& O)
+	: Source(std::move(S)), Options(std::move(O)), State(state::PENDING),
+	  Succeed(false) { }
+
+	// Whether it's what clBuildProgram would instrument
+	bool Matches(const std::string& S, const char* O) const {
+		return (Source == S && Options == (O ? O : ""));
+		}
+
+	// Run on a build worker, unless it's been claimed by Join
+	void Run();
+
+	// Skip it if no worker has started it yet
+	void Cancel();
+
+	// Wait for the result, or run it right away if no worker has started it
+	// Same as CLPKM::Compile, Out is set to the instrumented code, or the log
+	// on failure
+	bool Join(std::string& Out, ProfileList& PL);
+
+private:
+	enum class state : uint8_t {
+		PENDING = 0,
+		RUNNING,
+		DONE
+		};
+
+	// Shall be called with State claimed
+	void Instrument();
+
+	const std::string Source;
+	const std::string Options;
+
+	std::mutex              Mutex;
+	std::condition_variable Cond;
+	state                   State;
+
+	// Valid once done
+	bool        Succeed;
+	std::string Result;
+	ProfileList PL;
+
+	};
+
+class Speculator {
+public:
+	// Start instrumenting the source of Program on a build worker, with the
+	// options the same source was last built with, or none
+	void Start(cl_program Program, std::string Source);
+
+	// Take the speculation of Program out, or null if there's none
+	std::shared_ptr<Speculation> Take(cl_program Program);
+
+	bool isPending(cl_program Program);
+
+	// Remember the options Source is built with, for later programs of it
+	void Record(const std::string& Source, const char* Options);
+
+private:
+	Speculator(const Speculator& ) = delete;
+	Speculator& operator=(const Speculator& ) = delete;
+
+	Speculator() = default;
+
+	std::mutex Mutex;
+	std::unordered_map<cl_program, std::shared_ptr<Speculation>> Pending;
+
+	// Keyed by the hash of the source
+	std::unordered_map<size_t, std::string> LastOptions;
+
+	friend Speculator& getSpeculator(void);
+
+	};
+
+Speculator& getSpeculator(void);
+
+}
+
+
+
+#endif
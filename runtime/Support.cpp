@@ -5,15 +5,227 @@
 
 */
 
+#include "BinaryCache.hpp"
+#include "CompilerDriver.hpp"
 #include "ErrorHandling.hpp"
+#include "LocalWorkSize.hpp"
 #include "ResourceGuard.hpp"
 #include "RuntimeKeeper.hpp"
+#include "Speculator.hpp"
 #include "Support.hpp"
 
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+
 using namespace CLPKM;
 
 
 
+namespace {
+
+// Entries of the local work size cache per kernel and device
+constexpr size_t MaxLWSCacheSize = 256;
+
+// Slice overhead is bucketed into steps of this in the keys of both the memo
+// and the store, so that the choice is revised once it drifts, but not on
+// every launch
+constexpr double SliceOverheadStep = 0.125;
+
+// What BuildShadowProgram does, except that it may throw
+cl_int BuildShadowProgramCore(cl_program Program, cl_context Context,
+                              std::string& Source, cl_uint NumOfDevice,
+                              const cl_device_id* DeviceList,
+                              const char* Options) {
+
+	auto& RT = getRuntimeKeeper();
+	auto& PT = RT.getProgramTable();
+	auto& BC = getBinaryCache();
+	ProfileList PL;
+
+	cl_int Ret = CL_SUCCESS;
+
+	// Instrumentation started when the program was created, if any
+	auto& Spec = getSpeculator();
+	auto Speculated = Spec.Take(Program);
+
+	Spec.Record(Source, Options);
+
+	// Devices to build for, which binaries in the cache are keyed by
+	std::vector<cl_device_id> Devices;
+	std::string CacheKey;
+	BinaryCache::Entry Cached;
+
+	if (BC.isEnabled()) {
+		if (DeviceList != nullptr)
+			Devices.assign(DeviceList, DeviceList + NumOfDevice);
+		else {
+			auto venGetContextInfo = Lookup<OclAPI::clGetContextInfo>();
+			size_t Size = 0;
+			Ret = venGetContextInfo(Context, CL_CONTEXT_DEVICES, 0, nullptr, &Size);
+			OCL_ASSERT(Ret);
+			Devices.resize(Size / sizeof(cl_device_id));
+			Ret = venGetContextInfo(Context, CL_CONTEXT_DEVICES, Size,
+			                        Devices.data(), nullptr);
+			OCL_ASSERT(Ret);
+			}
+		CacheKey = BC.MakeKey(Source, Options, Devices);
+		}
+
+	const bool Hit = BC.Find(CacheKey, Cached) &&
+	                 Cached.Binaries.size() == Devices.size();
+
+	// Guessed wrong, or not needed at all
+	if (Speculated != nullptr &&
+	    (Hit || !Speculated->Matches(Source, Options))) {
+		Speculated->Cancel();
+		Speculated = nullptr;
+		}
+
+	cl_program RawShadowProgram = NULL;
+	bool FromBinary = false;
+
+	if (Hit) {
+
+		std::vector<size_t> Lengths;
+		std::vector<const unsigned char*> Binaries;
+
+		for (const auto& Bin : Cached.Binaries) {
+			Lengths.emplace_back(Bin.size());
+			Binaries.emplace_back(
+					reinterpret_cast<const unsigned char*>(Bin.data()));
+			}
+
+		RawShadowProgram = Lookup<OclAPI::clCreateProgramWithBinary>()(
+				Context, Devices.size(), Devices.data(), Lengths.data(),
+				Binaries.data(), nullptr, &Ret);
+
+		// The driver may reject binaries of another build of itself, in which
+		// case the instrumented source is still good
+		if (Ret != CL_SUCCESS) {
+			RT.Log(RuntimeKeeper::loglevel::INFO,
+			       "==CLPKM== Cached binaries rejected, ret %" PRId32 "\n", Ret);
+			RawShadowProgram = NULL;
+			}
+		else
+			FromBinary = true;
+
+		Source = std::move(Cached.Source);
+		PL = std::move(Cached.PL);
+
+		}
+
+	// Now invoke CLPKMCC, unless it's been started with the same options
+	auto Instrument = [&]() -> bool {
+		if (Speculated != nullptr)
+			return Speculated->Join(Source, PL);
+		return CLPKM::Compile(Source, Options, PL);
+		};
+
+	if (!Hit && !Instrument()) {
+
+		RT.Log(RuntimeKeeper::loglevel::DEBUG,
+		       "==CLPKM== Build program failed! Build log:\n"
+		       "------------[ cut here ]------------\n"
+		       "%s\n"
+		       "------------[ cut here ]------------\n",
+		       Source.c_str());
+
+		// Build log is put in source
+		ProgramInfo NewEntry(Context, NULL, std::move(Source), ProfileList());
+
+		PT.insert_or_assign(Program, std::move(NewEntry));
+
+		return CL_BUILD_PROGRAM_FAILURE;
+
+		}
+
+	// Build a new program with instrumented code
+	if (RawShadowProgram == NULL) {
+		const char* Ptr = Source.data();
+		const size_t Len = Source.size();
+		RawShadowProgram = Lookup<OclAPI::clCreateProgramWithSource>()(
+				Context, 1, &Ptr, &Len, &Ret);
+		OCL_ASSERT(Ret);
+		}
+
+	clProgram ShadowProgram = RawShadowProgram;
+
+	// Binaries loaded from the cache are already there
+	const bool ShallSave = !CacheKey.empty() && !FromBinary;
+
+	// Kept for the cache, as the list is moved into the table
+	if (ShallSave)
+		Cached.PL = PL;
+
+	ProgramInfo NewEntry(Context, std::move(ShadowProgram), std::string(),
+	                     std::move(PL));
+
+	PT.insert_or_assign(Program, std::move(NewEntry));
+
+	// Call the vendor's impl to build the instrumented code
+	Ret = Lookup<OclAPI::clBuildProgram>()(
+			RawShadowProgram, NumOfDevice, DeviceList, Options, nullptr, nullptr);
+
+	if (Ret == CL_SUCCESS && ShallSave &&
+	    BinaryCache::GetBinaries(RawShadowProgram, Devices, Cached.Binaries)) {
+		Cached.Source = std::move(Source);
+		BC.Save(CacheKey, Cached);
+		}
+
+	// Return immediately if not in debug mode
+	if (!RT.shouldLog(RuntimeKeeper::loglevel::DEBUG))
+		return Ret;
+
+	// Do not try to retrieve device list here because it seems to be expensive
+	if (!DeviceList) {
+		RT.Log("==CLPKM== Device list not specified, skipping logging build log\n");
+		return Ret;
+		}
+
+	auto venGetProgramBuildInfo = Lookup<OclAPI::clGetProgramBuildInfo>();
+
+	size_t LogLength = 0;
+	std::string VendorLog;
+
+	cl_int DRet = venGetProgramBuildInfo(
+			RawShadowProgram, DeviceList[0], CL_PROGRAM_BUILD_LOG,
+			0, nullptr, &LogLength);
+
+	if (DRet != CL_SUCCESS) {
+		RT.Log("==CLPKM== Failed to query size of vendor build log, ret %"
+		       PRId32 "\n", DRet);
+		return Ret;
+		}
+
+	VendorLog.resize(LogLength, '\0');
+
+	DRet = venGetProgramBuildInfo(
+			RawShadowProgram, DeviceList[0], CL_PROGRAM_BUILD_LOG,
+			LogLength, VendorLog.data(), nullptr);
+
+	if (DRet != CL_SUCCESS) {
+		RT.Log("==CLPKM== Failed to retrieve vendor build log, ret %" PRId32 "\n",
+		       DRet);
+		return Ret;
+		}
+
+	RT.Log("\n==CLPKM== Vendor compiler build log:\n"
+	       "------------[ cut here ]------------\n"
+	       "%s\n"
+	       "------------[ cut here ]------------\n",
+	       VendorLog.c_str());
+
+	return Ret;
+
+	}
+
+}
+
+
+
 std::string CLPKM::ToHumanReadable(size_t S) {
 
 	float  R = S;
@@ -31,73 +243,145 @@ std::string CLPKM::ToHumanReadable(size_t S) {
 
 	}
 
-std::vector<size_t> CLPKM::FindWorkGroupSize(cl_kernel Kernel,
-                                             cl_device_id Device,
-                                             size_t WorkDim, size_t MaxDim,
-                                             const size_t* WorkSize,
-                                             cl_int* Ret) {
+std::shared_ptr<const DeviceInfo> CLPKM::QueryDeviceInfo(cl_device_id Device) {
+
+	auto& DT = getRuntimeKeeper().getDeviceTable();
+
+	if (auto DevInfo = DT.find(Device))
+		return DevInfo;
 
 	auto venGetDevInfo = Lookup<OclAPI::clGetDeviceInfo>();
-	std::vector<size_t> MaxThreadSize(MaxDim, 1);
-
-	// Find out max size on each dimension
-	*Ret = venGetDevInfo(Device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
-	                     sizeof(size_t) * MaxDim, MaxThreadSize.data(),
-	                     nullptr);
-	OCL_ASSERT(*Ret);
-
-	// Find out max number of work items
-	size_t MaxNumOfThread = 0;
-	auto venGetKernelBlockInfo = Lookup<OclAPI::clGetKernelWorkGroupInfo>();
-
-	*Ret = venGetKernelBlockInfo(Kernel, Device, CL_KERNEL_WORK_GROUP_SIZE,
-	                             sizeof(size_t), &MaxNumOfThread, nullptr);
-	OCL_ASSERT(*Ret);
-
-	std::vector<std::vector<size_t>> Factor(WorkDim);
-
-	// Compute the factors of global work size on each dimension
-	for (size_t Dim = 0; Dim < WorkDim; ++Dim) {
-		for (size_t Num = 1, Quotient;
-		     Num <= (Quotient = WorkSize[Dim] / Num)
-		     && Num <= MaxThreadSize[Dim];
-		     ++Num) {
-			if (WorkSize[Dim] % Num)
-				continue;
-			Factor[Dim].emplace_back(Num);
-			if (Quotient != Num && Quotient <= MaxThreadSize[Dim])
-				Factor[Dim].emplace_back(Quotient);
-			}
-		}
+	size_t  NameLength = 0;
+	cl_uint MaxDim = 0;
+	cl_uint NumOfComputeUnit = 0;
+	cl_bool HostUnifiedMem = CL_FALSE;
+
+	cl_int Ret = venGetDevInfo(Device, CL_DEVICE_NAME, 0, nullptr, &NameLength);
+	OCL_ASSERT(Ret);
+
+	std::string Name(NameLength, '\0');
+
+	Ret = venGetDevInfo(Device, CL_DEVICE_NAME, NameLength, Name.data(), nullptr);
+	OCL_ASSERT(Ret);
+
+	// Drop the terminating null
+	Name.resize(strlen(Name.c_str()));
+
+	Ret = venGetDevInfo(Device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS,
+	                    sizeof(cl_uint), &MaxDim, nullptr);
+	OCL_ASSERT(Ret);
+
+	std::vector<size_t> MaxWorkItemSize(MaxDim, 1);
+
+	Ret = venGetDevInfo(Device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+	                    sizeof(size_t) * MaxDim, MaxWorkItemSize.data(), nullptr);
+	OCL_ASSERT(Ret);
+
+	Ret = venGetDevInfo(Device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint),
+	                    &NumOfComputeUnit, nullptr);
+	OCL_ASSERT(Ret);
+
+	Ret = venGetDevInfo(Device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool),
+	                    &HostUnifiedMem, nullptr);
+	OCL_ASSERT(Ret);
+
+	// If another thread beat us to it, theirs is as good as ours
+	DT.emplace(Device, DeviceInfo(Device, std::move(Name), MaxDim,
+	                              std::move(MaxWorkItemSize), NumOfComputeUnit,
+	                              HostUnifiedMem));
+
+	return DT.find(Device);
+
+	}
 
-	// Each entry in the set stores an index to a factor in the factor table
-	std::vector<size_t> TrySet(WorkDim, 0);
-	std::vector<size_t> MaxSet(WorkDim, 0);
-	size_t MaxSize = 1;
+std::vector<size_t> CLPKM::FindWorkGroupSize(KernelInfo& KInfo,
+                                             cl_kernel Kernel,
+                                             const DeviceInfo& DevInfo,
+                                             size_t WorkDim,
+                                             const size_t* WorkSize) {
+
+	std::unique_lock<std::mutex> Lock(*KInfo.Mutex);
+
+	auto KDevInfo = std::find_if(KInfo.DevInfo.begin(), KInfo.DevInfo.end(),
+	                             [&](const KernelDeviceInfo& Entry) {
+		return (Entry.Device == DevInfo.Device);
+		});
+
+	// Find out max number of work items, and the SIMD width
+	if (KDevInfo == KInfo.DevInfo.end()) {
+		auto venGetKernelBlockInfo = Lookup<OclAPI::clGetKernelWorkGroupInfo>();
+		size_t MaxNumOfThread = 0;
+		size_t PreferredMultiple = 0;
+		cl_int Ret = venGetKernelBlockInfo(
+				Kernel, DevInfo.Device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t),
+				&MaxNumOfThread, nullptr);
+		OCL_ASSERT(Ret);
+		Ret = venGetKernelBlockInfo(
+				Kernel, DevInfo.Device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+				sizeof(size_t), &PreferredMultiple, nullptr);
+		OCL_ASSERT(Ret);
+		KInfo.DevInfo.emplace_back(DevInfo.Device, MaxNumOfThread,
+		                           PreferredMultiple);
+		KDevInfo = std::prev(KInfo.DevInfo.end());
+		}
 
-	auto NextTry = [&]() -> bool {
-		size_t Dim = 0;
-		while (Dim < WorkDim && TrySet[Dim] == Factor[Dim].size() - 1)
-			TrySet[Dim++] = 0;
-		if (Dim >= WorkDim)
+	// __local live values are saved per work-group
+	size_t ReqLocSize = KInfo.Profile->ReqLocSize;
+	for (auto ParamIdx : KInfo.Profile->LocPtrParamIdx)
+		ReqLocSize += KInfo.Args.getSize(ParamIdx);
+
+	// Zero if the kernel has never finished sliced
+	const size_t OverheadBucket = (KInfo.SliceOverhead < 0)
+	                              ? 0 : 1 + static_cast<size_t>(
+	                                        KInfo.SliceOverhead /
+	                                        SliceOverheadStep);
+
+	// Also keyed by what the choice depends on besides the global work size
+	std::vector<size_t> Key(WorkSize, WorkSize + WorkDim);
+	Key.push_back(ReqLocSize);
+	Key.push_back(OverheadBucket);
+	auto& Cache = KDevInfo->LWSCache;
+	auto Hit = Cache.find(Key);
+
+	if (Hit != Cache.end())
+		return Hit->second;
+
+	const size_t MaxNumOfThread = KDevInfo->WorkGrpSize;
+	const auto& MaxThreadSize = DevInfo.MaxWorkItemSize;
+
+	// Take the one chosen in earlier runs if it still fits
+	auto& Store = getLWSStore();
+	std::string StoreKey;
+	std::vector<size_t> LWS;
+
+	auto Fits = [&]() -> bool {
+		if (LWS.size() != WorkDim)
 			return false;
-		++TrySet[Dim];
-		return true;
+		size_t Size = 1;
+		for (size_t Dim = 0; Dim < WorkDim; ++Dim) {
+			if (LWS[Dim] == 0 || WorkSize[Dim] % LWS[Dim] ||
+			    LWS[Dim] > MaxThreadSize[Dim])
+				return false;
+			Size *= LWS[Dim];
+			}
+		return (Size <= MaxNumOfThread);
 		};
 
-	// Start from the second try
-	while (NextTry()) {
-		size_t ThisSize = 1;
-		for (size_t Dim = 0; Dim < WorkDim; ++Dim)
-			ThisSize *= Factor[Dim][TrySet[Dim]];
-		if (ThisSize > MaxSize && ThisSize < MaxNumOfThread) {
-			MaxSet = TrySet;
-			MaxSize = ThisSize;
-			}
+	if (Store.isEnabled()) {
+		StoreKey = LWSStore::MakeKey(DevInfo.Name, KInfo.Profile->Name, WorkDim,
+		                             WorkSize, ReqLocSize, OverheadBucket);
+		if (!Store.Find(StoreKey, LWS) || !Fits())
+			LWS.clear();
 		}
 
-	for (size_t Dim = 0; Dim < WorkDim; ++Dim)
-		MaxSet[Dim] = Factor[Dim][MaxSet[Dim]];
+	const bool Stored = !LWS.empty();
+
+	if (!Stored) {
+		LWSModel Model{MaxThreadSize.data(), MaxNumOfThread,
+		               KDevInfo->PreferredMultiple, DevInfo.NumOfComputeUnit,
+		               ReqLocSize, KInfo.Profile->ReqPrvSize, KInfo.SliceOverhead};
+		LWS = SelectLocalWorkSize(Model, WorkDim, WorkSize);
+		}
 
 	auto ToString = [](auto Start, auto End) -> std::string {
 		std::string S;
@@ -112,17 +396,32 @@ std::vector<size_t> CLPKM::FindWorkGroupSize(cl_kernel Kernel,
 		};
 
 	getRuntimeKeeper().Log(RuntimeKeeper::loglevel::INFO,
-	                       "\n==CLPKM== auto decide local work size\n"
-	                       "==CLPKM==   kernel work-group size: %zu\n"
+	                       "\n==CLPKM== auto decide local work size%s\n"
+	                       "==CLPKM==   kernel work-group size: %zu (multiple of %zu)\n"
 	                       "==CLPKM==   device limit: (%s)\n"
+	                       "==CLPKM==   slice overhead: %.2f\n"
 	                       "==CLPKM==   gws: (%s) lws: (%s)\n",
-	                       MaxNumOfThread,
+	                       Stored ? " (stored)" : "",
+	                       MaxNumOfThread, KDevInfo->PreferredMultiple,
 	                       ToString(MaxThreadSize.begin(),
 	                                MaxThreadSize.end()).c_str(),
+	                       KInfo.SliceOverhead,
 	                       ToString(WorkSize, WorkSize + WorkDim).c_str(),
-	                       ToString(MaxSet.begin(), MaxSet.end()).c_str());
+	                       ToString(LWS.begin(), LWS.end()).c_str());
+
+	// Don't let a kernel launched in ever-changing shapes grow it unbounded
+	if (Cache.size() >= MaxLWSCacheSize)
+		Cache.clear();
+
+	Cache.emplace(std::move(Key), LWS);
 
-	return MaxSet;
+	// Writes the file, which shall not hold up others launching the kernel
+	Lock.unlock();
+
+	if (!Stored && Store.isEnabled())
+		Store.Save(StoreKey, LWS);
+
+	return LWS;
 
 	}
 
@@ -180,13 +479,12 @@ cl_int CLPKM::Reorder(cl_command_queue OrigQueue, const cl_event* WaitingList,
 	auto& RT = getRuntimeKeeper();
 	auto& QT = RT.getQueueTable();
 
-	boost::shared_lock<boost::upgrade_mutex> QTLock(RT.getQTLock());
 	const auto QTEntry = QT.find(OrigQueue);
 
-	if (QTEntry == QT.end())
+	if (QTEntry == nullptr)
 		return CL_INVALID_COMMAND_QUEUE;
 
-	auto& QueueInfo = QTEntry->second;
+	auto& QueueInfo = *QTEntry;
 
 	// Prepare new wait list for ReorderCore
 	std::vector<cl_event> NewWaitingList(WaitingList, WaitingList + NumOfWaiting);
@@ -194,3 +492,53 @@ cl_int CLPKM::Reorder(cl_command_queue OrigQueue, const cl_event* WaitingList,
 	return ReorderCore(QueueInfo, NewWaitingList, Event, Func);
 
 	}
+
+std::string CLPKM::GetProgramSource(cl_program Program) {
+
+	auto venGetProgramInfo = Lookup<OclAPI::clGetProgramInfo>();
+	size_t SourceLength = 0;
+
+	cl_int Ret = venGetProgramInfo(Program, CL_PROGRAM_SOURCE, 0, nullptr,
+	                               &SourceLength);
+	OCL_ASSERT(Ret);
+
+	// Must be greater than zero because the size includes null terminator
+	INTER_ASSERT(SourceLength > 0, "clGetProgramInfo returned zero source length");
+
+	// Retrieve the source and remove the null terminator
+	std::string Source(SourceLength, '\0');
+	Ret = venGetProgramInfo(Program, CL_PROGRAM_SOURCE, SourceLength,
+	                        Source.data(), nullptr);
+	OCL_ASSERT(Ret);
+	Source.resize(SourceLength - 1);
+
+	return Source;
+
+	}
+
+cl_int CLPKM::BuildShadowProgram(cl_program Program, cl_context Context,
+                                 std::string Source, cl_uint NumOfDevice,
+                                 const cl_device_id* DeviceList,
+                                 const char* Options) {
+
+	auto Fail = [&](cl_int Ret, const char* What) -> cl_int {
+		std::string Log = std::string("CLPKM: ") + What;
+		ProgramInfo NewEntry(Context, NULL, std::move(Log), ProfileList());
+		getRuntimeKeeper().getProgramTable().insert_or_assign(
+				Program, std::move(NewEntry));
+		return Ret;
+		};
+
+	// The placeholder shall not outlive the build
+	try {
+		return BuildShadowProgramCore(Program, Context, Source, NumOfDevice,
+		                              DeviceList, Options);
+		}
+	catch (const __ocl_error& OclError) {
+		return Fail(OclError, "failed to build the shadow program");
+		}
+	catch (const std::bad_alloc& ) {
+		return Fail(CL_OUT_OF_HOST_MEMORY, "out of host memory");
+		}
+
+	}
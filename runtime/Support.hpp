@@ -11,6 +11,7 @@
 
 
 #include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -23,11 +24,27 @@ namespace CLPKM {
 // Convert a size to human readable string, e.g. 1024 -> 1 KiB
 std::string ToHumanReadable(size_t );
 
+// Get the cached info of the device, querying it on first use
+std::shared_ptr<const DeviceInfo> QueryDeviceInfo(cl_device_id Device);
+
 // Helper function to find work group size if the user didn't specify one
-std::vector<size_t> FindWorkGroupSize(cl_kernel Kernel, cl_device_id Device,
-                                      size_t WorkDim, size_t MaxDim,
-                                      const size_t* WorkSize,
-                                      cl_int* Ret);
+// Results are memoized in KInfo per device and global work size, and
+// persisted if CLPKM_LWS_CACHE is set
+std::vector<size_t> FindWorkGroupSize(KernelInfo& KInfo, cl_kernel Kernel,
+                                      const DeviceInfo& DevInfo,
+                                      size_t WorkDim, const size_t* WorkSize);
+
+// Get the source of a program, or an empty string if it's created from
+// binaries or built-in kernels
+std::string GetProgramSource(cl_program Program);
+
+// Instrument Source and build the shadow program of Program with the vendor's
+// impl, putting the result in the program table
+// Returns what the vendor's clBuildProgram returned, or the error that failed
+// the build before that
+cl_int BuildShadowProgram(cl_program Program, cl_context Context,
+                          std::string Source, cl_uint NumOfDevice,
+                          const cl_device_id* DeviceList, const char* Options);
 
 using ReorderInvokee = std::function<cl_int(const cl_event*, size_t, cl_event*)>;
 
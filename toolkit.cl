@@ -7,6 +7,8 @@
 
 //
 // Memory copy functions
+// CLPKMCC emits straight-line copies for most private variables, and these
+// are used only for those too large or too oddly sized
 //
 void __clpkm_load_private_align_4(__global void * __lvb,
                                   __private const void * __dst,
@@ -71,6 +73,50 @@ void __clpkm_store_private(__global void * __lvb,
     --__size;
   }
 }
+// Interleaved layout: __lvb points to the first word of this work-item, and
+// consecutive words of the same work-item are __stride words apart
+void __clpkm_load_private_interleaved_align_4(__global void * __lvb,
+                                              size_t __offset,
+                                              __private void * __dst,
+                                              size_t __size,
+                                              size_t __stride) {
+  __global uint * __w_lvb = ((__global uint *) __lvb) + (__offset >> 2) * __stride;
+  __private uint * __w_dst = (__private uint *) __dst;
+  while (__size >= 4) {
+    * __w_dst++ = * __w_lvb;
+    __w_lvb += __stride;
+    __size -= 4;
+  }
+}
+void __clpkm_store_private_interleaved_align_4(__global void * __lvb,
+                                               size_t __offset,
+                                               __private const void * __src,
+                                               size_t __size,
+                                               size_t __stride) {
+  __global uint * __w_lvb = ((__global uint *) __lvb) + (__offset >> 2) * __stride;
+  __private const uint * __w_src = (__private const uint *) __src;
+  while (__size >= 4) {
+    * __w_lvb = * __w_src++;
+    __w_lvb += __stride;
+    __size -= 4;
+  }
+}
+void __clpkm_load_private_interleaved(__global void * __lvb, size_t __offset,
+                                      __private void * __dst, size_t __size,
+                                      size_t __stride) {
+  __global uchar * __b_lvb = (__global uchar *) __lvb;
+  __private uchar * __b_dst = (__private uchar *) __dst;
+  for (size_t __idx = __offset; __idx < __offset + __size; ++__idx)
+    * __b_dst++ = __b_lvb[(__idx >> 2) * __stride * 4 + (__idx & 3)];
+}
+void __clpkm_store_private_interleaved(__global void * __lvb, size_t __offset,
+                                       __private const void * __src,
+                                       size_t __size, size_t __stride) {
+  __global uchar * __b_lvb = (__global uchar *) __lvb;
+  __private const uchar * __b_src = (__private const uchar *) __src;
+  for (size_t __idx = __offset; __idx < __offset + __size; ++__idx)
+    __b_lvb[(__idx >> 2) * __stride * 4 + (__idx & 3)] = * __b_src++;
+}
 // XXX: assumption: __local variables are always 4-aligned
 void __clpkm_store_local(__global void * __lvb, __local const void * __src,
                          size_t __size, size_t __loc_id, size_t __batch_size) {
@@ -120,10 +166,107 @@ void __get_linear_id(size_t * __global_id, size_t * __group_id,
   * __group_size = __grp_sz;
 }
 
+size_t __get_linear_global_size(void) {
+  uint   __dim = get_work_dim();
+  size_t __size = 1;
+  while (__dim-- > 0)
+    __size *= get_global_size(__dim);
+  return __size;
+}
+
+// Compact launch
+// A kernel free of calls to other functions can be resumed with only the
+// unfinished work-groups, laid out along dimension 0. CLPKMCC then replaces
+// calls to work-item functions with the macros below, which refer to the IDs
+// of the work-group in the whole NDRange
+// __launch consists of:
+//   [0] number of launched work-groups, or 0 if the whole NDRange is launched
+//   [1] if not ~0, the launched work-groups are consecutive from this one
+//   [2, 5) number of work-groups of each dimension of the whole NDRange
+//   [5, 8) global offset of each dimension of the whole NDRange
+//   [8, )  linear IDs of the launched work-groups, if not consecutive
+#define __CLPKM_LAUNCH_NUM_GRPS 2
+#define __CLPKM_LAUNCH_GWO      5
+#define __CLPKM_LAUNCH_TABLE    8
+void __get_compact_linear_id(__global const uint * __launch,
+                             size_t * __grp_ids, size_t * __num_grps,
+                             size_t * __gwo, size_t * __global_id,
+                             size_t * __group_id, size_t * __local_id,
+                             size_t * __group_size) {
+  uint __dim = get_work_dim();
+  for (uint __d = 0; __d < 3; ++__d) {
+    __num_grps[__d] = (__d < __dim) ? get_num_groups(__d) : 1;
+    __gwo[__d] = (__d < __dim) ? get_global_offset(__d) : 0;
+    __grp_ids[__d] = (__d < __dim) ? get_group_id(__d) : 0;
+  }
+  __get_linear_id(__global_id, __group_id, __local_id, __group_size);
+  if (__launch[0] == 0)
+    return;
+  size_t __grp_id = (__launch[1] != ~0u)
+                    ? __launch[1] + get_group_id(0)
+                    : __launch[__CLPKM_LAUNCH_TABLE + get_group_id(0)];
+  * __group_id = __grp_id;
+  * __global_id = __grp_id * (* __group_size) + (* __local_id);
+  for (uint __d = 0; __d < __dim; ++__d) {
+    __num_grps[__d] = __launch[__CLPKM_LAUNCH_NUM_GRPS + __d];
+    __gwo[__d] = __launch[__CLPKM_LAUNCH_GWO + __d];
+    __grp_ids[__d] = __grp_id % __num_grps[__d];
+    __grp_id /= __num_grps[__d];
+  }
+}
+
+size_t __get_compact_linear_global_size(const size_t * __num_grps) {
+  uint   __dim = get_work_dim();
+  size_t __size = 1;
+  while (__dim-- > 0)
+    __size *= __num_grps[__dim] * get_local_size(__dim);
+  return __size;
+}
+
+size_t __clpkm_pick(const size_t * __val, size_t __default, uint __d) {
+  return (__d < get_work_dim()) ? __val[__d] : __default;
+}
+
+size_t __clpkm_global_id(const size_t * __grp_ids, const size_t * __gwo,
+                         uint __d) {
+  return __clpkm_pick(__grp_ids, 0, __d) * get_local_size(__d) +
+         get_local_id(__d) + __clpkm_pick(__gwo, 0, __d);
+}
+
+size_t __clpkm_global_size(const size_t * __num_grps, uint __d) {
+  return __clpkm_pick(__num_grps, 1, __d) * get_local_size(__d);
+}
+
+#define __clpkm_get_global_id(__d) \
+  __clpkm_global_id(__clpkm_grp_ids, __clpkm_gwo, (__d))
+#define __clpkm_get_global_size(__d) \
+  __clpkm_global_size(__clpkm_num_grps, (__d))
+#define __clpkm_get_group_id(__d) __clpkm_pick(__clpkm_grp_ids, 0, (__d))
+#define __clpkm_get_num_groups(__d) __clpkm_pick(__clpkm_num_grps, 1, (__d))
+#define __clpkm_get_global_offset(__d) __clpkm_pick(__clpkm_gwo, 0, (__d))
+
 //
 // CR-related stuff
 //
-#if 1
+// By default, slices are measured with the cycle counter of NVIDIA GPUs, and
+// __clpkm_tlv is in units of 1024 cycles
+// If CLPKM_SLICE_BY_COST is defined, they are measured with the cost estimated
+// by CLPKMCC instead, which works on all devices, and __clpkm_tlv is in units
+// of the cost model
+// If CLPKM_PREEMPT_BY_FLAG is defined, kernels are not sliced at all, but
+// checkpoint when the host raises __clpkm_flag, and __clpkm_tlv only controls
+// how often loops poll, in units of the cost model
+#if defined(CLPKM_PREEMPT_BY_FLAG)
+void __clpkm_init_cost_ctr(uint * __cost_ctr, const uint __clpkm_tlv) {
+  * __cost_ctr = 0;
+}
+void __clpkm_update_ctr(uint * __cost_ctr, uint __esti_cost) {
+}
+bool __clpkm_should_chkpnt(uint __cost_ctr, uint __clpkm_tlv,
+                           __global const volatile int * __clpkm_flag) {
+  return * __clpkm_flag != 0;
+}
+#elif !defined(CLPKM_SLICE_BY_COST)
 ulong clock64(void) {
   ulong __clock_val;
   asm volatile ("mov.u64 %0, %%clock64;"
@@ -151,15 +294,94 @@ ulong clock32_hi(void) {
                );
   return __clock_val;
 }
-#endif
 void __clpkm_init_cost_ctr(uint * __cost_ctr, const uint __clpkm_tlv) {
-  //* __cost_ctr = 0;
   * __cost_ctr = (uint)(clock64() >> 10);
 }
 void __clpkm_update_ctr(uint * __cost_ctr, uint __esti_cost) {
-  //* __cost_ctr += __esti_cost;
 }
-bool __clpkm_should_chkpnt(uint __cost_ctr, uint __clpkm_tlv) {
-  //return __cost_ctr > __clpkm_tlv;
+bool __clpkm_should_chkpnt(uint __cost_ctr, uint __clpkm_tlv,
+                           __global const volatile int * __clpkm_flag) {
   return ((uint)(clock64() >> 10) - __cost_ctr) > __clpkm_tlv;
 }
+#else
+void __clpkm_init_cost_ctr(uint * __cost_ctr, const uint __clpkm_tlv) {
+  * __cost_ctr = 0;
+}
+void __clpkm_update_ctr(uint * __cost_ctr, uint __esti_cost) {
+  * __cost_ctr += __esti_cost;
+}
+bool __clpkm_should_chkpnt(uint __cost_ctr, uint __clpkm_tlv,
+                           __global const volatile int * __clpkm_flag) {
+  return __cost_ctr > __clpkm_tlv;
+}
+#endif
+// Loops poll every (mask + 1) iterations
+// Polls are spaced about 1/16 of a slice apart, so that a slice overruns by no
+// more than that. The cost model roughly counts cycles, so a unit of
+// __clpkm_tlv in clock mode is taken as 1024 units of cost
+#define __CLPKM_MAX_POLL_MASK 1023
+uint __clpkm_poll_mask(uint __esti_cost, uint __clpkm_tlv) {
+#if !defined(CLPKM_SLICE_BY_COST) && !defined(CLPKM_PREEMPT_BY_FLAG)
+  ulong __budget = ((ulong) __clpkm_tlv << 10) >> 4;
+#else
+  ulong __budget = (ulong) __clpkm_tlv >> 4;
+#endif
+  ulong __iter = __budget / max(__esti_cost, 1u);
+  uint  __mask = 0;
+  while (__mask < __CLPKM_MAX_POLL_MASK && ((ulong) __mask + 1) * 2 <= __iter)
+    __mask = __mask * 2 + 1;
+  return __mask;
+}
+
+//
+// Runtime support kernels
+//
+// Summarize the header of a work-group per work-item, and let work-groups
+// blocked by the same barrier pass
+// __summary receives the number of unfinished and finished work-items,
+// whether some work-items reach different barriers, the number of unfinished
+// work-groups, and the bitwise NOT of the min and the max of their IDs, and
+// shall be zeroed
+// If __launch is not null, the IDs of unfinished work-groups are put into its
+// table for compact launch
+__kernel void __clpkm_reduce_header(__global int * __clpkm_metadata,
+                                    uint __hdr_offset, uint __grp_size,
+                                    __global uint * __summary,
+                                    __global uint * __launch) {
+  uint __grp = get_global_id(0);
+  __global int * __hdr = __clpkm_metadata + __hdr_offset +
+                         (size_t) __grp * __grp_size;
+  int  __tag = 0;
+  uint __blocked = 0;
+  uint __unfinished = 0;
+  int  __mismatch = 0;
+  for (uint __idx = 0; __idx < __grp_size; ++__idx) {
+    int __val = __hdr[__idx];
+    if (__val == 0)
+      continue;
+    ++__unfinished;
+    if (__val > 0)
+      continue;
+    if (__tag == 0)
+      __tag = __val;
+    else if (__tag != __val)
+      __mismatch = 1;
+    ++__blocked;
+  }
+  if (__blocked == __grp_size && !__mismatch) {
+    for (uint __idx = 0; __idx < __grp_size; ++__idx)
+      __hdr[__idx] = -__tag;
+  }
+  if (__unfinished > 0) {
+    atomic_add(&__summary[0], __unfinished);
+    uint __slot = atomic_inc(&__summary[3]);
+    atomic_max(&__summary[4], ~__grp);
+    atomic_max(&__summary[5], __grp);
+    if (__launch)
+      __launch[__CLPKM_LAUNCH_TABLE + __slot] = __grp;
+  }
+  if (__unfinished < __grp_size)
+    atomic_add(&__summary[1], __grp_size - __unfinished);
+  if (__mismatch)
+    atomic_or(&__summary[2], 1u);
+}
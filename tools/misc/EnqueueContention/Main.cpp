@@ -0,0 +1,164 @@
+/*
+  Enqueue contention benchmark, enqueuing tiny kernels from many threads at
+  once to measure how much time is spent in clEnqueueNDRangeKernel
+
+  Each thread has its own queue and kernel, so that any contention comes from
+  the runtime. E.g. 32 threads enqueuing 1000 kernels each:
+
+  $ g++ -std=c++17 -O2 -pthread Main.cpp -o EnqueueContention -lOpenCL
+  $ CLPKM_PRIORITY=low LD_PRELOAD=$HOME/CLPKM/runtime/libclpkm.so \
+    ./EnqueueContention 32 1000
+
+*/
+
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdlib>
+
+#include <CL/cl.h>
+
+
+
+#define OCL_ASSERT(Ret) do { \
+	cl_int __Ret = Ret; \
+	if (__Ret != CL_SUCCESS) { \
+		std::cerr << __FILE__ << ':' << __LINE__ << '(' << __func__ << ") got " \
+		          << __Ret << std::endl; \
+		std::abort(); \
+		} \
+	} while(0)
+
+
+using Milli = std::chrono::duration<double, std::milli>;
+
+const char* Source = R"(
+__kernel void Tiny(__global uint* Out, uint Num) {
+	uint foo = get_global_id(0);
+	for (uint i = 0; i < Num; ++i)
+		foo ^= i;
+	Out[get_global_id(0)] = foo;
+	}
+)";
+
+// Wait for the queue every so often, so that it doesn't grow unbounded
+constexpr size_t FinishInterval = 64;
+
+
+
+int main(int ArgCount, const char* ArgVar[]) {
+
+	if (ArgCount < 3) {
+		std::cerr << "Usage: " << ArgVar[0]
+		          << " <num-of-threads> <enqueues-per-thread> [<work-items>]"
+		          << std::endl;
+		return -1;
+		}
+
+	const size_t NumOfThread = std::stoul(ArgVar[1]);
+	const size_t NumOfEnqueue = std::stoul(ArgVar[2]);
+	const size_t NumOfItem = (ArgCount > 3) ? std::stoul(ArgVar[3]) : 256;
+
+	cl_platform_id Platform = nullptr;
+	cl_device_id   Device = nullptr;
+	cl_int Ret = CL_SUCCESS;
+
+	Ret = clGetPlatformIDs(1, &Platform, nullptr);
+	OCL_ASSERT(Ret);
+
+	Ret = clGetDeviceIDs(Platform, CL_DEVICE_TYPE_DEFAULT, 1, &Device, nullptr);
+	OCL_ASSERT(Ret);
+
+	cl_context Context = clCreateContext(nullptr, 1, &Device, nullptr, nullptr,
+	                                     &Ret);
+	OCL_ASSERT(Ret);
+
+	cl_program Program = clCreateProgramWithSource(Context, 1, &Source, nullptr,
+	                                               &Ret);
+	OCL_ASSERT(Ret);
+
+	Ret = clBuildProgram(Program, 1, &Device, "", nullptr, nullptr);
+	OCL_ASSERT(Ret);
+
+	// Time spent in clEnqueueNDRangeKernel per thread
+	std::vector<Milli> EnqueueTime(NumOfThread);
+	std::vector<std::thread> Threads;
+
+	auto Start = std::chrono::high_resolution_clock::now();
+
+	for (size_t Tid = 0; Tid < NumOfThread; ++Tid)
+		Threads.emplace_back([&, Tid] {
+
+			cl_int Ret = CL_SUCCESS;
+
+			cl_command_queue Queue = clCreateCommandQueue(Context, Device, 0, &Ret);
+			OCL_ASSERT(Ret);
+
+			cl_kernel Kernel = clCreateKernel(Program, "Tiny", &Ret);
+			OCL_ASSERT(Ret);
+
+			cl_mem Out = clCreateBuffer(Context, CL_MEM_WRITE_ONLY,
+			                            NumOfItem * sizeof(cl_uint), nullptr, &Ret);
+			OCL_ASSERT(Ret);
+
+			// Kept alive until the kernel is done, as CLPKM refers to it
+			const cl_uint Num = 16;
+
+			Ret = clSetKernelArg(Kernel, 0, sizeof(cl_mem), &Out);
+			OCL_ASSERT(Ret);
+			Ret = clSetKernelArg(Kernel, 1, sizeof(cl_uint), &Num);
+			OCL_ASSERT(Ret);
+
+			for (size_t Idx = 0; Idx < NumOfEnqueue; ++Idx) {
+				auto Before = std::chrono::high_resolution_clock::now();
+				Ret = clEnqueueNDRangeKernel(Queue, Kernel, 1, nullptr, &NumOfItem,
+				                             nullptr, 0, nullptr, nullptr);
+				EnqueueTime[Tid] += std::chrono::high_resolution_clock::now() - Before;
+				OCL_ASSERT(Ret);
+				if ((Idx + 1) % FinishInterval == 0)
+					OCL_ASSERT(clFinish(Queue));
+				}
+
+			OCL_ASSERT(clFinish(Queue));
+			OCL_ASSERT(clReleaseMemObject(Out));
+			OCL_ASSERT(clReleaseKernel(Kernel));
+			OCL_ASSERT(clReleaseCommandQueue(Queue));
+
+			});
+
+	for (auto& T : Threads)
+		T.join();
+
+	Milli Elapsed = std::chrono::high_resolution_clock::now() - Start;
+
+	Milli Total(0);
+	Milli Worst(0);
+
+	for (const auto& T : EnqueueTime) {
+		Total += T;
+		Worst = std::max(Worst, T);
+		}
+
+	const double NumOfCall = static_cast<double>(NumOfThread * NumOfEnqueue);
+
+	std::cout << "Threads:           " << NumOfThread << '\n'
+	          << "Enqueues:          " << NumOfThread * NumOfEnqueue << '\n'
+	          << "Elapsed:           " << Elapsed.count() << " ms\n"
+	          << "Enqueue/s:         " << NumOfCall / Elapsed.count() * 1000 << '\n'
+	          << "Mean enqueue call: " << Total.count() / NumOfCall * 1000
+	          << " us\n"
+	          << "Slowest thread:    " << Worst.count() << " ms in enqueue"
+	          << std::endl;
+
+	OCL_ASSERT(clReleaseProgram(Program));
+	OCL_ASSERT(clReleaseContext(Context));
+
+	return 0;
+
+	}
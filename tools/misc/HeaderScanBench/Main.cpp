@@ -0,0 +1,107 @@
+/*
+  Header scan benchmark, measuring the throughput of scanning the header on
+  the host with each implementation
+
+  E.g. scan a header of 16M work-items in work-groups of 256:
+
+  $ g++ -std=c++17 -O2 -pthread -I$HOME/CLPKM/runtime \
+    Main.cpp $HOME/CLPKM/runtime/HeaderScan.cpp -o HeaderScanBench
+  $ ./HeaderScanBench 16777216 256
+
+*/
+
+#include "HeaderScan.hpp"
+
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <cstdlib>
+
+
+
+using Second = std::chrono::duration<double>;
+
+int main(int ArgCount, const char* ArgVar[]) {
+
+	if (ArgCount < 3) {
+		std::cerr << "Usage: " << ArgVar[0]
+		          << " <num-of-work-items> <work-group-size> [<num-of-runs>]"
+		          << std::endl;
+		return -1;
+		}
+
+	const size_t NumOfThread = std::stoul(ArgVar[1]);
+	const size_t WorkGrpSize = std::stoul(ArgVar[2]);
+	const size_t NumOfRun = (ArgCount > 3) ? std::stoul(ArgVar[3]) : 20;
+	const size_t NumOfWorkGrp = NumOfThread / WorkGrpSize;
+
+	if (WorkGrpSize == 0 || NumOfThread % WorkGrpSize != 0) {
+		std::cerr << "The work-group size shall divide the number of work-items"
+		          << std::endl;
+		return -1;
+		}
+
+	// A mix of finished, checkpointed and blocked work-items
+	// No work-group is entirely blocked, so the header stays the same across
+	// runs
+	std::vector<cl_int> Header(NumOfThread);
+	std::mt19937 Gen(5566);
+	std::uniform_int_distribution<int> Dist(0, 3);
+
+	for (size_t GrpId = 0; GrpId < NumOfWorkGrp; ++GrpId) {
+		cl_int* First = Header.data() + GrpId * WorkGrpSize;
+		for (size_t Idx = 0; Idx < WorkGrpSize; ++Idx) {
+			switch (Dist(Gen)) {
+			case 0: First[Idx] = 0; break;
+			case 1: First[Idx] = 1; break;
+			case 2: First[Idx] = -2; break;
+			default: First[Idx] = 0x12345678; break;
+				}
+			}
+		First[0] = 1;
+		}
+
+	std::vector<cl_uint> Remaining(NumOfWorkGrp);
+	const double Bytes = static_cast<double>(NumOfThread) * sizeof(cl_int);
+
+	CLPKM::HeaderScanResult Baseline{};
+
+	for (auto ISA : {CLPKM::scan_isa::SCALAR, CLPKM::scan_isa::SSE2,
+	                 CLPKM::scan_isa::AVX2}) {
+
+		if (ISA > CLPKM::getScanISA())
+			continue;
+
+		for (bool Parallel : {false, true}) {
+
+			CLPKM::HeaderScanResult Result{};
+			auto Start = std::chrono::high_resolution_clock::now();
+
+			for (size_t Run = 0; Run < NumOfRun; ++Run)
+				Result = CLPKM::ScanHeader(Header.data(), NumOfWorkGrp, WorkGrpSize,
+				                           Remaining.data(), ISA, Parallel);
+
+			Second Elapsed = std::chrono::high_resolution_clock::now() - Start;
+
+			if (ISA == CLPKM::scan_isa::SCALAR && !Parallel)
+				Baseline = Result;
+			else if (Result.Progress != Baseline.Progress ||
+			         Result.NumOfRemaining != Baseline.NumOfRemaining ||
+			         Result.Mismatch != Baseline.Mismatch)
+				std::cerr << "Result differs from the scalar one!" << std::endl;
+
+			std::cout << CLPKM::getScanISAName(ISA)
+			          << (Parallel ? " parallel: " : ": ")
+			          << Bytes * NumOfRun / Elapsed.count() / 1e9 << " GB/s"
+			          << std::endl;
+
+			}
+
+		}
+
+	return 0;
+
+	}